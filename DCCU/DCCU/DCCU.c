@@ -1,1381 +1,10963 @@
-/* 
-  DCC Utility
-  (C) 2020-2022 Jac Goudsmit
-
-  This program converts MPP files from DCC-Studio to MP1 (MPEG 1 Layer 1)
-  and vice versa.
-
-  It was written as a console application for Windows 98.
-
-  Licensed under the MIT license. See the LICENSE file for licensing terms.
-*/
-
-#include <windows.h>
-#include <stdio.h>
-#include <malloc.h>
-#include <string.h>
-
-
-/////////////////////////////////////////////////////////////////////////////
-// MACROS
-/////////////////////////////////////////////////////////////////////////////
-
-
-// These buffer sizes can basically be anything but need to be at least the
-// size of the largest possible frame size.
-#define INPUT_BUFFER_SIZE (48000)       // One second of MP1 data
-#define OUTPUT_BUFFER_SIZE (48000)      // Same as input buffer size
-
-
-/////////////////////////////////////////////////////////////////////////////
-// TYPES
-/////////////////////////////////////////////////////////////////////////////
-
-
-//---------------------------------------------------------------------------
-// Types that evidently don't exist in early versions of the Windows SDK
-#ifndef _LPCBYTE_DEFINED
-#define _LPCBYTE_DEFINED
-typedef const BYTE *LPCBYTE;
-#endif
-
-
-//---------------------------------------------------------------------------
-// Enum type that corresponds to DCC-Studio file header value
-//
-// Do not change; these are used in MPP file headers and must correspond to
-// what DCC-Studio does.
-typedef enum RATEID_t
-{
-  RATEID_UNKNOWN = 0,                   // Used internally
-  RATEID_32000 = 32,                    // 32 kHz
-  RATEID_44100 = 44,                    // 44.1 kHz
-  RATEID_48000 = 48,                    // 48 kHz
-
-} RATEID;
-
-
-//---------------------------------------------------------------------------
-// Enum type for error codes
-typedef enum ERR_t
-{
-  ERR_OK = 0,                           // No problem
-  ERR_COMMAND,                          // Command line error
-  ERR_PARAMETER,                        // Internal parameter error
-  ERR_INTERNAL,                         // Internal error
-  ERR_MALLOC,                           // Allocation error
-  ERR_SYNC,                             // Input doesn't start with sync
-  ERR_INSUFFICIENT_DATA,                // Not enough input data
-  ERR_DATA_NOT_MPEG1,                   // Input is not MPEG1
-  ERR_DATA_NOT_LAYER1,                  // Input is not layer 1
-  ERR_DATA_NOT_384KBPS,                 // Input is not 384 kbps
-  ERR_DATA_BAD_CHANMODE,                // Mono is not supported by DCC
-  ERR_DATA_BAD_SAMPLERATE,              // Unsupported sample rate in input
-  ERR_SAMPLERATE_MISMATCH,              // Input rate doesn't match output
-  ERR_INPUT_FILE_NAME,                  // Input file name is invalid
-  ERR_INPUT_FILE_OPEN,                  // Couldn't open input file
-  ERR_INPUT_FILE_READ,                  // Error reading input file
-  ERR_INPUT_FILE_EOF,                   // End of input file reached
-  ERR_OUTPUT_FILE_EXISTS,               // Output file already exists
-  ERR_OUTPUT_FILE_OPEN,                 // Couldn't open output file
-  ERR_OUTPUT_FILE_WRITE,                // Error writing output file
-
-  ERR_NUM                               // (number of errors)
-} ERR;
-
-
-//---------------------------------------------------------------------------
-// Struct type representing the input stream
-typedef struct INPUTSTREAM_t
-{
-  // Handle for file operations
-  FILE             *fin;                // Input file handle
-
-  // The buffer is divided in three parts:
-  // - The start of the buffer is discardable data
-  // - This is followed by the current MPEG frame (or part of it)
-  // - The end of the buffer may be unusable data (e.g. past end of file)
-  UINT              startindex;         // Index to start of frame
-  UINT              endindex;           // Index to end of usable data
-
-  // When a valid frame of data is found in the input buffer,
-  // the following are set to the attributes of the frame.
-  RATEID            rateid;             // Sample rate
-  size_t            framesize;          // Frame size
-
-  // Statistics
-  UINT              numpaddingslots;    // Number of nozero padding slots
-
-  // The actual buffer follows the struct once it's allocated.
-  UINT              buffersize;         // Number of bytes in buffer
-  BYTE              buffer[0];          // Input buffer follows struct
-} INPUTSTREAM, *HINPUTSTREAM;
-
-
-typedef struct OUTPUTSTREAM_t
-{
-  CHAR              outname[MAX_PATH];     // MPP/MP1 file name for output
-  CHAR              trkfilename[MAX_PATH]; // TRK file name (long)
-  CHAR              lvlfilename[MAX_PATH]; // LVL file name (short)
-  FILE             *fout;               // Output file handle
-  FILE             *flvl;               // Level file handle
-  FILE             *ftrk;               // Track file handle
-  BOOL              is_mpp;             // TRUE=MPP FALSE=MP1
-  RATEID            rateid;             // Rate ID for MPP file
-  UINT32            numframes;          // Number of frames generated
-
-} OUTPUTSTREAM, *HOUTPUTSTREAM;
-
-
-/////////////////////////////////////////////////////////////////////////////
-// CODE
-/////////////////////////////////////////////////////////////////////////////
-
-
-//---------------------------------------------------------------------------
-// Get the extension of a file name
-//
-// Returns the location in the input string of the period in front of the
-// filename extension.
-//
-// If the name doesn't end in an extension, the function returns the location
-// of the end of the string.
-//
-// If the name includes a directory with a path with an extension, the
-// function handles this correctly.
-//
-// If the file name is NULL, the function returns NULL.
-LPCSTR                                  // Returns extension; NULL on error
-GetFileExtension(
-  LPCSTR filename,                      // Input file name
-  LPCSTR *pbasename)                    // Optional output base file name
-{
-  LPCSTR result = NULL;
-  LPCSTR basename = filename;
-
-  if (filename)
-  {
-    LPCSTR s;
-
-    for (s = filename; *s; s++)
-    {
-      if (*s == '.')
-      {
-        result = s;
-      }
-      else if ((*s == '\\') || (*s == '/') || (*s == ':'))
-      {
-        basename = s + 1;
-        result = NULL;
-      }
-    }
-
-    if (!result)
-    {
-      // If no period was found (or the last period appeared in front of
-      // a slash or backslash), return the end of the string
-      result = s;
-    }
-  }
-
-  if (pbasename)
-  {
-    *pbasename = basename;
-  }
-
-  return result;
-}
-
-
-//---------------------------------------------------------------------------
-// Replace the extension of a file if it matches
-//
-// Extension parameters to this function don't include the period.
-//
-// If the extension doesn't match, the input string is not copied to the
-// output buffer.
-BOOL                                    // Returns TRUE if replacement done
-ReplaceFileExtension(
-  LPCSTR filename,                      // Input filename
-  LPSTR outfilename,                    // Output filename (ok to use input)
-  LPCSTR matchext,                      // Input ext must be this (NULL=any)
-  LPCSTR replaceext,                    // Replace with this (NULL=no change)
-  BOOL shorten)                         // Generate short output file name
-{
-  BOOL result = TRUE;
-  LPCSTR extension = NULL;
-  LPCSTR basename = NULL;
-  UINT32 dirlen = 0;
-  UINT32 filelen = 0;
-  BOOL haveperiod = FALSE;
-
-  if (result)
-  {
-    // Make sure we have an input filename
-    if ((!filename) || (!*filename) || (!outfilename))
-    {
-      result = FALSE;
-    }
-  }
-
-  if (result)
-  {
-    extension = GetFileExtension(filename, &basename);
-
-    if (!extension)
-    {
-      // Something went wrong
-      result = FALSE;
-    }
-  }
-
-  if (result)
-  {
-    // Calculate the length of the directory and file name
-    dirlen = basename - filename;
-    filelen = extension - basename; // period excluded
-
-    // Move the extension pointer beyond the period if there is one
-    if (*extension == '.')
-    {
-      haveperiod = TRUE;
-      extension++;
-    }
-
-    // If a match string was given, check if the extension matches
-    if (matchext)
-    {
-      result = !stricmp(extension, matchext);
-    }
-  }
-
-  if (result)
-  {
-    if (replaceext || shorten)
-    {
-      LPSTR t = outfilename + dirlen;
-      LPCSTR s = filename + dirlen;
-      UINT32 i;
-
-      // Copy the directory name (if necessary)
-      if ((filename != outfilename) && (dirlen))
-      {
-        memcpy(outfilename, filename, dirlen);
-      }
-
-      // Copy the file name
-      // If we're in shortening mode, convert to upper case and skip spaces
-      for (i = 0; i < filelen; i++)
-      {
-        char c = *s;
-
-        if (shorten)
-        {
-          c = toupper(c);
-          if (c == ' ')
-          {
-            s++;
-            i++;
-            continue;
-          }
-        }
-
-        *t++ = c;
-        s++;
-
-        if ((shorten) && (t == outfilename + dirlen + 8))
-        {
-          break;
-        }
-      }
-
-      // Store terminator in case no extension will be added
-      *t = '\0';
-
-      // Choose the extension to copy
-      if ((replaceext) && (*replaceext))
-      {
-        s = replaceext;
-      }
-      else
-      {
-        s = extension;
-      }
-
-      // If there's no extension to append, we're done
-      if (*s)
-      {
-        // We have now copied the directory and the base name of the file.
-        // From this point on we may be making the output longer than
-        // the input. Make sure we don't overrun the buffer.
-        if ((t - outfilename) + 1 + strlen(s) > MAX_PATH - 1)
-        {
-          result = FALSE;
-        }
-        else
-        {
-          *t++ = '.';
-
-          strcpy(t, s); // Safe
-
-          if (shorten)
-          {
-            strupr(t);
-          }
-        }
-      }
-    }
-  }
-
-  return result;
-}
-
-
-//---------------------------------------------------------------------------
-// Check if file exists
-BOOL                                    // Returns nonzero if file exists
-FileExists(
-  LPCSTR filename)                      // File name
-{
-  BOOL result = FALSE;
-
-  if (filename)
-  {
-    FILE *fp = fopen(filename, "r");
-
-    if (fp)
-    {
-      fclose(fp);
-      result = TRUE;
-    }
-  }
-
-  return result;
-}
-
-
-//---------------------------------------------------------------------------
-// Determine MPEG-1 Layer 1 frame size based on header
-//
-// The frame must start with:
-// Index 0:
-// 8  bits sync (binary 11111111)                         - FF
-//
-// Index 1:
-// 4  bits sync (binary 1111)                             \
-// 1  bit  ID (1=MPEG)                                    | FF or FE
-// 2  bits layer (binary 11 for layer 1)                  |
-// 1  bit  protection (=CRC added after header) (1=no)    /
-//
-// Index 2:
-// 4  bits bit rate (1100 = 384kbps for layer 1)          \
-// 2  bits sample freq (00=44kHz 01=48kHz 10=32kHz 11=res)| C0/C2 (44.1)
-// 1  bit  indicates 44.1kHz frame is padded              | or C4 (48)
-// 1  bit  private bit (ignored)                          / or C6 (32)
-//
-// Index 3:
-// 2  bits mode (00=stereo 01=joint 10=2ch 11=res./mono)  \
-// 2  bits mode extension for joint stereo (ignored)      | Usually 0C
-// 1  bit  copyright protected (1=yes, 0=no) (ignored)    | or 00
-// 1  bit  original (1=original 0=copy) (ignored)         |
-// 2  bits emphasis (00=none 01=50/15us 10=res. 11=CCITT) /
-//
-// The total size of the frame including the header is
-// (48 * 384000 / samplerate). For 44.1 kHz this doesn't yield an integer
-// result, so some frames have 4 bytes extra data based on header[2] bit 2.
-ERR                                     // Returns error code
-GetFrameSize(
-  PBYTE frame,                          // Pointer to start of frame
-  UINT insize,                          // Number of available bytes
-  PUINT pframesize,                     // Output required frame size
-  PUINT pskipsize,                      // Output amount of input to skip
-  RATEID *prateid)                      // Output sample rate enum
-{
-  ERR result = ERR_OK;
-  UINT framesize = 0;
-  UINT skipsize = 0;
-  RATEID rateid = RATEID_UNKNOWN;
-
-  if (!result)
-  {
-    // The header must be at least 4 bytes
-    //
-    // If there's less data, read more from the input file.
-    if (insize < 4)
-    {
-      result = ERR_INSUFFICIENT_DATA;
-    }
-  }
-
-  if (!result)
-  {
-    // Check that frame[0] == 0b11111111
-    //
-    // The header must start with a sync word
-    if (frame[0] != 0xFF)
-    {
-      // Optimization: Look for an 0xFF byte in the rest of the buffer
-      for (skipsize = 1; skipsize < insize; skipsize++)
-      {
-        if (frame[skipsize] == 0xFF)
-        {
-          break;
-        }
-      }
-
-      result = ERR_SYNC;
-    }
-  }
-
-  if (!result)
-  {
-    // Check that frame[1] == 0b1111xxxx
-    //
-    // The header must start with a sync word
-    if ((frame[1] & 0xF0) != 0xF0)
-    {
-      skipsize = 2;
-      result = ERR_SYNC;
-    }
-  }
-
-  if (!result)
-  {
-    // Check that frame[1] == 0bxxxx1xxx
-    //
-    // We can only do MPEG 1
-    if ((frame[1] & 0x08) != 0x08)
-    {
-      skipsize = 2;
-      result = ERR_DATA_NOT_MPEG1;
-    }
-  }
-
-  if (!result)
-  {
-    // Check that frame[1] == 0bxxxxx11x
-    //
-    // We can only do layer 1
-    if ((frame[1] & 0x6) != 0x6)
-    {
-      skipsize = 2;
-      result = ERR_DATA_NOT_LAYER1;
-    }
-  }
-
-  // frame[1] bit 0 indicates whether a CRC follows the header (0) or not (1)
-  // We deal with that while copying the frame.
-
-  if (!result)
-  {
-    // Check that frame[2] == 0b1100xxxx
-    //
-    // The bit rate must be 384kbps
-    if ((frame[2] & 0xF0) != 0xC0)
-    {
-      skipsize = 3;
-      result = ERR_DATA_NOT_384KBPS;
-    }
-  }
-
-  // frame[2] bits 3-2 are the sample frequency, we'll get to those below.
-  // frame[2] bit  1 is the padding bit, also handled below.
-  // frame[2] bit  0 is the user bit and is ignored.
-
-  if (!result)
-  {
-    // Check that frame[3] == 0b11xxxxxx
-    //
-    // The channel mode cannot be 11 binary (mono).
-    // DCC doesn't support mono, only dual mono on prerecorded cassettes.
-    // TODO: We could change mono mode to stereo by duplicating the data.
-    if ((frame[3] & 0xC0) == 0xC0)
-    {
-      skipsize = 4; // TODO: Could skip (48 * 384000 / samplerate) / 2 ???
-      result = ERR_DATA_BAD_CHANMODE;
-    }
-  }
-
-  // frame[3] bits 5-4 are used for joint stereo encoding
-  // frame[3] bit  3 is copyright. TODO: Allow setting/clearing?
-  // frame[3] bit  2 is the copied-flag. TODO: Allow setting/clearing?
-  // frame[3] bits 1-0 are used for emphasis
-
-  if (!result)
-  {
-    // Evaluate frame[2] bits 3-2 (sample rate) and bit 1 (padding)
-    //
-    // The frame size in bytes is 48 * 384000 / samplerate according to the
-    // standard.
-    //
-    // For 44.1kHz frames, that calculation is not an integer so
-    // some frames are shorter and some are longer.
-    switch (frame[2] & 0x0C)
-    {
-    case 0x00:
-      rateid = RATEID_44100;
-      framesize = 416 + 4 * ((frame[2] & 0x2) != 0); // Padding is only used at 44.1.
-      break;
-
-    case 0x04:
-      rateid = RATEID_48000;
-      framesize = 384;
-      break;
-
-    case 0x08:
-      rateid = RATEID_32000;
-      framesize = 576;
-      break;
-
-    default:
-      result = ERR_DATA_BAD_SAMPLERATE;
-      break;
-    }
-  }
-
-  if (prateid)
-  {
-    *prateid = rateid;
-  }
-
-  if (pframesize)
-  {
-    *pframesize = framesize;
-  }
-
-  if (pskipsize)
-  {
-    *pskipsize = skipsize;
-  }
-
-  return result;
-}
-
-
-//---------------------------------------------------------------------------
-// Destroy an output stream
-void outputstream_Destroy(
-  HOUTPUTSTREAM hso)                    // Output stream handle
-{
-  if (hso)
-  {
-    if (hso->fout)
-    {
-      fclose(hso->fout);
-    }
-
-    if (hso->flvl)
-    {
-      static CHAR lvldata[MAX_PATH];
-      UINT32 u = hso->numframes;
-
-      // Use the file name as dummy data
-      strcpy(lvldata, hso->outname); // safe
-
-      for (;;)
-      {
-        UINT32 x = sizeof(lvldata) / 2; // number of frames in dummy pattern
-
-        if (u < x)
-        {
-          x = u;
-        }
-
-        if (!fwrite(lvldata, 2 * x, 1, hso->flvl)) // 2 bytes per frame
-        {
-          // TODO: Error
-          break;
-        }
-
-        if (!(u -= x))
-        {
-          break;
-        }
-      }
-
-      fclose(hso->flvl);
-    }
-
-    if (hso->ftrk)
-    {
-      LPCSTR basename;
-      LPCSTR extension = GetFileExtension(hso->outname, &basename);
-      LPCSTR longbasename;
-      LPCSTR longextension = GetFileExtension(hso->trkfilename, &longbasename);
-
-      if (extension && longextension)
-      {
-        UINT namelen = extension - basename;
-        UINT longnamelen = longextension - longbasename;
-
-        if (longnamelen > 40)
-        {
-          longnamelen = 40;
-        }
-
-        fprintf(hso->ftrk,
-          "A-IO"
-          "=5 Track{"
-            "%u \"%s\""                 // Artist name (length first)
-            "=5 Stack{"
-              "1 4 ["
-                "=8 Fragment{"
-                  "%u \"%.*s\""         // Filename (length first)
-                  "%u "                 // Number of frames
-                  "0 "                  // Skip this many frames at start?
-                "}"
-              "]"
-            "}"
-            "c1 {0 0 []}"
-            "%u "                       // sample rate ID
-            "%u \"%.*s\""               // Title (length first)
-            "%u "                       // Number of frames
-          "}",
-
-          4, "DCCU",                    // Artist name (TODO allow specifying from command line)
-          namelen, namelen, basename,   // File name
-          hso->numframes,               // Number of frames
-          hso->rateid,                  // Sample rate ID
-          longnamelen, longnamelen, longbasename, // Title (TODO allow specifying from command line)
-          hso->numframes                // Number of frames
-        );
-      }
-      else
-      {
-        // TODO: Something went wrong parsing the file name. This shouldn't happen
-      }
-
-      fclose(hso->ftrk);
-    }
-
-    free(hso);
-  }
-}
-
-
-//---------------------------------------------------------------------------
-// Create an output stream
-ERR
-outputstream_Create(
-  HOUTPUTSTREAM *phso,                  // Ptr to handle; must point to NULL
-  LPCSTR infilename,                      // File to open
-  BOOL is_mpp)                          // TRUE=MPP, FALSE=MP1
-{
-  ERR result = ERR_OK;
-  HOUTPUTSTREAM hs = NULL;
-
-  if (!result)
-  {
-    if ((!phso) || (*phso) || (!infilename) || (!*infilename))
-    {
-      result = ERR_PARAMETER;
-    }
-  }
-
-  if (!result)
-  {
-    if (!(hs = (HOUTPUTSTREAM)calloc(1, sizeof(OUTPUTSTREAM))))
-    {
-      result = ERR_MALLOC;
-    }
-  }
-
-  if (!result)
-  {
-    hs->is_mpp = is_mpp;
-    hs->rateid = RATEID_UNKNOWN;
-    hs->numframes = 0;
-
-    // Generate our file name(s) from the input file name
-    // And check that the output file doesn't exist
-    // TODO: fix copy/paste
-    if (is_mpp)
-    {
-      if ( (!result)
-        && ( (!ReplaceFileExtension(infilename, hs->outname, NULL, "MPP", TRUE))
-          || (FileExists(hs->outname))))
-      {
-        result = ERR_OUTPUT_FILE_EXISTS; // TODO: not always the correct error code
-      }
-
-      if ( (!result)
-        && ( (!ReplaceFileExtension(infilename, hs->trkfilename, NULL, "TRK", FALSE))
-          || (FileExists(hs->trkfilename))))
-      {
-        result = ERR_OUTPUT_FILE_EXISTS; // TODO: not always the correct error code
-      }
-
-      if ( (!result)
-        && ( (!ReplaceFileExtension(infilename, hs->lvlfilename, NULL, "LVL", TRUE))
-          || (FileExists(hs->lvlfilename))))
-      {
-        result = ERR_OUTPUT_FILE_EXISTS; // TODO: not always the correct error code
-      }
-    }
-    else
-    {
-      if ( (!result)
-        && ( (!ReplaceFileExtension(infilename, hs->outname, NULL, "MP1", FALSE))
-          || (FileExists(hs->lvlfilename))))
-      {
-        result = ERR_OUTPUT_FILE_EXISTS; // TODO: not always the correct error code
-      }
-    }
-  }
-
-  if (phso)
-  {
-    *phso = hs;
-  }
-
-  return result;
-}
-
-
-//---------------------------------------------------------------------------
-// Process a frame to an output stream
-ERR                                     // Returns error code
-outputstream_ProcessFrame(
-  HOUTPUTSTREAM hso,                    // Output stream handle
-  LPCBYTE buffer,                       // Frame to write
-  size_t framesize,                     // Size of frame in bytes
-  RATEID rateid)                        // Rate ID of frame
-{
-  ERR result = ERR_OK;
-
-  if (!result)
-  {
-    if ((!hso) || (!buffer) || (rateid == RATEID_UNKNOWN))
-    {
-      result = ERR_PARAMETER;
-    }
-  }
-
-  if (!result)
-  {
-    // If the file(s) isn't/aren't open yet, open it/them now
-    if (!hso->fout)
-    {
-      if (!(hso->fout = fopen(hso->outname, "wb")))
-      {
-        result = ERR_OUTPUT_FILE_OPEN;
-      }
-      else
-      {
-        // The file was opened successfully and we're at the start of it.
-        if (hso->is_mpp)
-        {
-          // MPP files need a two byte header representing the sample
-          // frequency so that DCC-Studio can seek in the file
-          BYTE header[2];
-
-          header[0] = (BYTE)rateid;
-          header[1] = 0;
-
-          if (!fwrite(header, sizeof(header), 1, hso->fout))
-          {
-            result = ERR_OUTPUT_FILE_WRITE;
-          }
-          else
-          {
-            hso->rateid = rateid;
-          }
-
-          if (!result)
-          {
-            // Generate a .TRK file too
-            hso->ftrk = fopen(hso->trkfilename, "w");
-            if (!hso->ftrk)
-            {
-              result = ERR_OUTPUT_FILE_OPEN;
-            }
-          }
-
-          if (!result)
-          {
-            // Generate an LVL file too
-            hso->flvl = fopen(hso->lvlfilename, "wb");
-            if (!hso->flvl)
-            {
-              result = ERR_OUTPUT_FILE_OPEN;
-            }
-          }
-        }
-      }
-    }
-  }
-
-  if (!result)
-  {
-    // Make sure the rate ID hasn't changed
-    if (rateid != hso->rateid)
-    {
-      // MPP files can only have a single sample rate. For MP1 files,
-      // changing the sample rate is okay.
-      if (hso->is_mpp)
-      {
-        // TODO: Instead of returning an error, start a new MPP output file
-        result = ERR_SAMPLERATE_MISMATCH;
-      }
-    }
-  }
-
-  if (!result)
-  {
-    // Write the buffer
-    if (!fwrite(buffer, framesize, 1, hso->fout))
-    {
-      result = ERR_OUTPUT_FILE_WRITE;
-    }
-    else
-    {
-      // Write extra padding if necessary
-      // This is only necessary for 44.1kHz in MPP files:
-      // At 44.1kHz, the frame size can be 416 or 420 bytes because the
-      // bit rate is not evenly divisible by the sample rate. DCC-Studio
-      // pretends that all frames are 420 bytes to make it easier to seek
-      // in the MPP file. We need to mimic that behavior.
-      if ((hso->is_mpp) && (rateid == RATEID_44100) && (framesize == 416))
-      {
-        const static BYTE padding[4] = { 0 };
-
-        if (!fwrite(padding, sizeof(padding), 1, hso->fout))
-        {
-          result = ERR_OUTPUT_FILE_WRITE;
-        }
-      }
-    }
-  }
-
-  if (!result)
-  {
-    // TODO: This could overflow but by the time that happens, DCC-Studio
-    // TODO:   probably won't be able to read the file anyway because of
-    // TODO:   other limitations such as a maximum file size of 2^32.
-    hso->numframes++;
-  }
-
-  return result;
-}
-
-
-//---------------------------------------------------------------------------
-// Destroy input stream
-void
-inputstream_Destroy(
-  HINPUTSTREAM hsi)                     // Input stream handle
-{
-  if (hsi)
-  {
-    if (hsi->fin)
-    {
-      fclose(hsi->fin);
-    }
-
-    free(hsi);
-  }
-}
-
-
-//---------------------------------------------------------------------------
-// Create input stream
-ERR                                     // Returns error code
-inputstream_Create(
-  HINPUTSTREAM *phsi,                   // Ptr to handle; must point to NULL
-  LPCSTR filename,                      // File to open
-  size_t buffersize)                    // Buffer size in bytes
-{
-  ERR result = ERR_OK;
-  HINPUTSTREAM hs = NULL;
-
-  if (!result)
-  {
-    if ((!phsi) || (!filename) || (!buffersize) || (*phsi))
-    {
-      result = ERR_PARAMETER;
-    }
-  }
-
-  if (!result)
-  {
-    if (!(hs = (HINPUTSTREAM)calloc(1, sizeof(INPUTSTREAM) + buffersize)))
-    {
-      result = ERR_MALLOC;
-    }
-  }
-
-  if (!result)
-  {
-    // Initialize file handle
-    if (!(hs->fin = fopen(filename, "rb")))
-    {
-      result = ERR_INPUT_FILE_OPEN;
-    }
-  }
-
-  if (!result)
-  {
-    // Initialize other members. Yes this is redundant after calloc but these
-    // explicit initializations will show future programmers that we know
-    // what we're doing.
-    hs->startindex = 0;
-    hs->endindex   = 0;
-    hs->rateid     = RATEID_UNKNOWN;
-    hs->framesize  = 0;
-
-    hs->buffersize = buffersize;
-  }
-
-  if (result)
-  {
-    // If something went wrong, destroy the instance
-    inputstream_Destroy(hs);
-    hs = NULL;
-  }
-
-  // Feedback
-  if (phsi)
-  {
-    *phsi = hs;
-  }
-
-  return result;
-}
-
-
-//---------------------------------------------------------------------------
-// Read data into the input buffer if possible
-ERR                                     // Returns error code
-inputstream_ReadFile(
-  HINPUTSTREAM hsi)                     // Input stream handle
-{
-  ERR result = ERR_OK;
-
-  if (!result)
-  {
-    if (!hsi)
-    {
-      result = ERR_PARAMETER;
-    }
-  }
-
-  if (!result)
-  {
-    // If there is any data in the buffer that hasn't been processed yet,
-    // move it to the start of the buffer, overwriting any data that was
-    // already processed before.
-    if (hsi->startindex)
-    {
-      // The data doesn't start at the top of the buffer so it may need to be
-      // moved.
-      if (hsi->endindex != hsi->startindex)
-      {
-        // There is unprocessed data in the buffer. Move it to the top.
-        memmove(hsi->buffer, hsi->buffer + hsi->startindex, hsi->endindex - hsi->startindex);
-        hsi->endindex -= hsi->startindex;
-      }
-      else
-      {
-        // The unprocessed data has zero length.
-        // So to move it to the start of the buffer, all we need to do is reset
-        // the index.
-        hsi->endindex = 0;
-      }
-
-      // The start of the unused data is now at the top of the buffer so reset
-      // the index.
-      hsi->startindex = 0;
-    }
-  }
-
-  // At this point, the buffer starts with unprocessed data and ends with
-  // space for new data.
-
-  if (!result)
-  {
-    // Make sure we have buffer space available to read data, otherwise
-    // we'll end up in an infinite loop.
-    if (hsi->endindex == hsi->buffersize)
-    {
-      result = ERR_INTERNAL;
-    }
-  }
-
-  if (!result)
-  {
-    size_t read_length;
-
-    // Read data starting at the end of the unhandled bytes
-    read_length = fread(hsi->buffer + hsi->endindex, 1, hsi->buffersize - hsi->endindex, hsi->fin);
-    hsi->endindex += read_length;
-
-    if (!read_length)
-    {
-      result = (ferror(hsi->fin) ? ERR_INPUT_FILE_READ : ERR_INPUT_FILE_EOF);
-    }
-  }
-
-  // TODO: At this point, if we have just read the first two bytes of an
-  // TODO:   .MPP file, we could check if the first byte is a valid rate
-  // TODO:   ID, and compare it to the following frames. DCC-Studio will
-  // TODO:   happily read tapes with mixed sample rates and store them in
-  // TODO:   a single .MPP file but it stores the last encountered sample
-  // TODO:   rate in the header of the file, which makes it almost always
-  // TODO:   impossible to play the track from the hard disk or record it
-  // TODO:   back to tape, since DCC-Studio will incorrectly calculate the
-  // TODO:   offset of each frame based on the ID at the start of the file.
-  // TODO:   We will eventually do the right thing (i.e. track the sample
-  // TODO:   rate from the frames, not the header, and split files between
-  // TODO:   sample rates), and this is a rare occurrence anyway, so it's
-  // TODO:   not really that important.
-
-  return result;
-}
-
-
-//---------------------------------------------------------------------------
-// Copy a frame from the input stream to the output stream if possible
-ERR                                     // Returns error code
-inputstream_CopyFrame(
-  HINPUTSTREAM hsi,                     // Input stream handle
-  HOUTPUTSTREAM hso)                    // Output stream handle
-{
-  ERR result = ERR_OK;
-
-  if (!result)
-  {
-    if (!hsi)
-    {
-      result = ERR_PARAMETER;
-    }
-  }
-
-  if (!result)
-  {
-    // If we don't have a framesize yet, see if we can calculate it now.
-    if (!hsi->framesize)
-    {
-      for(;;)
-      {
-        UINT skipsize;
-
-        result = GetFrameSize(hsi->buffer + hsi->startindex, hsi->endindex - hsi->startindex, &hsi->framesize, &skipsize, &hsi->rateid);
-
-        if ( (result == ERR_SYNC)
-          || (result == ERR_DATA_NOT_MPEG1)
-          || (result == ERR_DATA_NOT_LAYER1)
-          || (result == ERR_DATA_NOT_384KBPS)
-          || (result == ERR_DATA_BAD_CHANMODE))
-        {
-          if (!skipsize)
-          {
-            skipsize = 1;
-          }
-
-          // Skip unusable data if possible
-          if ((hsi->startindex + skipsize) <= hsi->endindex)
-          {
-            hsi->startindex += skipsize;
-            continue;
-          }
-          else
-          {
-            // Need more input
-            result = ERR_INSUFFICIENT_DATA;
-          }
-        }
-
-        break;
-      }
-    }
-  }
-
-  if (!result)
-  {
-    // Check if we finally have a frame size
-    if (!hsi->framesize)
-    {
-      result = ERR_INSUFFICIENT_DATA;
-    }
-  }
-
-  if (!result)
-  {
-    // Check if the entire frame is in the buffer
-    if (hsi->endindex - hsi->startindex < hsi->framesize)
-    {
-      result = ERR_INSUFFICIENT_DATA;
-    }
-  }
-
-  if (!result)
-  {
-    // Remove optional CRC
-    if ((hsi->buffer[hsi->startindex + 1] & 0x1) != 0x1)
-    {
-      // Change the header to indicate there's no CRC anymore
-      hsi->buffer[hsi->startindex + 1] |= 0x1;
-
-      // Overwrite the CDC with the data that follows it
-      memmove(hsi->buffer + hsi->startindex + 4, hsi->buffer + hsi->startindex + 6, hsi->framesize - 6);
-
-      // Clear the last two bytes
-      hsi->buffer[hsi->startindex + hsi->framesize - 2] = 0;
-      hsi->buffer[hsi->startindex + hsi->framesize - 1] = 0;
-    }
-  }
-
-  if (!result)
-  {
-    // If there's a padding slot, make sure it doesn't contain any data
-    // if writing to MPP.
-    // The DCC System Description describes padding slots as "dummy",
-    // implying that the slot must be blank.
-    if ((hso->is_mpp) && (hsi->framesize == 420))
-    {
-      DWORD *ppaddingslot = (DWORD *)(hsi->buffer + hsi->startindex + 416);
-
-      // Check if there's any data in the padding slot.
-      if (*ppaddingslot != 0)
-      {
-        hsi->numpaddingslots++;
-      }
-
-      *ppaddingslot = 0;
-    }
-  }
-
-  if (!result)
-  {
-    // Call the output function to process the frame.
-    result = outputstream_ProcessFrame(hso, hsi->buffer + hsi->startindex, hsi->framesize, hsi->rateid);
-  }
-
-  if (!result)
-  {
-    // Remove the frame from the input buffer
-    hsi->startindex += hsi->framesize;
-    hsi->framesize = 0;
-    hsi->rateid = RATEID_UNKNOWN;
-  }
-
-  return result;
-}
-
-
-//---------------------------------------------------------------------------
-// Process input file
-ERR                                     // Returns error code
-ProcessFile(
-  LPCSTR infilename,                    // Input file name
-  BOOL output_is_mpp)                   // TRUE=Generate MPP file
-{
-  ERR result = ERR_OK;
-  HINPUTSTREAM hsi = NULL;
-  HOUTPUTSTREAM hso = NULL;
-
-  if (!result)
-  {
-    if ((!infilename) || (!*infilename))
-    {
-      result = ERR_PARAMETER;
-    }
-  }
-
-  if (!result)
-  {
-    result = inputstream_Create(&hsi, infilename, INPUT_BUFFER_SIZE);
-  }
-
-  if (!result)
-  {
-    result = outputstream_Create(&hso, infilename, output_is_mpp);
-  }
-
-  if (!result)
-  {
-    ERR inresult  = ERR_OK;
-    ERR outresult = ERR_OK;
-
-    fprintf(stderr, "Processing %s\n", infilename);
-
-    while ((!inresult) && (!outresult))
-    {
-      BOOL eof = FALSE;
-
-      inresult = inputstream_ReadFile(hsi);
-      if (inresult == ERR_INPUT_FILE_EOF)
-      {
-        eof = TRUE;
-        inresult = ERR_OK;
-        break;
-      }
-
-      while (!outresult)
-      {
-        static UINT32 timestamp;
-
-        outresult = inputstream_CopyFrame(hsi, hso);
-        if (outresult == ERR_INSUFFICIENT_DATA)
-        {
-          outresult = ERR_OK;
-          break;
-        }
-
-        if (GetTickCount() - timestamp > 1000)
-        {
-          timestamp = GetTickCount();
-          fprintf(stderr, "%u frame%s\r",
-            hso->numframes,
-            (hso->numframes == 1 ? "" : "s"));
-        }
-      }
-
-      if (eof)
-      {
-        break;
-      }
-    }
-
-    fprintf(stderr, "%u frame%s DONE%s\n", 
-      hso->numframes,
-      (hso->numframes == 1 ? "" : "s"),
-      (hsi->numpaddingslots ? " (NOTE: nonzero padding slots detected and cleared)" : ""));
-
-    if (inresult)
-    {
-      result = inresult;
-    }
-    else if (outresult)
-    {
-      result = outresult;
-    }
-  }
-
-  outputstream_Destroy(hso);
-  inputstream_Destroy(hsi);
-
-  return result;
-}
-
-
-//---------------------------------------------------------------------------
-// Main program
-int main(int argc, char *argv[])
-{
-  int result = 0;
-
-  fprintf(stderr, 
-    "DCCU File Conversion Utility for DCC-Studio\n"
-    "Version 3.4\n"
-    "(C) 2020-2022 Jac Goudsmit\n"
-    "Licensed under the MIT license.\n"
-    "\n");
-
-  if (argc < 2)
-  {
-    fprintf(stderr, 
-      "This program converts MPP files (used by DCC-Studio) to MP1 (MPEG 1 Layer 1)\n"
-      "and vice versa.\n"
-      "\n"
-      "Syntax: DCCU inputfile [inputfile...]\n"
-      "\n"
-      "You can convert multiple files at a time by putting multiple file names on\n"
-      "the command line. The output file name(s) is/are generated from the input\n"
-      "file names by changing the file extension from \".MPP\" to \".MP1\" or\n"
-      "from \".MP1\" to \".MPP\".\n"
-      "\n"
-      "When converting to .MPP, the program also generates a .LVL and a .TRK file.\n"
-      "Those are necessary to import the audio into the DCC-Studio. However,\n"
-      "because DCCU is not an MP1 decoder, it has to put dummy information into\n"
-      "the .LVL file. As a result, you won't see the actual audio levels in the\n"
-      "DCC Studio wave editor unless you record the track to tape first, and\n"
-      "then copy it back to hard disk again.\n"
-      "\n"
-      "When converting a 44.1 kHz .MP1 file to .MPP, the program checks for padding\n"
-      "slots that aren't blank. Padding slots occur in the audio stream because\n"
-      "384000 / 44100 is not an integer. In a 44.1 kHz PASC/MP1 stream, 24 out of\n"
-      "every 49 frames have an extra slot (105 slots instead of 104 slots per\n"
-      "frame). In MP1, that slot may contain audio data, however in PASC the padding\n"
-      "slot is a dummy slot and must be blank to avoid decoding problems. The program\n"
-      "clears the padding slot and notes in the output that it happened, because\n"
-      "the audio data was changed and a minor amount of audio accuracy may have been\n"
-      "lost at the highest frequencies.\n"
-      "\n");
-
-    result = ERR_COMMAND;
-  }
-
-  if (!result)
-  {
-    int i;
-
-    for (i = 1; i < argc; i++)
-    {
-      ERR loopresult = ERR_OK;
-      LPCSTR inputfilename = argv[i];
-      BOOL output_is_mpp = FALSE;
-
-      if (!loopresult)
-      {
-        if (!*inputfilename)
-        {
-          loopresult = ERR_INPUT_FILE_NAME;
-        }
-      }
-
-      if (!loopresult)
-      {
-        LPCSTR extension = GetFileExtension(inputfilename, NULL);
-
-        if (extension)
-        {
-          if (!stricmp(extension, ".MP1"))
-          {
-            output_is_mpp = TRUE;
-          }
-          else if (!stricmp(extension, ".MPP"))
-          {
-            // Nothing to do
-          }
-          else
-          {
-            // Filename extension not recognized
-            loopresult = ERR_INPUT_FILE_NAME;
-          }
-        }
-        else
-        {
-          // File name has no extension
-          loopresult = ERR_INPUT_FILE_NAME;
-        }
-      }
-
-      if (!loopresult)
-      {
-        // We have an input file name and we know
-        // if we are creating an MPP file. Let's go!
-        loopresult = ProcessFile(inputfilename, output_is_mpp);
-      }
-
-      if (loopresult)
-      {
-        // TODO: print error message
-        fprintf(stderr, "Error %u processing file %s\n", loopresult, inputfilename);
-
-        // Set result to first error that appeared
-        if (!result)
-        {
-          result = loopresult;
-        }
-      }
-    } // for
-  }
-
-  return result;
-}
-
-
-/////////////////////////////////////////////////////////////////////////////
-// END
-/////////////////////////////////////////////////////////////////////////////
+/* 
+  DCC Utility
+  (C) 2020-2022 Jac Goudsmit
+
+  This program converts MPP files from DCC-Studio to MP1 (MPEG 1 Layer 1)
+  and vice versa.
+
+  It was written as a console application for Windows 98.
+
+  Licensed under the MIT license. See the LICENSE file for licensing terms.
+*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <io.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <process.h>
+#include <string.h>
+#include <math.h>
+
+// SIMD instruction sets are only used if the compiler is told that it can
+// use them (e.g. /arch:SSE2 or /arch:AVX2, or when compiling for x64).
+// The default build for Windows 98 doesn't use them.
+#if defined(__AVX2__)
+#define DCCU_AVX2
+#include <immintrin.h>
+#endif
+
+#if defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define DCCU_SSE2
+#include <emmintrin.h>
+#endif
+
+
+/////////////////////////////////////////////////////////////////////////////
+// MACROS
+/////////////////////////////////////////////////////////////////////////////
+
+
+// These buffer sizes can basically be anything but need to be at least the
+// size of the largest possible frame size.
+//
+// The output buffer is written to the file whenever it's full, so it
+// should be a multiple of the cluster size of the disk. The size can be
+// changed from the command line.
+#define INPUT_BUFFER_SIZE (48000)       // One second of MP1 data
+#define OUTPUT_BUFFER_SIZE (1024 * 1024) // Default output buffer size
+#define MIN_OUTPUT_BUFFER_SIZE (4096)   // Minimum output buffer size
+#define LVL_BUFFER_SIZE (4096)          // Buffer for LVL file (2 per frame)
+
+// File name on the command line that stands for standard input. The
+// output goes to standard output, and the --to option tells what kind of
+// data it is.
+#define STDIO_FILENAME "-"
+
+// Highest number that's added to a short file name to make it unique
+// (e.g. MYRECO~1.MPP). The base name keeps at least 2 characters.
+#define MAX_SHORT_NAME_NUMBER (99999)
+
+// The cache (see --cache) recognizes changed source files by a hash of
+// their contents, which is calculated in blocks of this size (see
+// FILEHASH). It must be a multiple of 8, and of the allocation granularity
+// of memory mapped views so that parts of a file can be hashed separately.
+#define CACHE_HASH_BLOCK_SIZE (65536)
+
+// Maximum number of worker threads (limited by WaitForMultipleObjects)
+#define MAX_THREADS (MAXIMUM_WAIT_OBJECTS)
+
+// Number of samples per channel in a Layer 1 frame, and the size of the
+// largest frame that DCC uses (384kbps at 32kHz)
+#define SAMPLES_PER_FRAME (384)
+#define MAX_FRAME_SIZE (576)
+
+// Size of the WAV file header
+#define WAV_HEADER_SIZE (44)
+
+// Not all versions of math.h define this
+#define DCCU_PI (3.14159265358979323846)
+
+// Minimum number of frames in each part of an MPP file that's converted
+// by multiple threads (10000 frames is about 80 seconds of audio).
+// Smaller files aren't worth the trouble of splitting them up.
+#define MIN_PART_FRAMES (10000)
+
+// The header table is indexed by the bits of the header that matter to
+// DCC: all bits of byte 1, bits 7-1 of byte 2, and one bit that indicates
+// whether byte 3 has the mono channel mode. The sync byte (byte 0) is
+// checked separately.
+#define HEADER_TABLE_SIZE (0x10000)
+#define HEADER_KEY(p) (((UINT)(p)[1] << 8) | ((p)[2] & 0xFE) | ((((p)[3] & 0xC0) + 0x40) >> 8))
+
+// When the input file can be memory mapped, this is the size of the window
+// into the file that's mapped at any time. Mapping the entire file at once
+// is not an option for files of several GB in a 32-bit address space.
+// This must be much larger than the allocation granularity of the system
+// (usually 64KB) plus the size of the largest possible frame.
+#define INPUT_VIEW_SIZE (16 * 1024 * 1024)
+
+// With --pipeline, the input file is read by a reader thread and the output
+// file is written by a writer thread. They're connected to the conversion
+// by rings of buffers (see RING). The input buffers are large so that the
+// reader thread reads the file in large blocks; the output buffers have
+// the size of the output buffer (see --buffer).
+#define RING_BUFFERS (4)                // Number of buffers in a ring
+#define READER_BUFFER_SIZE (1024 * 1024) // Size of reader thread buffers
+
+// Functions that are generated for constant parameters (see
+// DEFINE_COPYFRAMES) must be inlined into each caller, so that the
+// compiler can leave out the code that doesn't apply.
+#if defined(_MSC_VER)
+#define DCCU_FORCEINLINE static __forceinline
+#else
+#define DCCU_FORCEINLINE static __inline__ __attribute__((always_inline))
+#endif
+
+
+/////////////////////////////////////////////////////////////////////////////
+// TYPES
+/////////////////////////////////////////////////////////////////////////////
+
+
+//---------------------------------------------------------------------------
+// Types that evidently don't exist in early versions of the Windows SDK
+#ifndef _LPCBYTE_DEFINED
+#define _LPCBYTE_DEFINED
+typedef const BYTE *LPCBYTE;
+#endif
+
+
+//---------------------------------------------------------------------------
+// Enum type that corresponds to DCC-Studio file header value
+//
+// Do not change; these are used in MPP file headers and must correspond to
+// what DCC-Studio does.
+typedef enum RATEID_t
+{
+  RATEID_UNKNOWN = 0,                   // Used internally
+  RATEID_32000 = 32,                    // 32 kHz
+  RATEID_44100 = 44,                    // 44.1 kHz
+  RATEID_48000 = 48,                    // 48 kHz
+
+} RATEID;
+
+
+//---------------------------------------------------------------------------
+// Enum type for error codes
+typedef enum ERR_t
+{
+  ERR_OK = 0,                           // No problem
+  ERR_COMMAND,                          // Command line error
+  ERR_PARAMETER,                        // Internal parameter error
+  ERR_INTERNAL,                         // Internal error
+  ERR_MALLOC,                           // Allocation error
+  ERR_SYNC,                             // Input doesn't start with sync
+  ERR_INSUFFICIENT_DATA,                // Not enough input data
+  ERR_DATA_NOT_MPEG1,                   // Input is not MPEG1
+  ERR_DATA_NOT_LAYER1,                  // Input is not layer 1
+  ERR_DATA_NOT_384KBPS,                 // Input is not 384 kbps
+  ERR_DATA_BAD_CHANMODE,                // Mono is not supported by DCC
+  ERR_DATA_BAD_SAMPLERATE,              // Unsupported sample rate in input
+  ERR_SAMPLERATE_MISMATCH,              // Input rate doesn't match output
+  ERR_INPUT_FILE_NAME,                  // Input file name is invalid
+  ERR_INPUT_FILE_OPEN,                  // Couldn't open input file
+  ERR_INPUT_FILE_READ,                  // Error reading input file
+  ERR_INPUT_FILE_EOF,                   // End of input file reached
+  ERR_OUTPUT_FILE_EXISTS,               // Output file already exists
+  ERR_OUTPUT_FILE_OPEN,                 // Couldn't open output file
+  ERR_OUTPUT_FILE_WRITE,                // Error writing output file
+  ERR_INDEX_INVALID,                    // Index file damaged or outdated
+  ERR_TRACK_FILE,                       // TRK file has no usable fragments
+  ERR_CACHE_INVALID,                    // Cache file damaged
+
+  ERR_NUM                               // (number of errors)
+} ERR;
+
+
+//---------------------------------------------------------------------------
+// Struct type with decoded header information
+//
+// These are stored in the header table, so they're kept as small as
+// possible.
+typedef struct HEADERINFO_t
+{
+  BYTE              err;                // Error code (ERR)
+  BYTE              flags;              // Skip size and flags, see below
+  BYTE              rateid;             // Sample rate (RATEID)
+  BYTE              numslots;           // Frame size in 4-byte slots
+
+} HEADERINFO;
+
+#define HEADERINFO_SKIPMASK (0x07)      // Minimum skip size if sync lost
+#define HEADERINFO_CRC      (0x80)      // A CRC follows the header
+
+
+//---------------------------------------------------------------------------
+// Struct type for a run of frames in a frame index
+//
+// The frames in a segment follow each other without gaps, and they all
+// have the same size, except for the padding slot.
+typedef struct FRAMESEGMENT_t
+{
+  UINT64            offset;             // File offset of first frame
+  UINT32            firstframe;         // Number of first frame
+  UINT32            framesize;          // Frame size without padding slot
+
+} FRAMESEGMENT;
+
+
+//---------------------------------------------------------------------------
+// Struct type for a frame index
+//
+// The index has the file offset of every frame in an MP1 file, so that
+// any frame can be found without scanning the file. At 44.1kHz, frames
+// are 416 or 420 bytes depending on whether they have a padding slot, so
+// the index has a bitmap with one bit per frame that indicates the
+// padding slot. A new segment is only started when a frame isn't where
+// the previous frame ends (e.g. after garbage or a sample rate change),
+// so normally the entire file is a single segment.
+typedef struct FRAMEINDEX_t
+{
+  // Identification of the indexed file; when it changes, the index
+  // is no longer valid
+  UINT64            filesize;           // Size of indexed file
+  UINT64            filetime;           // Last write time of indexed file
+
+  UINT32            numframes;          // Number of frames
+  UINT32            numsegments;        // Number of segments
+  UINT32            maxframes;          // Number of bits in bitmap
+  UINT32            maxsegments;        // Number of allocated segments
+  UINT64            nextoffset;         // File offset after last frame
+  UINT32           *padding;            // Bitmap of padded frames
+  UINT32           *padcount;           // Padded frames before each word
+  FRAMESEGMENT     *segments;           // Segments
+
+} FRAMEINDEX, *HFRAMEINDEX;
+
+
+//---------------------------------------------------------------------------
+// Struct type for the names of the files in a directory
+//
+// The names are kept in a hash table with open addressing (see
+// nameindex_Find). The table is never more than half full. Each name is
+// stored behind a flag byte that's TRUE if the name was reserved by the
+// batch (see nameindex_Reserve), or FALSE if the file was already in the
+// directory.
+typedef struct NAMEDIR_t
+{
+  struct NAMEDIR_t *next;               // Next directory in the index
+  LPSTR            *names;              // Hash table of flag+name; NULL=free
+  UINT              numnames;           // Number of names in table
+  UINT              maxnames;           // Size of table (power of 2)
+  CHAR              dirname[0];         // Directory name follows struct
+
+} NAMEDIR;
+
+
+//---------------------------------------------------------------------------
+// Struct type for an index of the file names in the output directories
+//
+// The names of the files in a directory are read once per batch, when
+// the first output file in that directory is named. After that, output
+// file names are checked against the index instead of the disk. The names
+// that the batch is going to use are added to the index, so that two
+// jobs never get the same output file name.
+typedef struct NAMEINDEX_t
+{
+  NAMEDIR          *dirs;               // Directories that were read
+  CRITICAL_SECTION  lock;               // Lock for the index
+
+} NAMEINDEX, *HNAMEINDEX;
+
+
+//---------------------------------------------------------------------------
+// Struct type for the hash of the contents of a file, for the cache
+//
+// The file is hashed in blocks of CACHE_HASH_BLOCK_SIZE bytes, and the
+// hashes of the blocks are mixed with their block numbers and added up.
+// That way, the parts of a file can be hashed separately (see
+// MppPart_Run) and added up afterwards. The data can be passed in pieces
+// of any size, as it's read for the conversion (see filehash_Add).
+typedef struct FILEHASH_t
+{
+  UINT64            total;              // Total of the finished blocks
+  UINT64            block;              // Hash of current block so far
+  UINT64            start;              // File offset of first byte
+  UINT64            offset;             // File offset of next byte
+  UINT64            end;                // File offset to stop; -1=EOF
+  BYTE              word[8];            // Bytes of an incomplete word
+  BOOL              valid;              // FALSE=Some data was missed
+
+} FILEHASH;
+
+
+//---------------------------------------------------------------------------
+// Struct type for a source file in the conversion cache
+//
+// The fingerprint of the source file is its size, its last write time and
+// a hash of its contents (see FILEHASH). The names are
+// stored back to back, each with a terminator: first the source file,
+// then the output files that were generated from it.
+typedef struct CACHEENTRY_t
+{
+  UINT64            filesize;           // Size of source file
+  UINT64            filetime;           // Last write time of source file
+  UINT64            hash;               // Hash of contents of source file
+  UINT              numnames;           // Number of names incl. source
+  UINT              namessize;          // Number of bytes in names
+  LPSTR             names;              // Names, back to back
+
+} CACHEENTRY;
+
+
+//---------------------------------------------------------------------------
+// Struct type for the conversion cache (see --cache)
+//
+// The cache is loaded from the cache file when the batch starts, and saved
+// when it's done. Entries are found by their names through a hash table
+// with open addressing that has a slot for every name of every entry.
+typedef struct CACHE_t
+{
+  LPCSTR            filename;           // Cache file; NULL=no cache
+  CACHEENTRY       *entries;            // Entries
+  UINT              numentries;         // Number of entries
+  UINT              maxentries;         // Number of allocated entries
+  UINT             *table;              // Hash table; entry+1, 0=free
+  UINT              numslots;           // Number of used slots in table
+  UINT              tablesize;          // Size of table (power of 2)
+  BOOL              changed;            // TRUE=Cache file must be saved
+  CRITICAL_SECTION  lock;               // Lock for the cache
+
+} CACHE, *HCACHE;
+
+
+//---------------------------------------------------------------------------
+// Enum type for the stages of a conversion, for the statistics
+typedef enum STAGE_t
+{
+  STAGE_NONE = 0,                       // Not measuring
+  STAGE_READ,                           // Reading or mapping input
+  STAGE_SCAN,                           // Finding and converting frames
+  STAGE_WRITE,                          // Writing output
+
+  STAGE_NUM                             // (number of stages)
+} STAGE;
+
+
+//---------------------------------------------------------------------------
+// Struct type for the statistics of a conversion (see --stats)
+//
+// The input and output streams update the counters if they have a pointer
+// to the statistics. The times are only measured when the stage changes
+// (see Stats_Switch), so this doesn't slow down the frame loop.
+typedef struct STATS_t
+{
+  UINT32            numframes;          // Number of frames generated
+  UINT64            bytesread;          // Bytes read or mapped from input
+  UINT64            byteswritten;       // Bytes written to output files
+  UINT64            bytesskipped[ERR_NUM]; // Bytes skipped by reason
+  UINT32            crcstripped;        // Number of CRC words removed
+  UINT32            paddingcleared;     // Number of padding slots cleared
+  UINT32            crcerrors;          // Number of frames with bad CRC
+  UINT32            refills;            // Buffer reads and view mappings
+  UINT32            writes;             // Write calls
+  double            walltime[STAGE_NUM]; // Wall clock time per stage
+  double            cputime[STAGE_NUM]; // CPU time per stage
+
+  // Current stage, see Stats_Switch
+  STAGE             stage;              // Stage being measured
+  double            wallstart;          // Wall clock time at start of stage
+  double            cpustart;           // CPU time at start of stage
+
+} STATS;
+
+
+//---------------------------------------------------------------------------
+// Struct type for a ring of buffers between two threads
+//
+// One thread (the producer) fills empty buffers and passes them on, the
+// other thread (the consumer) processes the full buffers in the same order
+// and gives them back. The semaphores count the buffers that each side
+// can take, so a thread only waits when the other thread is behind.
+// A full buffer with size 0 means there is no more data.
+//
+// Either side may hold several buffers at a time (e.g. for overlapped
+// reads or writes), as long as it passes them on in the order in which
+// it got them.
+typedef struct RING_t
+{
+  HANDLE            hempty;             // Semaphore for empty buffers
+  HANDLE            hfull;              // Semaphore for full buffers
+  UINT              emptyindex;         // Index of next empty buffer
+  UINT              fullindex;          // Index of next buffer to pass on
+  UINT              consumerindex;      // Index of next full buffer
+  UINT              sizes[RING_BUFFERS]; // Number of bytes in full buffers
+  UINT              buffersize;         // Size of each buffer
+  LPBYTE            buffers;            // Buffers (page aligned)
+
+} RING, *HRING;
+
+
+//---------------------------------------------------------------------------
+// Struct type representing the input stream
+typedef struct INPUTSTREAM_t
+{
+  // Handles for file operations
+  FILE             *fin;                // Input file handle
+  HANDLE            hmapping;           // File mapping; NULL=use buffer
+
+  // The data pointer points to the buffer at the end of the struct, or
+  // to a view of the input file if the file is memory mapped.
+  //
+  // The data is divided in three parts:
+  // - The start of the data is discardable data
+  // - This is followed by the current MPEG frame (or part of it)
+  // - The end of the data may be unusable data (e.g. past end of file)
+  LPBYTE            data;               // Buffer or mapped view
+  UINT              startindex;         // Index to start of frame
+  UINT              endindex;           // Index to end of usable data
+
+  // Location of the data in the input file
+  UINT64            dataoffset;         // File offset of data[0]
+  UINT64            filesize;           // File size (only if mapped)
+
+  // When a valid frame of data is found in the input buffer,
+  // the following are set to the attributes of the frame.
+  RATEID            rateid;             // Sample rate
+  size_t            framesize;          // Frame size
+
+  // In MPP files, all frames are stored at the same distance from each
+  // other (see GetMppStride). As long as the frames are where we expect
+  // them, the stride is used to find the next frame instead of searching
+  // for it.
+  BOOL              is_mpp;             // TRUE=input is MPP file
+  UINT              stride;             // Distance between frames; 0=search
+  UINT              padding;            // Padding to skip before next frame
+
+  // Statistics
+  UINT              numpaddingslots;    // Number of nozero padding slots
+  UINT              numcrcerrors;       // Number of frames with bad CRC
+
+  // Frames that have a CRC are checked if requested. Bad frames are
+  // reported with the file name and the frame number.
+  BOOL              checkcrc;           // TRUE=Check CRC (see GetFrameCrc)
+  UINT32            frameno;            // Number of current frame in file
+  CHAR              filename[MAX_PATH]; // Input file name for messages
+
+  // Frame index that's built while reading; NULL=none
+  HFRAMEINDEX       hindex;             // Frame index handle
+
+  // Statistics; NULL=none
+  STATS            *pstats;             // Statistics to update
+
+  // Hash of the data for the cache, calculated as the data is mapped or
+  // read into the buffer; NULL=none
+  FILEHASH         *phash;              // Hash to update
+
+  // With a reader thread (see inputstream_StartReader), the file is read
+  // ahead of time into a ring of large buffers, and the input buffer is
+  // filled from there.
+  HRING             hring;              // Ring of buffers; NULL=no thread
+  HANDLE            hreader;            // Reader thread
+  DWORD             fileflags;          // CreateFile flags; 0=use fread
+  volatile ERR      readresult;         // Result at end of reader thread
+  volatile BOOL     stopreader;         // TRUE=Reader thread must stop
+  BOOL              readerdone;         // TRUE=All data was taken
+  LPBYTE            chunk;              // Full buffer from ring; NULL=none
+  UINT              chunkindex;         // Index of next byte in chunk
+  UINT              chunksize;          // Number of bytes in chunk
+
+  // The actual buffer follows the struct once it's allocated.
+  // It's not used if the file is memory mapped.
+  UINT              buffersize;         // Number of bytes in buffer
+  BYTE              buffer[0];          // Input buffer follows struct
+} INPUTSTREAM, *HINPUTSTREAM;
+
+
+typedef struct OUTPUTSTREAM_t
+{
+  CHAR              outname[MAX_PATH];     // MPP/MP1 file name for output
+  CHAR              trkfilename[MAX_PATH]; // TRK file name (long)
+  CHAR              lvlfilename[MAX_PATH]; // LVL file name (short)
+  HNAMEINDEX        hnames;             // Names in use; NULL=check disk
+
+  // With the cache, the output files are written under a temporary name
+  // (the name with a tilde at the end). They get their own names when
+  // the conversion was successful (see outputstream_Commit). The names
+  // are added to the cache entry when the files are created.
+  CACHEENTRY       *pentry;             // Cache entry; NULL=no cache
+  BOOL              created[3];         // TRUE=Output/TRK/LVL file created
+  FILE             *fout;               // Output file handle
+  HANDLE            hout;               // Output handle for writing a part
+  FILE             *flvl;               // Level file handle
+  FILE             *ftrk;               // Track file handle
+  BOOL              is_mpp;             // TRUE=MPP FALSE=MP1
+  BOOL              is_wav;             // TRUE=Decode to WAV (is_mpp=FALSE)
+  BOOL              is_stdout;          // TRUE=Write to standard output
+  struct DECODER_t *hdecoder;           // Decoder for WAV output
+  RATEID            rateid;             // Rate ID of output file
+  UINT32            numframes;          // Number of frames generated
+
+  // When the sample rate changes, a new set of output files is started
+  // (see outputstream_NextSegment)
+  CHAR              infilename[MAX_PATH]; // Input file name
+  UINT              segment;            // Segment number (0=first)
+  UINT32            prevframes;         // Frames in previous segments
+
+  // Statistics; NULL=none
+  STATS            *pstats;             // Statistics to update
+
+  // Levels for the LVL file are collected in a separate buffer
+  UINT              lvlindex;           // Number of bytes in LVL buffer
+  BYTE              lvlbuffer[LVL_BUFFER_SIZE]; // LVL buffer
+
+  // With a writer thread (see outputstream_StartWriter), full buffers
+  // are passed to the writer thread through a ring of buffers, and the
+  // conversion continues in the next buffer while they're written.
+  HRING             hring;              // Ring of buffers; NULL=no thread
+  HANDLE            hwriter;            // Writer thread
+  DWORD             fileflags;          // CreateFile flags; 0=use fwrite
+  volatile ERR      writeresult;        // First error of writer thread
+
+  // Frames are collected in the buffer, and written to the output file
+  // when the buffer is full. The data pointer points to the buffer at the
+  // end of the struct, or to a buffer of the ring.
+  LPBYTE            data;               // Buffer being filled
+  UINT              bufferindex;        // Number of bytes in buffer
+  UINT              buffersize;         // Size of buffer
+  BYTE              buffer[0];          // Output buffer follows struct
+
+} OUTPUTSTREAM, *HOUTPUTSTREAM;
+
+
+//---------------------------------------------------------------------------
+// Struct type for the state of the Layer 1 decoder
+//
+// The synthesis filter of each channel needs the last 16 V vectors (see
+// Synthesis_Scalar). They're stored in a ring buffer.
+typedef struct DECODER_t
+{
+  FLOAT             v[2][16][64];       // V vectors for each channel
+  UINT              vindex;             // Index of most recent V vector
+
+} DECODER, *HDECODER;
+
+
+//---------------------------------------------------------------------------
+// Struct type for the command line options
+typedef struct OPTIONS_t
+{
+  UINT              outbuffersize;      // Output buffer size in bytes
+  UINT              numthreads;         // Number of files to convert at once
+  BOOL              wav;                // TRUE=Decode to WAV files
+  BOOL              index;              // TRUE=Save index of MP1 files
+  LPCSTR            to;                 // Output type for standard input
+  BOOL              json;               // TRUE=Benchmark results as JSON
+  UINT              benchmarksize;      // Largest benchmark file in MB
+  BOOL              stats;              // TRUE=Show statistics as JSON
+  BOOL              nocrccheck;         // TRUE=Don't check CRCs of frames
+  BOOL              pipeline;           // TRUE=Reader and writer threads
+  BOOL              overlapped;         // TRUE=Overlapped I/O in threads
+  BOOL              unbuffered;         // TRUE=Read without file cache
+  BOOL              recursive;          // TRUE=Search subdirectories too
+  LPCSTR            cache;              // Cache file name; NULL=none
+
+} OPTIONS;
+
+
+//---------------------------------------------------------------------------
+// Struct type for a file conversion job
+typedef struct JOB_t
+{
+  LPCSTR            filename;           // Input file name (after struct)
+  UINT              index;              // Index in command line order
+  BOOL              output_is_mpp;      // TRUE=Generate MPP file
+  BOOL              output_is_wav;      // TRUE=Generate WAV file
+  BOOL              is_trk;             // TRUE=Input is TRK file
+  UINT64            filesize;           // Input file size (for scheduling)
+  UINT              numthreads;         // Threads to use for this file
+  ERR               result;             // Result of the conversion
+  STATS             stats;              // Statistics of the conversion
+
+} JOB;
+
+
+//---------------------------------------------------------------------------
+// Struct type for a list of jobs that are processed by worker threads
+//
+// Jobs are added while the worker threads are already running, so the
+// jobs that haven't started yet are kept in a heap (see JobQueue_Push).
+typedef struct JOBQUEUE_t
+{
+  JOB             **jobs;               // Jobs in command line order
+  UINT              numjobs;            // Number of jobs
+  UINT              maxjobs;            // Allocated length of job arrays
+  JOB             **waiting;            // Heap of jobs that haven't started
+  UINT              numwaiting;         // Number of jobs in heap
+  BOOL              bysize;             // TRUE=Start largest files first
+  CRITICAL_SECTION  lock;               // Lock for the job arrays
+  HANDLE            hsemaphore;         // Number of jobs for the threads
+  HANDLE            hthreads[MAX_THREADS]; // Worker threads
+  UINT              numthreads;         // Number of worker threads started
+  double            start;              // Time when the queue was created
+  const OPTIONS    *poptions;           // Options for all jobs
+  NAMEINDEX         names;              // Names in output directories
+  CACHE             cache;              // Conversion cache (see --cache)
+
+} JOBQUEUE;
+
+
+//---------------------------------------------------------------------------
+// Struct type for a part of an MPP file that's converted by its own thread
+//
+// All frames in an MPP file are at a known offset, so the file can be cut
+// into parts that are converted at the same time. See ProcessMppParts.
+typedef struct MPPPART_t
+{
+  LPCSTR            infilename;         // Input file name
+  LPCSTR            outname;            // Output file name
+  UINT              stride;             // Distance between frames
+  UINT              buffersize;         // Output buffer size in bytes
+  BOOL              convert;            // FALSE=Only count the frames
+  BOOL              checkcrc;           // TRUE=Check CRCs of frames
+
+  UINT              firstframe;         // Number of first frame in file
+
+  UINT64            inoffset;           // Input file offset of first frame
+  UINT64            inend;              // Input file offset of end of part
+  UINT64            outoffset;          // Output file offset of first frame
+
+  UINT              numframes;          // Number of frames in the part
+  UINT              numpadded;          // Number of frames with padding slot
+  ERR               result;             // Result for this part
+
+  STATS             stats;              // Statistics for this part
+  BOOL              usestats;           // TRUE=Update the statistics
+
+  FILEHASH          hash;               // Hash of the blocks of the part
+  BOOL              usehash;            // TRUE=Update the hash
+
+} MPPPART;
+
+
+//---------------------------------------------------------------------------
+// Struct type for a fragment of a track in a TRK file
+typedef struct TRKFRAGMENT_t
+{
+  CHAR              filename[MAX_PATH]; // MPP file name
+  UINT              numframes;          // Number of frames
+  UINT              skip;               // Frames to skip at start of file
+
+} TRKFRAGMENT;
+
+
+//---------------------------------------------------------------------------
+// Struct type for a kind of synthetic stream for the benchmarks
+//
+// See Benchmark_FillStream.
+typedef struct BENCHSTREAM_t
+{
+  LPCSTR            name;               // Name of the test data
+  RATEID            rateid;             // Sample rate
+  BOOL              crc;                // TRUE=Frames have a CRC
+  BOOL              padding;            // TRUE=Padding slots aren't blank
+  BOOL              dirty;              // TRUE=Garbage and sync losses
+
+} BENCHSTREAM;
+
+
+/////////////////////////////////////////////////////////////////////////////
+// DATA
+/////////////////////////////////////////////////////////////////////////////
+
+
+//---------------------------------------------------------------------------
+// Header table, see HeaderTable_Init
+HEADERINFO HeaderTable[HEADER_TABLE_SIZE];
+
+
+//---------------------------------------------------------------------------
+// CRC table, see CrcTable_Init
+UINT16 CrcTable[256];
+
+
+//---------------------------------------------------------------------------
+// Lock for console output from multiple threads, see Console_Printf
+CRITICAL_SECTION ConsoleLock;
+
+
+//---------------------------------------------------------------------------
+// Synthesis window of the Layer 1 decoder, first half
+//
+// These are the coefficients of the synthesis window D[i] in ISO 11172-3
+// table 3-B.3, for i = 0 to 256, in units of 2^-16. The second half of the
+// window is the mirror image of the first half. The signs of the
+// coefficients are inverted in every other block of 64 (see
+// SynthesisTables_Init).
+const LONG SynthesisWindowBase[257] =
+{
+       0,     -1,     -1,     -1,     -1,     -1,     -1,     -2,     -2,     -2,     -2,     -3,
+      -3,     -4,     -4,     -5,     -5,     -6,     -7,     -7,     -8,     -9,    -10,    -11,
+     -13,    -14,    -16,    -17,    -19,    -21,    -24,    -26,    -29,    -31,    -35,    -38,
+     -41,    -45,    -49,    -53,    -58,    -63,    -68,    -73,    -79,    -85,    -91,    -97,
+    -104,   -111,   -117,   -125,   -132,   -139,   -147,   -154,   -161,   -169,   -176,   -183,
+    -190,   -196,   -202,   -208,   -213,   -218,   -222,   -225,   -227,   -228,   -228,   -227,
+    -224,   -221,   -215,   -208,   -200,   -189,   -177,   -163,   -146,   -127,   -106,    -83,
+     -57,    -29,      2,     36,     72,    111,    153,    197,    244,    294,    347,    401,
+     459,    519,    581,    645,    711,    779,    848,    919,    991,   1064,   1137,   1210,
+    1283,   1356,   1428,   1498,   1567,   1634,   1698,   1759,   1817,   1870,   1919,   1962,
+    2001,   2032,   2057,   2075,   2085,   2087,   2080,   2063,   2037,   2000,   1952,   1893,
+    1822,   1739,   1644,   1535,   1414,   1280,   1131,    970,    794,    605,    402,    185,
+     -45,   -288,   -545,   -814,  -1095,  -1388,  -1692,  -2006,  -2330,  -2663,  -3004,  -3351,
+   -3705,  -4063,  -4425,  -4788,  -5153,  -5517,  -5879,  -6237,  -6589,  -6935,  -7271,  -7597,
+   -7910,  -8209,  -8491,  -8755,  -8998,  -9219,  -9416,  -9585,  -9727,  -9838,  -9916,  -9959,
+   -9966,  -9935,  -9863,  -9750,  -9592,  -9389,  -9139,  -8840,  -8492,  -8092,  -7640,  -7134,
+   -6574,  -5959,  -5288,  -4561,  -3776,  -2935,  -2037,  -1082,    -70,    998,   2122,   3300,
+    4533,   5818,   7154,   8540,   9975,  11455,  12980,  14548,  16155,  17799,  19478,  21189,
+   22929,  24694,  26482,  28289,  30112,  31947,  33791,  35640,  37489,  39336,  41176,  43006,
+   44821,  46617,  48390,  50137,  51853,  53534,  55178,  56778,  58333,  59838,  61289,  62684,
+   64019,  65290,  66494,  67629,  68692,  69679,  70590,  71420,  72169,  72835,  73415,  73908,
+   74313,  74630,  74856,  74992,  75038,
+};
+
+
+//---------------------------------------------------------------------------
+// Tables for the Layer 1 decoder, see SynthesisTables_Init
+FLOAT SynthesisWindow[512];             // Synthesis window D[i]
+FLOAT SynthesisMatrix[32][32];          // Matrixing coefficients
+FLOAT ScaleFactorTable[64];             // Scale factors by index
+FLOAT DequantizeTable[16];              // Dequantization by number of bits
+
+
+//---------------------------------------------------------------------------
+// Levels for the LVL file, indexed by Layer 1 scale factor index
+//
+// Scale factor n is 2.0 * 2^(-n/3); index 3 is full scale. The level is
+// the scale factor on a linear scale where 255 is full scale. Index 63
+// is not a valid scale factor; it's used for channels without any bits
+// allocated to them.
+const BYTE LevelTable[64] =
+{
+  255, 255, 255, 255, 202, 161, 128, 101,  80,  64,  51,  40,  32,  25,  20,  16,
+   13,  10,   8,   6,   5,   4,   3,   3,   2,   2,   1,   1,   1,   1,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+};
+
+
+/////////////////////////////////////////////////////////////////////////////
+// CODE
+/////////////////////////////////////////////////////////////////////////////
+
+
+//---------------------------------------------------------------------------
+// Print a message to the console
+//
+// Worker threads may print messages at the same time, so this makes sure
+// that they don't get mixed up.
+void
+Console_Printf(
+  LPCSTR format,                        // Format string for fprintf
+  ...)                                  // Arguments
+{
+  va_list args;
+
+  va_start(args, format);
+
+  EnterCriticalSection(&ConsoleLock);
+  vfprintf(stderr, format, args);
+  LeaveCriticalSection(&ConsoleLock);
+
+  va_end(args);
+}
+
+
+//---------------------------------------------------------------------------
+// Get the wall clock time and the CPU time of the current thread
+void
+Stats_GetTimes(
+  double *pwall,                        // Output wall clock time in s
+  double *pcpu)                         // Output thread CPU time in s
+{
+  static double frequency;
+  LARGE_INTEGER counter;
+  FILETIME creation;
+  FILETIME exit;
+  FILETIME kernel;
+  FILETIME user;
+
+  if (!frequency)
+  {
+    LARGE_INTEGER f;
+
+    QueryPerformanceFrequency(&f);
+    frequency = (double)f.QuadPart;
+  }
+
+  QueryPerformanceCounter(&counter);
+  *pwall = (double)counter.QuadPart / frequency;
+
+  if (GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+  {
+    // File times are in units of 100ns
+    *pcpu = ((double)kernel.dwHighDateTime + (double)user.dwHighDateTime) * 429.4967296
+      + ((double)kernel.dwLowDateTime + (double)user.dwLowDateTime) / 10000000.0;
+  }
+  else
+  {
+    *pcpu = 0.0;
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Switch the statistics to a different stage
+//
+// The time since the previous switch is added to the previous stage. The
+// times are only measured when switching, which happens once per buffer
+// or view, not once per frame.
+STAGE                                   // Returns previous stage
+Stats_Switch(
+  STATS *pstats,                        // Statistics (NULL=none)
+  STAGE stage)                          // New stage
+{
+  STAGE result = STAGE_NONE;
+
+  if (pstats)
+  {
+    double wall;
+    double cpu;
+
+    Stats_GetTimes(&wall, &cpu);
+
+    result = pstats->stage;
+
+    if (result != STAGE_NONE)
+    {
+      pstats->walltime[result] += wall - pstats->wallstart;
+      pstats->cputime[result] += cpu - pstats->cpustart;
+    }
+
+    pstats->stage = stage;
+    pstats->wallstart = wall;
+    pstats->cpustart = cpu;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Add statistics to other statistics
+void
+Stats_Add(
+  STATS *pstats,                        // Statistics to update
+  const STATS *padd)                    // Statistics to add
+{
+  UINT i;
+
+  pstats->numframes      += padd->numframes;
+  pstats->bytesread      += padd->bytesread;
+  pstats->byteswritten   += padd->byteswritten;
+  pstats->crcstripped    += padd->crcstripped;
+  pstats->paddingcleared += padd->paddingcleared;
+  pstats->crcerrors      += padd->crcerrors;
+  pstats->refills        += padd->refills;
+  pstats->writes         += padd->writes;
+
+  for (i = 0; i < ERR_NUM; i++)
+  {
+    pstats->bytesskipped[i] += padd->bytesskipped[i];
+  }
+
+  for (i = 0; i < STAGE_NUM; i++)
+  {
+    pstats->walltime[i] += padd->walltime[i];
+    pstats->cputime[i] += padd->cputime[i];
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Print statistics as a JSON object on a line by itself
+//
+// The statistics go to the console with the other messages. Lines that
+// start with a brace can be filtered out by a script.
+void
+Stats_Print(
+  const STATS *pstats,                  // Statistics to print
+  LPCSTR type,                          // "file" or "batch"
+  LPCSTR filename,                      // File name (NULL=none)
+  UINT numfiles,                        // Number of files
+  ERR err,                              // Result
+  double elapsed)                       // Wall clock time in s (0=none)
+{
+  // Reasons for skipping data while searching for a frame, see
+  // inputstream_CopyFrame
+  static const struct
+  {
+    ERR             err;
+    LPCSTR          name;
+  } reasons[] =
+  {
+    { ERR_SYNC,               "sync" },
+    { ERR_DATA_NOT_MPEG1,     "not_mpeg1" },
+    { ERR_DATA_NOT_LAYER1,    "not_layer1" },
+    { ERR_DATA_NOT_384KBPS,   "not_384kbps" },
+    { ERR_DATA_BAD_CHANMODE,  "bad_chanmode" },
+  };
+  static const LPCSTR stages[STAGE_NUM] = { NULL, "read", "scan", "write" };
+  CHAR name[MAX_PATH * 2];
+  CHAR skipped[256];
+  CHAR times[256];
+  CHAR line[MAX_PATH * 2 + 1024];
+  UINT len;
+  UINT i;
+
+  // Escape the file name; Windows paths have backslashes
+  len = 0;
+
+  if (filename)
+  {
+    for (i = 0; (filename[i]) && (len + 2 < sizeof(name)); i++)
+    {
+      if ((filename[i] == '\\') || (filename[i] == '"'))
+      {
+        name[len++] = '\\';
+      }
+
+      name[len++] = ((BYTE)filename[i] < ' ' ? '?' : filename[i]);
+    }
+  }
+
+  name[len] = '\0';
+
+  len = 0;
+
+  for (i = 0; i < sizeof(reasons) / sizeof(reasons[0]); i++)
+  {
+    len += sprintf(skipped + len, "%s\"%s\":%.0f",
+      (i ? "," : ""),
+      reasons[i].name,
+      (double)(INT64)pstats->bytesskipped[reasons[i].err]);
+  }
+
+  len = 0;
+
+  for (i = STAGE_NONE + 1; i < STAGE_NUM; i++)
+  {
+    len += sprintf(times + len, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f}",
+      (i > STAGE_NONE + 1 ? "," : ""),
+      stages[i],
+      pstats->walltime[i],
+      pstats->cputime[i]);
+  }
+
+  len = sprintf(line, "{\"type\":\"%s\",%s%s%s\"files\":%u,\"result\":%u,"
+    "\"frames\":%u,\"bytes_read\":%.0f,\"bytes_written\":%.0f,"
+    "\"bytes_skipped\":{%s},\"crc_stripped\":%u,\"crc_errors\":%u,"
+    "\"padding_cleared\":%u,"
+    "\"refills\":%u,\"writes\":%u,\"time\":{%s}",
+    type,
+    (filename ? "\"file\":\"" : ""),
+    name,
+    (filename ? "\"," : ""),
+    numfiles,
+    err,
+    pstats->numframes,
+    (double)(INT64)pstats->bytesread,
+    (double)(INT64)pstats->byteswritten,
+    skipped,
+    pstats->crcstripped,
+    pstats->crcerrors,
+    pstats->paddingcleared,
+    pstats->refills,
+    pstats->writes,
+    times);
+
+  if (elapsed)
+  {
+    len += sprintf(line + len, ",\"elapsed\":%.6f", elapsed);
+  }
+
+  // Print the entire line at once, so that lines from different threads
+  // don't get mixed up
+  Console_Printf("%s}\n", line);
+}
+
+
+//---------------------------------------------------------------------------
+// Get the extension of a file name
+//
+// Returns the location in the input string of the period in front of the
+// filename extension.
+//
+// If the name doesn't end in an extension, the function returns the location
+// of the end of the string.
+//
+// If the name includes a directory with a path with an extension, the
+// function handles this correctly.
+//
+// If the file name is NULL, the function returns NULL.
+LPCSTR                                  // Returns extension; NULL on error
+GetFileExtension(
+  LPCSTR filename,                      // Input file name
+  LPCSTR *pbasename)                    // Optional output base file name
+{
+  LPCSTR result = NULL;
+  LPCSTR basename = filename;
+
+  if (filename)
+  {
+    LPCSTR s;
+
+    for (s = filename; *s; s++)
+    {
+      if (*s == '.')
+      {
+        result = s;
+      }
+      else if ((*s == '\\') || (*s == '/') || (*s == ':'))
+      {
+        basename = s + 1;
+        result = NULL;
+      }
+    }
+
+    if (!result)
+    {
+      // If no period was found (or the last period appeared in front of
+      // a slash or backslash), return the end of the string
+      result = s;
+    }
+  }
+
+  if (pbasename)
+  {
+    *pbasename = basename;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Replace the extension of a file if it matches
+//
+// Extension parameters to this function don't include the period.
+//
+// If the extension doesn't match, the input string is not copied to the
+// output buffer.
+BOOL                                    // Returns TRUE if replacement done
+ReplaceFileExtension(
+  LPCSTR filename,                      // Input filename
+  LPSTR outfilename,                    // Output filename (ok to use input)
+  LPCSTR matchext,                      // Input ext must be this (NULL=any)
+  LPCSTR replaceext,                    // Replace with this (NULL=no change)
+  BOOL shorten)                         // Generate short output file name
+{
+  BOOL result = TRUE;
+  LPCSTR extension = NULL;
+  LPCSTR basename = NULL;
+  UINT32 dirlen = 0;
+  UINT32 filelen = 0;
+  BOOL haveperiod = FALSE;
+
+  if (result)
+  {
+    // Make sure we have an input filename
+    if ((!filename) || (!*filename) || (!outfilename))
+    {
+      result = FALSE;
+    }
+  }
+
+  if (result)
+  {
+    extension = GetFileExtension(filename, &basename);
+
+    if (!extension)
+    {
+      // Something went wrong
+      result = FALSE;
+    }
+  }
+
+  if (result)
+  {
+    // Calculate the length of the directory and file name
+    dirlen = basename - filename;
+    filelen = extension - basename; // period excluded
+
+    // Move the extension pointer beyond the period if there is one
+    if (*extension == '.')
+    {
+      haveperiod = TRUE;
+      extension++;
+    }
+
+    // If a match string was given, check if the extension matches
+    if (matchext)
+    {
+      result = !stricmp(extension, matchext);
+    }
+  }
+
+  if (result)
+  {
+    if (replaceext || shorten)
+    {
+      LPSTR t = outfilename + dirlen;
+      LPCSTR s = filename + dirlen;
+      UINT32 i;
+
+      // Copy the directory name (if necessary)
+      if ((filename != outfilename) && (dirlen))
+      {
+        memcpy(outfilename, filename, dirlen);
+      }
+
+      // Copy the file name
+      // If we're in shortening mode, convert to upper case and skip spaces
+      for (i = 0; i < filelen; i++)
+      {
+        char c = *s;
+
+        if (shorten)
+        {
+          c = toupper(c);
+          if (c == ' ')
+          {
+            s++;
+            i++;
+            continue;
+          }
+        }
+
+        *t++ = c;
+        s++;
+
+        if ((shorten) && (t == outfilename + dirlen + 8))
+        {
+          break;
+        }
+      }
+
+      // Store terminator in case no extension will be added
+      *t = '\0';
+
+      // Choose the extension to copy
+      if ((replaceext) && (*replaceext))
+      {
+        s = replaceext;
+      }
+      else
+      {
+        s = extension;
+      }
+
+      // If there's no extension to append, we're done
+      if (*s)
+      {
+        // We have now copied the directory and the base name of the file.
+        // From this point on we may be making the output longer than
+        // the input. Make sure we don't overrun the buffer.
+        if ((t - outfilename) + 1 + strlen(s) > MAX_PATH - 1)
+        {
+          result = FALSE;
+        }
+        else
+        {
+          *t++ = '.';
+
+          strcpy(t, s); // Safe
+
+          if (shorten)
+          {
+            strupr(t);
+          }
+        }
+      }
+    }
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Add a number to the base name of a file
+//
+// For example, "TAPE.MPP" with separator '_' and number 2 becomes
+// "TAPE_2.MPP". If the name has to stay short, the base name is truncated
+// so that the result still fits in 8 characters.
+BOOL                                    // Returns FALSE if name too long
+AddFileNumber(
+  LPSTR filename,                       // File name, updated
+  CHAR separator,                       // Character in front of number
+  UINT number,                          // Number to add
+  BOOL shorten)                         // TRUE=keep base name 8 characters
+{
+  BOOL result = TRUE;
+  CHAR suffix[16];
+  CHAR extension[MAX_PATH];
+  LPCSTR basename;
+  UINT dirlen;
+  UINT baselen;
+  UINT suffixlen;
+
+  strcpy(extension, GetFileExtension(filename, &basename)); // safe
+  dirlen = basename - filename;
+  baselen = strlen(basename) - strlen(extension);
+  suffixlen = sprintf(suffix, "%c%u", separator, number);
+
+  if ((shorten) && (baselen + suffixlen > 8))
+  {
+    baselen = 8 - suffixlen;
+  }
+
+  if (dirlen + baselen + suffixlen + strlen(extension) > MAX_PATH - 1)
+  {
+    result = FALSE;
+  }
+  else
+  {
+    LPSTR t = filename + dirlen + baselen;
+
+    strcpy(t, suffix); // safe
+    strcat(t, extension); // safe
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Get the size and the last write time of a file
+BOOL                                    // Returns FALSE if not found
+GetFileInfo(
+  LPCSTR filename,                      // File name
+  UINT64 *psize,                        // Output file size
+  UINT64 *ptime)                        // Output last write time
+{
+  BOOL result = FALSE;
+  WIN32_FIND_DATA fd;
+  HANDLE hfind = FindFirstFile(filename, &fd);
+
+  if (hfind != INVALID_HANDLE_VALUE)
+  {
+    *psize = ((UINT64)fd.nFileSizeHigh << 32) | fd.nFileSizeLow;
+    *ptime = ((UINT64)fd.ftLastWriteTime.dwHighDateTime << 32) | fd.ftLastWriteTime.dwLowDateTime;
+
+    FindClose(hfind);
+
+    result = TRUE;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Check if file exists
+BOOL                                    // Returns nonzero if file exists
+FileExists(
+  LPCSTR filename)                      // File name
+{
+  BOOL result = FALSE;
+
+  if (filename)
+  {
+    FILE *fp = fopen(filename, "r");
+
+    if (fp)
+    {
+      fclose(fp);
+      result = TRUE;
+    }
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Get the full path of a file
+//
+// This is used where file names are compared, because the same file can be
+// named in different ways (e.g. "DIR\X.MP1" and ".\DIR\X.MP1"), and
+// relative names depend on the current directory. If the full path can't
+// be determined, the name is returned as it is.
+LPCSTR                                  // Returns fullname or name
+GetFullName(
+  LPCSTR name,                          // File name
+  LPSTR fullname)                       // Buffer of MAX_PATH bytes
+{
+  DWORD len = GetFullPathName(name, MAX_PATH, fullname, NULL);
+
+  return ((len) && (len < MAX_PATH) ? fullname : name);
+}
+
+
+//---------------------------------------------------------------------------
+// Rename a file, replacing the file that has the new name (if any)
+//
+// Windows 98 doesn't implement MoveFileEx, so there the old file is
+// deleted first and the file is renamed with MoveFile. On other versions,
+// a failure leaves both files alone.
+BOOL                                    // Returns FALSE on failure
+MoveFileReplace(
+  LPCSTR filename,                      // File to rename
+  LPCSTR newname)                       // New name
+{
+  BOOL result = MoveFileEx(filename, newname, MOVEFILE_REPLACE_EXISTING);
+
+  if ((!result) && (GetLastError() == ERROR_CALL_NOT_IMPLEMENTED))
+  {
+    DeleteFile(newname);
+
+    result = MoveFile(filename, newname);
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Initialize a name index
+void
+nameindex_Init(
+  HNAMEINDEX hnames)                    // Name index to initialize
+{
+  memset(hnames, 0, sizeof(*hnames));
+
+  InitializeCriticalSection(&hnames->lock);
+}
+
+
+//---------------------------------------------------------------------------
+// Free a name index
+void
+nameindex_Destroy(
+  HNAMEINDEX hnames)                    // Name index
+{
+  while (hnames->dirs)
+  {
+    NAMEDIR *pdir = hnames->dirs;
+    UINT i;
+
+    hnames->dirs = pdir->next;
+
+    for (i = 0; i < pdir->maxnames; i++)
+    {
+      free(pdir->names[i]);
+    }
+
+    free(pdir->names);
+    free(pdir);
+  }
+
+  DeleteCriticalSection(&hnames->lock);
+}
+
+
+//---------------------------------------------------------------------------
+// Calculate the hash of a file name for a hash table
+//
+// Windows file names are not case sensitive, so neither is the hash.
+UINT32                                  // Returns FNV-1a hash
+HashName(
+  LPCSTR name)                          // File name
+{
+  UINT32 hash = 2166136261U;
+  LPCSTR s;
+
+  for (s = name; *s; s++)
+  {
+    hash = (hash ^ (BYTE)toupper(*s)) * 16777619U;
+  }
+
+  return hash;
+}
+
+
+//---------------------------------------------------------------------------
+// Find a name in the hash table of a directory
+//
+// Names are compared without regard to case, like Windows does. If the
+// name isn't in the table, the function returns the free slot where it
+// belongs. The table must not be empty.
+UINT                                    // Returns slot in hash table
+nameindex_Find(
+  const NAMEDIR *pdir,                  // Directory
+  LPCSTR name)                          // File name without directory
+{
+  UINT mask = pdir->maxnames - 1;
+  UINT i;
+
+  for (i = HashName(name) & mask; (pdir->names[i]) && (stricmp(pdir->names[i] + 1, name)); i = (i + 1) & mask)
+  {
+    // Nothing
+  }
+
+  return i;
+}
+
+
+//---------------------------------------------------------------------------
+// Add a name to the hash table of a directory
+BOOL                                    // Returns FALSE if out of memory
+nameindex_Insert(
+  NAMEDIR *pdir,                        // Directory
+  LPCSTR name,                          // File name without directory
+  BOOL reserved)                        // TRUE=Reserved by the batch
+{
+  BOOL result = TRUE;
+  UINT i;
+
+  // Make the table twice as big when it would become more than half full
+  if ((pdir->numnames + 1) * 2 > pdir->maxnames)
+  {
+    LPSTR *oldnames = pdir->names;
+    UINT oldmaxnames = pdir->maxnames;
+    UINT maxnames = (oldmaxnames ? oldmaxnames * 2 : 256);
+
+    if (!(pdir->names = (LPSTR *)calloc(maxnames, sizeof(LPSTR))))
+    {
+      pdir->names = oldnames;
+      result = FALSE;
+    }
+    else
+    {
+      pdir->maxnames = maxnames;
+
+      for (i = 0; i < oldmaxnames; i++)
+      {
+        if (oldnames[i])
+        {
+          pdir->names[nameindex_Find(pdir, oldnames[i] + 1)] = oldnames[i];
+        }
+      }
+
+      free(oldnames);
+    }
+  }
+
+  if (result)
+  {
+    i = nameindex_Find(pdir, name);
+
+    if (!pdir->names[i])
+    {
+      if (!(pdir->names[i] = (LPSTR)malloc(strlen(name) + 2)))
+      {
+        result = FALSE;
+      }
+      else
+      {
+        pdir->names[i][0] = (CHAR)reserved;
+        strcpy(pdir->names[i] + 1, name); // safe
+        pdir->numnames++;
+      }
+    }
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Get the names of the files in a directory
+//
+// The directory is read the first time it's needed; after that, the
+// names come from the index. Both the long names and the short names of
+// the files are stored, because a short name that Windows generated for a
+// long name can't be used for another file either. The index must be
+// locked by the caller.
+//
+// The same directory can be named in different ways (e.g. "DIR\" and
+// ".\DIR\"), so directories are kept by their full path.
+NAMEDIR *                               // Returns NULL if out of memory
+nameindex_GetDir(
+  HNAMEINDEX hnames,                    // Name index
+  LPCSTR dirname,                       // Directory, ends in backslash
+  UINT dirlen)                          // Length of directory name
+{
+  NAMEDIR *pdir;
+  CHAR name[MAX_PATH];
+  CHAR fullname[MAX_PATH];
+
+  if (dirlen + 3 <= MAX_PATH)
+  {
+    DWORD len;
+
+    if (dirlen)
+    {
+      memcpy(name, dirname, dirlen);
+      name[dirlen] = '\0';
+    }
+    else
+    {
+      strcpy(name, ".\\"); // safe
+    }
+
+    // If this fails, the name is used as it is
+    len = GetFullPathName(name, MAX_PATH, fullname, NULL);
+
+    if ((len) && (len + 2 <= MAX_PATH))
+    {
+      if ((fullname[len - 1] != '\\') && (fullname[len - 1] != '/'))
+      {
+        fullname[len++] = '\\';
+        fullname[len] = '\0';
+      }
+
+      dirname = fullname;
+      dirlen = len;
+    }
+  }
+
+  for (pdir = hnames->dirs; pdir; pdir = pdir->next)
+  {
+    if ((strlen(pdir->dirname) == dirlen) && (!strnicmp(pdir->dirname, dirname, dirlen)))
+    {
+      break;
+    }
+  }
+
+  if ((!pdir) && (dirlen + 2 <= MAX_PATH))
+  {
+    if ((pdir = (NAMEDIR *)calloc(1, sizeof(NAMEDIR) + dirlen + 1)) != NULL)
+    {
+      CHAR pattern[MAX_PATH];
+      WIN32_FIND_DATA fd;
+      HANDLE hfind;
+      BOOL ok = TRUE;
+
+      memcpy(pdir->dirname, dirname, dirlen);
+      pdir->dirname[dirlen] = '\0';
+      sprintf(pattern, "%s*", pdir->dirname); // safe
+
+      if ((hfind = FindFirstFile(pattern, &fd)) != INVALID_HANDLE_VALUE)
+      {
+        do
+        {
+          ok = ( (nameindex_Insert(pdir, fd.cFileName, FALSE))
+            && ((!fd.cAlternateFileName[0]) || (nameindex_Insert(pdir, fd.cAlternateFileName, FALSE))));
+        } while ((ok) && (FindNextFile(hfind, &fd)));
+
+        FindClose(hfind);
+      }
+
+      // Make sure the table exists even if the directory is empty
+      if ((ok) && (!pdir->maxnames) && (pdir->names = (LPSTR *)calloc(256, sizeof(LPSTR))) != NULL)
+      {
+        pdir->maxnames = 256;
+      }
+
+      if ((ok) && (pdir->maxnames))
+      {
+        pdir->next = hnames->dirs;
+        hnames->dirs = pdir;
+      }
+      else
+      {
+        UINT i;
+
+        for (i = 0; i < pdir->maxnames; i++)
+        {
+          free(pdir->names[i]);
+        }
+
+        free(pdir->names);
+        free(pdir);
+        pdir = NULL;
+      }
+    }
+  }
+
+  return pdir;
+}
+
+
+//---------------------------------------------------------------------------
+// Reserve the names of output files
+//
+// If none of the files exist, their names are added to the index so that
+// no other job can use them, and the function returns ERR_OK. Otherwise,
+// nothing is added. Empty names are skipped.
+ERR                                     // Returns error code
+nameindex_Reserve(
+  HNAMEINDEX hnames,                    // Name index
+  LPCSTR *filenames,                    // File names with directory
+  UINT numfilenames)                    // Number of file names
+{
+  ERR result = ERR_OK;
+  UINT pass;
+  UINT i;
+
+  EnterCriticalSection(&hnames->lock);
+
+  // Check all names first, then add them
+  for (pass = 0; (pass < 2) && (!result); pass++)
+  {
+    for (i = 0; (i < numfilenames) && (!result); i++)
+    {
+      LPCSTR basename = NULL;
+      NAMEDIR *pdir;
+
+      if (!*filenames[i])
+      {
+        continue;
+      }
+
+      if (!GetFileExtension(filenames[i], &basename))
+      {
+        result = ERR_PARAMETER;
+      }
+      else if (!(pdir = nameindex_GetDir(hnames, filenames[i], basename - filenames[i])))
+      {
+        result = ERR_MALLOC;
+      }
+      else if (!pass)
+      {
+        if (pdir->names[nameindex_Find(pdir, basename)])
+        {
+          result = ERR_OUTPUT_FILE_EXISTS;
+        }
+      }
+      else if (!nameindex_Insert(pdir, basename, TRUE))
+      {
+        result = ERR_MALLOC;
+      }
+    }
+  }
+
+  LeaveCriticalSection(&hnames->lock);
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Take the name of a file out of a name index
+//
+// This is used when a file is going to be replaced, so that a new output
+// file can get its name. Later names in the same run of slots are moved
+// back, so that nameindex_Find still finds them.
+void
+nameindex_Release(
+  HNAMEINDEX hnames,                    // Name index
+  LPCSTR filename)                      // File name with directory
+{
+  LPCSTR basename = NULL;
+  NAMEDIR *pdir;
+
+  EnterCriticalSection(&hnames->lock);
+
+  if ( (GetFileExtension(filename, &basename))
+    && ((pdir = nameindex_GetDir(hnames, filename, basename - filename)) != NULL))
+  {
+    UINT mask = pdir->maxnames - 1;
+    UINT i = nameindex_Find(pdir, basename);
+    UINT j;
+
+    if (pdir->names[i])
+    {
+      free(pdir->names[i]);
+      pdir->names[i] = NULL;
+      pdir->numnames--;
+
+      for (j = (i + 1) & mask; pdir->names[j]; j = (j + 1) & mask)
+      {
+        UINT home = HashName(pdir->names[j] + 1) & mask;
+
+        // Move the name to the free slot if that's not in front of the
+        // slot where its search starts
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+          pdir->names[i] = pdir->names[j];
+          pdir->names[j] = NULL;
+          i = j;
+        }
+      }
+    }
+  }
+
+  LeaveCriticalSection(&hnames->lock);
+}
+
+
+//---------------------------------------------------------------------------
+// Check if a file name was reserved by the batch
+//
+// This is used to recognize the output files of the batch when searching
+// a directory for files to convert.
+BOOL                                    // Returns TRUE if reserved
+nameindex_IsReserved(
+  HNAMEINDEX hnames,                    // Name index
+  LPCSTR filename)                      // File name with directory
+{
+  BOOL result = FALSE;
+  LPCSTR basename = NULL;
+  NAMEDIR *pdir;
+
+  EnterCriticalSection(&hnames->lock);
+
+  if ( (GetFileExtension(filename, &basename))
+    && ((pdir = nameindex_GetDir(hnames, filename, basename - filename)) != NULL))
+  {
+    LPCSTR name = pdir->names[nameindex_Find(pdir, basename)];
+
+    result = ((name) && (name[0]));
+  }
+
+  LeaveCriticalSection(&hnames->lock);
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Delete a file unless its name is in a name index
+//
+// This is used to clean up output files that were replaced by files with
+// other names. If another job reserved the name in the mean time, the
+// file is left alone.
+void
+nameindex_DeleteFile(
+  HNAMEINDEX hnames,                    // Name index
+  LPCSTR filename)                      // File name with directory
+{
+  LPCSTR basename = NULL;
+  NAMEDIR *pdir;
+
+  EnterCriticalSection(&hnames->lock);
+
+  if ( (GetFileExtension(filename, &basename))
+    && ((pdir = nameindex_GetDir(hnames, filename, basename - filename)) != NULL)
+    && (!pdir->names[nameindex_Find(pdir, basename)]))
+  {
+    DeleteFile(filename);
+  }
+
+  LeaveCriticalSection(&hnames->lock);
+}
+
+
+//---------------------------------------------------------------------------
+// Check if a header is a valid DCC header
+//
+// See GetFrameSize for the meaning of the bits. To be usable on DCC, a frame
+// must have a sync word, must be MPEG 1 Layer 1 at 384kbps, must not be
+// mono, and must use one of the three sample rates.
+//
+// The CRC bit, the padding bit and everything else is ignored here.
+#define IS_DCC_HEADER(p) ( \
+     ((p)[0]          == 0xFF) \
+  && (((p)[1] | 0x01) == 0xFF) \
+  && (((p)[2] & 0xF0) == 0xC0) \
+  && (((p)[2] & 0x0C) != 0x0C) \
+  && (((p)[3] & 0xC0) != 0xC0))
+
+
+//---------------------------------------------------------------------------
+// Find the first position in a block of data that has a valid DCC header
+//
+// This is the portable version. It uses memchr to find the first byte of
+// the sync word, and checks the rest of the header from there.
+//
+// If no header is found, the function returns the first location where
+// a header could start that's too close to the end of the data to check.
+// That way, the caller can skip all data that can't contain a header, and
+// check the rest after more data becomes available.
+UINT                                    // Returns offset of header
+FindHeader_Scalar(
+  LPCBYTE data,                         // Data to search
+  UINT insize)                          // Number of bytes in data
+{
+  UINT result = 0;
+  LPCBYTE s = data;
+  LPCBYTE end = data + insize;
+
+  if (insize >= 4)
+  {
+    // The last possible location that can be checked completely
+    LPCBYTE last = end - 4;
+
+    while ((s = (LPCBYTE)memchr(s, 0xFF, last + 1 - s)) != NULL)
+    {
+      if (IS_DCC_HEADER(s))
+      {
+        break;
+      }
+
+      if (++s > last)
+      {
+        s = NULL;
+        break;
+      }
+    }
+
+    result = (s ? s - data : insize - 3);
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Find the index of the lowest bit that's set in a nonzero mask
+UINT                                    // Returns bit index
+LowestBit(
+  UINT32 mask)                          // Mask; must not be 0
+{
+  UINT result = 0;
+
+  while (!(mask & 0xFF))
+  {
+    mask >>= 8;
+    result += 8;
+  }
+
+  while (!(mask & 1))
+  {
+    mask >>= 1;
+    result++;
+  }
+
+  return result;
+}
+
+
+#ifdef DCCU_SSE2
+//---------------------------------------------------------------------------
+// Find the first valid DCC header using SSE2
+//
+// This checks 16 possible header locations at a time, by loading the data
+// four times with offsets 0, 1, 2 and 3, so that each byte position in the
+// four registers corresponds to one of the header bytes.
+//
+// See FindHeader_Scalar for the return value.
+UINT                                    // Returns offset of header
+FindHeader_SSE2(
+  LPCBYTE data,                         // Data to search
+  UINT insize)                          // Number of bytes in data
+{
+  UINT result = insize;
+  UINT i = 0;
+
+  if (insize >= 16 + 3)
+  {
+    const __m128i ff = _mm_set1_epi8((char)0xFF);
+    const __m128i m01 = _mm_set1_epi8(0x01);
+    const __m128i mf0 = _mm_set1_epi8((char)0xF0);
+    const __m128i mc0 = _mm_set1_epi8((char)0xC0);
+    const __m128i m0c = _mm_set1_epi8(0x0C);
+
+    for (; i + 16 + 3 <= insize; i += 16)
+    {
+      __m128i b1;
+      __m128i b2;
+      __m128i b3;
+      __m128i ok;
+      __m128i bad;
+      UINT32 mask;
+
+      // Most of the time, there is no sync byte at all, so check that
+      // first before checking the other bytes.
+      ok = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i)), ff);
+      if (!_mm_movemask_epi8(ok))
+      {
+        continue;
+      }
+
+      b1 = _mm_loadu_si128((const __m128i *)(data + i + 1));
+      b2 = _mm_loadu_si128((const __m128i *)(data + i + 2));
+      b3 = _mm_loadu_si128((const __m128i *)(data + i + 3));
+
+      ok  = _mm_and_si128(ok, _mm_cmpeq_epi8(_mm_or_si128(b1, m01), ff));
+      ok  = _mm_and_si128(ok, _mm_cmpeq_epi8(_mm_and_si128(b2, mf0), mc0));
+      bad = _mm_cmpeq_epi8(_mm_and_si128(b2, m0c), m0c);
+      bad = _mm_or_si128(bad, _mm_cmpeq_epi8(_mm_and_si128(b3, mc0), mc0));
+      ok  = _mm_andnot_si128(bad, ok);
+
+      mask = (UINT32)_mm_movemask_epi8(ok);
+      if (mask)
+      {
+        result = i + LowestBit(mask);
+        break;
+      }
+    }
+  }
+
+  if (result == insize)
+  {
+    // Check the rest of the data
+    result = i + FindHeader_Scalar(data + i, insize - i);
+  }
+
+  return result;
+}
+#endif
+
+
+#ifdef DCCU_AVX2
+//---------------------------------------------------------------------------
+// Find the first valid DCC header using AVX2
+//
+// Same as FindHeader_SSE2 but checks 32 locations at a time.
+UINT                                    // Returns offset of header
+FindHeader_AVX2(
+  LPCBYTE data,                         // Data to search
+  UINT insize)                          // Number of bytes in data
+{
+  UINT result = insize;
+  UINT i = 0;
+
+  if (insize >= 32 + 3)
+  {
+    const __m256i ff = _mm256_set1_epi8((char)0xFF);
+    const __m256i m01 = _mm256_set1_epi8(0x01);
+    const __m256i mf0 = _mm256_set1_epi8((char)0xF0);
+    const __m256i mc0 = _mm256_set1_epi8((char)0xC0);
+    const __m256i m0c = _mm256_set1_epi8(0x0C);
+
+    for (; i + 32 + 3 <= insize; i += 32)
+    {
+      __m256i b1;
+      __m256i b2;
+      __m256i b3;
+      __m256i ok;
+      __m256i bad;
+      UINT32 mask;
+
+      // Most of the time, there is no sync byte at all, so check that
+      // first before checking the other bytes.
+      ok = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i)), ff);
+      if (!_mm256_movemask_epi8(ok))
+      {
+        continue;
+      }
+
+      b1 = _mm256_loadu_si256((const __m256i *)(data + i + 1));
+      b2 = _mm256_loadu_si256((const __m256i *)(data + i + 2));
+      b3 = _mm256_loadu_si256((const __m256i *)(data + i + 3));
+
+      ok  = _mm256_and_si256(ok, _mm256_cmpeq_epi8(_mm256_or_si256(b1, m01), ff));
+      ok  = _mm256_and_si256(ok, _mm256_cmpeq_epi8(_mm256_and_si256(b2, mf0), mc0));
+      bad = _mm256_cmpeq_epi8(_mm256_and_si256(b2, m0c), m0c);
+      bad = _mm256_or_si256(bad, _mm256_cmpeq_epi8(_mm256_and_si256(b3, mc0), mc0));
+      ok  = _mm256_andnot_si256(bad, ok);
+
+      mask = (UINT32)_mm256_movemask_epi8(ok);
+      if (mask)
+      {
+        result = i + LowestBit(mask);
+        break;
+      }
+    }
+  }
+
+  if (result == insize)
+  {
+    // Check the rest of the data
+    result = i + FindHeader_Scalar(data + i, insize - i);
+  }
+
+  return result;
+}
+#endif
+
+
+//---------------------------------------------------------------------------
+// Find the first valid DCC header using the best available implementation
+//
+// See FindHeader_Scalar for the return value.
+UINT                                    // Returns offset of header
+FindHeader(
+  LPCBYTE data,                         // Data to search
+  UINT insize)                          // Number of bytes in data
+{
+#if defined(DCCU_AVX2)
+  return FindHeader_AVX2(data, insize);
+#elif defined(DCCU_SSE2)
+  return FindHeader_SSE2(data, insize);
+#else
+  return FindHeader_Scalar(data, insize);
+#endif
+}
+
+
+//---------------------------------------------------------------------------
+// Decode an MPEG-1 Layer 1 header for DCC
+//
+// The frame must start with:
+// Index 0:
+// 8  bits sync (binary 11111111)                         - FF
+//
+// Index 1:
+// 4  bits sync (binary 1111)                             \
+// 1  bit  ID (1=MPEG)                                    | FF or FE
+// 2  bits layer (binary 11 for layer 1)                  |
+// 1  bit  protection (=CRC added after header) (1=no)    /
+//
+// Index 2:
+// 4  bits bit rate (1100 = 384kbps for layer 1)          \
+// 2  bits sample freq (00=44kHz 01=48kHz 10=32kHz 11=res)| C0/C2 (44.1)
+// 1  bit  indicates 44.1kHz frame is padded              | or C4 (48)
+// 1  bit  private bit (ignored)                          / or C6 (32)
+//
+// Index 3:
+// 2  bits mode (00=stereo 01=joint 10=2ch 11=res./mono)  \
+// 2  bits mode extension for joint stereo (ignored)      | Usually 0C
+// 1  bit  copyright protected (1=yes, 0=no) (ignored)    | or 00
+// 1  bit  original (1=original 0=copy) (ignored)         |
+// 2  bits emphasis (00=none 01=50/15us 10=res. 11=CCITT) /
+//
+// The total size of the frame including the header is
+// (48 * 384000 / samplerate). For 44.1 kHz this doesn't yield an integer
+// result, so some frames have 4 bytes extra data based on header[2] bit 2.
+//
+// This function is only used to generate the header table (see below);
+// the sync byte at index 0 is not checked here.
+void
+DecodeHeader(
+  LPCBYTE frame,                        // Pointer to start of frame
+  HEADERINFO *phi)                      // Output header information
+{
+  ERR result = ERR_OK;
+  UINT framesize = 0;
+  UINT skipsize = 0;
+  RATEID rateid = RATEID_UNKNOWN;
+
+  if (!result)
+  {
+    // Check that frame[1] == 0b1111xxxx
+    //
+    // The header must start with a sync word
+    if ((frame[1] & 0xF0) != 0xF0)
+    {
+      result = ERR_SYNC;
+    }
+  }
+
+  if (!result)
+  {
+    // Check that frame[1] == 0bxxxx1xxx
+    //
+    // We can only do MPEG 1
+    if ((frame[1] & 0x08) != 0x08)
+    {
+      result = ERR_DATA_NOT_MPEG1;
+    }
+  }
+
+  if (!result)
+  {
+    // Check that frame[1] == 0bxxxxx11x
+    //
+    // We can only do layer 1
+    if ((frame[1] & 0x6) != 0x6)
+    {
+      result = ERR_DATA_NOT_LAYER1;
+    }
+  }
+
+  // frame[1] bit 0 indicates whether a CRC follows the header (0) or not (1)
+  // We deal with that while copying the frame.
+
+  if (!result)
+  {
+    // Check that frame[2] == 0b1100xxxx
+    //
+    // The bit rate must be 384kbps
+    if ((frame[2] & 0xF0) != 0xC0)
+    {
+      result = ERR_DATA_NOT_384KBPS;
+    }
+  }
+
+  // frame[2] bits 3-2 are the sample frequency, we'll get to those below.
+  // frame[2] bit  1 is the padding bit, also handled below.
+  // frame[2] bit  0 is the user bit and is ignored.
+
+  if (!result)
+  {
+    // Check that frame[3] == 0b11xxxxxx
+    //
+    // The channel mode cannot be 11 binary (mono).
+    // DCC doesn't support mono, only dual mono on prerecorded cassettes.
+    // TODO: We could change mono mode to stereo by duplicating the data.
+    if ((frame[3] & 0xC0) == 0xC0)
+    {
+      result = ERR_DATA_BAD_CHANMODE;
+    }
+  }
+
+  // frame[3] bits 5-4 are used for joint stereo encoding
+  // frame[3] bit  3 is copyright. TODO: Allow setting/clearing?
+  // frame[3] bit  2 is the copied-flag. TODO: Allow setting/clearing?
+  // frame[3] bits 1-0 are used for emphasis
+
+  if (!result)
+  {
+    // Evaluate frame[2] bits 3-2 (sample rate) and bit 1 (padding)
+    //
+    // The frame size in bytes is 48 * 384000 / samplerate according to the
+    // standard.
+    //
+    // For 44.1kHz frames, that calculation is not an integer so
+    // some frames are shorter and some are longer.
+    switch (frame[2] & 0x0C)
+    {
+    case 0x00:
+      rateid = RATEID_44100;
+      framesize = 416 + 4 * ((frame[2] & 0x2) != 0); // Padding is only used at 44.1.
+      break;
+
+    case 0x04:
+      rateid = RATEID_48000;
+      framesize = 384;
+      break;
+
+    case 0x08:
+      rateid = RATEID_32000;
+      framesize = 576;
+      break;
+
+    default:
+      result = ERR_DATA_BAD_SAMPLERATE;
+      break;
+    }
+  }
+
+  if ( (result == ERR_SYNC)
+    || (result == ERR_DATA_NOT_MPEG1)
+    || (result == ERR_DATA_NOT_LAYER1)
+    || (result == ERR_DATA_NOT_384KBPS)
+    || (result == ERR_DATA_BAD_CHANMODE))
+  {
+    // We lost sync. The next header can't start before the first byte
+    // that may be 0xFF.
+    for (skipsize = 1; skipsize < 4; skipsize++)
+    {
+      if (frame[skipsize] == 0xFF)
+      {
+        break;
+      }
+    }
+  }
+
+  phi->err      = (BYTE)result;
+  phi->flags    = (BYTE)(skipsize | ((frame[1] & 0x01) ? 0 : HEADERINFO_CRC));
+  phi->rateid   = (BYTE)rateid;
+  phi->numslots = (BYTE)(framesize / 4);
+}
+
+
+//---------------------------------------------------------------------------
+// Generate the header table
+//
+// This must be called once before GetFrameSize is used.
+//
+// The table is indexed by the bits from header bytes 1-3 that DecodeHeader
+// checks (see HEADER_KEY). For each entry, DecodeHeader is called with a
+// header that has those bits, so the table gives exactly the same results
+// as checking the header bits one by one, but without all the branches.
+void
+HeaderTable_Init(void)
+{
+  UINT key;
+
+  for (key = 0; key < HEADER_TABLE_SIZE; key++)
+  {
+    BYTE header[4];
+
+    header[0] = 0xFF;
+    header[1] = (BYTE)(key >> 8);
+    header[2] = (BYTE)(key & 0xFE);
+    header[3] = (BYTE)((key & 0x01) ? 0xC0 : 0x00);
+
+    // Bytes 2 and 3 may be 0xFF in the original header if they were
+    // 0xFE or 0xC0 in the table key, so the skip size must take that
+    // into account.
+    if (header[2] == 0xFE)
+    {
+      header[2] = 0xFF;
+    }
+
+    if (header[3] == 0xC0)
+    {
+      header[3] = 0xFF;
+    }
+
+    DecodeHeader(header, &HeaderTable[key]);
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Determine MPEG-1 Layer 1 frame size based on header
+//
+// See DecodeHeader for the layout of the header. The actual checks are
+// done by looking up the header in the header table.
+//
+// If the data doesn't start with a valid header, the skip size is set to
+// the offset of the next valid header, or to the end of the data.
+ERR                                     // Returns error code
+GetFrameSize(
+  LPCBYTE frame,                        // Pointer to start of frame
+  UINT insize,                          // Number of available bytes
+  PUINT pframesize,                     // Output required frame size
+  PUINT pskipsize,                      // Output amount of input to skip
+  RATEID *prateid)                      // Output sample rate enum
+{
+  ERR result = ERR_OK;
+  UINT framesize = 0;
+  UINT skipsize = 0;
+  RATEID rateid = RATEID_UNKNOWN;
+
+  if (!result)
+  {
+    // The header must be at least 4 bytes
+    //
+    // If there's less data, read more from the input file.
+    if (insize < 4)
+    {
+      result = ERR_INSUFFICIENT_DATA;
+    }
+  }
+
+  if (!result)
+  {
+    // The header must start with a sync word
+    if (frame[0] != 0xFF)
+    {
+      result = ERR_SYNC;
+      skipsize = 1;
+    }
+    else
+    {
+      const HEADERINFO *phi = &HeaderTable[HEADER_KEY(frame)];
+
+      result    = (ERR)phi->err;
+      skipsize  = phi->flags & HEADERINFO_SKIPMASK;
+      rateid    = (RATEID)phi->rateid;
+      framesize = phi->numslots * 4;
+    }
+
+    if (skipsize)
+    {
+      // We lost sync. Skip to the next location that has a valid header,
+      // or to the end of the data if there isn't one.
+      skipsize += FindHeader(frame + skipsize, insize - skipsize);
+    }
+  }
+
+  if (prateid)
+  {
+    *prateid = rateid;
+  }
+
+  if (pframesize)
+  {
+    *pframesize = framesize;
+  }
+
+  if (pskipsize)
+  {
+    *pskipsize = skipsize;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Estimate the peak level of each channel in a frame
+//
+// In Layer 1, each subband that has bits allocated to it has a scale
+// factor, which is the maximum amplitude of the samples in that subband.
+// The largest scale factor in each channel is used as an estimate of the
+// peak level of the channel, so the audio doesn't have to be decoded.
+//
+// The frame must have a valid header (see GetFrameSize). DCC doesn't
+// support mono so there are always two channels.
+void
+GetFrameLevels(
+  LPCBYTE frame,                        // Frame with valid header
+  LPBYTE plevels)                       // Output levels for 2 channels
+{
+  BYTE allocation[64];
+  UINT minindex[2];
+  LPCBYTE p;
+  UINT bound = 32;
+  UINT pos;
+  UINT sb;
+  UINT i;
+
+  // In joint stereo mode, the subbands from the bound upwards have one
+  // allocation for both channels
+  if ((frame[3] & 0xC0) == 0x40)
+  {
+    bound = ((frame[3] >> 4) & 0x03) * 4 + 4;
+  }
+
+  // Get the bit allocations, skipping the header and the CRC (if any).
+  // The allocations are 4 bits each, so below the bound, each byte has
+  // the allocations for both channels of a subband. They're stored in
+  // the order of the scale factors: channel 0 and 1 of each subband.
+  p = frame + ((frame[1] & 0x01) ? 4 : 6);
+
+  for (sb = 0; sb < bound; sb++)
+  {
+    allocation[sb * 2]     = (BYTE)(p[sb] >> 4);
+    allocation[sb * 2 + 1] = (BYTE)(p[sb] & 0x0F);
+  }
+
+  p += bound;
+
+  for (sb = bound; sb < 32; sb++)
+  {
+    UINT n = sb - bound;
+
+    allocation[sb * 2] = (BYTE)((p[n >> 1] >> ((n & 1) ? 0 : 4)) & 0x0F);
+    allocation[sb * 2 + 1] = allocation[sb * 2];
+  }
+
+  // Find the largest scale factor (i.e. the lowest index) for each
+  // channel. The scale factors are 6 bits each, only for subbands that
+  // have bits allocated to them. Whether a subband has bits is hard to
+  // predict, so this is done without branches: the scale factor is
+  // always read but it's ignored and skipped if there's no allocation.
+  pos = (UINT)(p - frame) * 8 + (32 - bound) * 4;
+  minindex[0] = 63;
+  minindex[1] = 63;
+
+  for (i = 0; i < 64; i += 2)
+  {
+    UINT ch;
+
+    for (ch = 0; ch < 2; ch++)
+    {
+      UINT allocated = (allocation[i + ch] != 0);
+      UINT index = ((((UINT)frame[pos >> 3] << 8) | frame[(pos >> 3) + 1]) >> (10 - (pos & 7))) & 0x3F;
+
+      index |= (allocated - 1) & 0x3F;
+
+      if (index < minindex[ch])
+      {
+        minindex[ch] = index;
+      }
+
+      pos += allocated * 6;
+    }
+
+    // Stop when both channels are at full scale (see LevelTable)
+    if ((minindex[0] | minindex[1]) <= 3)
+    {
+      break;
+    }
+  }
+
+  plevels[0] = LevelTable[minindex[0]];
+  plevels[1] = LevelTable[minindex[1]];
+}
+
+
+//---------------------------------------------------------------------------
+// Generate the CRC table
+//
+// This must be called once before GetFrameCrc is used.
+//
+// MPEG audio uses the CRC-16 polynomial x^16 + x^15 + x^2 + 1, most
+// significant bit first. Each entry is the CRC of one byte, so the CRC
+// can be calculated one byte at a time instead of one bit at a time.
+void
+CrcTable_Init(void)
+{
+  UINT i;
+
+  for (i = 0; i < 256; i++)
+  {
+    UINT crc = i << 8;
+    UINT bit;
+
+    for (bit = 0; bit < 8; bit++)
+    {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x8005 : (crc << 1);
+    }
+
+    CrcTable[i] = (UINT16)crc;
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Calculate the CRC of a Layer 1 frame
+//
+// In Layer 1, the CRC protects the last two bytes of the header and the
+// bit allocations, which follow the CRC. Those are the bits that would
+// make the rest of the frame decode as garbage if they were wrong.
+//
+// The frame must have a valid header (see GetFrameSize) with the
+// protection bit cleared; the calculated CRC should be equal to the
+// 16 bits after the header. DCC doesn't support mono so there are always
+// two channels.
+UINT16                                  // Returns CRC
+GetFrameCrc(
+  LPCBYTE frame)                        // Frame with valid header
+{
+  UINT crc = 0xFFFF;
+  UINT bound = 32;
+  UINT size;
+  UINT i;
+
+  // In joint stereo mode, the subbands from the bound upwards have one
+  // allocation for both channels (see GetFrameLevels)
+  if ((frame[3] & 0xC0) == 0x40)
+  {
+    bound = ((frame[3] >> 4) & 0x03) * 4 + 4;
+  }
+
+  // The bound is a multiple of 4, so the allocations take a whole number
+  // of bytes
+  size = bound + (32 - bound) / 2;
+
+  crc = ((crc << 8) ^ CrcTable[(crc >> 8) ^ frame[2]]) & 0xFFFF;
+  crc = ((crc << 8) ^ CrcTable[(crc >> 8) ^ frame[3]]) & 0xFFFF;
+
+  for (i = 0; i < size; i++)
+  {
+    crc = ((crc << 8) ^ CrcTable[(crc >> 8) ^ frame[6 + i]]) & 0xFFFF;
+  }
+
+  return (UINT16)crc;
+}
+
+
+//---------------------------------------------------------------------------
+// Get the distance between frames in an MPP file
+//
+// DCC-Studio stores all frames in an MPP file at the same distance, so
+// that it can easily seek to any frame. At 44.1kHz, frames that are 416
+// bytes are followed by 4 bytes of padding.
+UINT                                    // Returns stride; 0=invalid rate
+GetMppStride(
+  RATEID rateid)                        // Rate ID
+{
+  UINT result = 0;
+
+  switch (rateid)
+  {
+  case RATEID_32000:
+    result = 576;
+    break;
+
+  case RATEID_44100:
+    result = 420;
+    break;
+
+  case RATEID_48000:
+    result = 384;
+    break;
+
+  default:
+    break;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Get the sample rate in Hz for a rate ID
+UINT                                    // Returns sample rate; 0=invalid
+GetSampleRate(
+  RATEID rateid)                        // Rate ID
+{
+  UINT result = 0;
+
+  switch (rateid)
+  {
+  case RATEID_32000:
+    result = 32000;
+    break;
+
+  case RATEID_44100:
+    result = 44100;
+    break;
+
+  case RATEID_48000:
+    result = 48000;
+    break;
+
+  default:
+    break;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Initialize the tables for the Layer 1 decoder
+//
+// This must be called once before the decoder is used.
+void
+SynthesisTables_Init(void)
+{
+  UINT i;
+  UINT k;
+
+  // Synthesis window (see SynthesisWindowBase)
+  for (i = 0; i < 512; i++)
+  {
+    FLOAT d = (FLOAT)SynthesisWindowBase[(i <= 256) ? i : 512 - i] / 65536.0f;
+
+    SynthesisWindow[i] = (((i / 64) & 1) ? -d : d);
+  }
+
+  // Matrixing. Each V vector has 64 values:
+  //   V[i] = sum(k = 0..31) of cos((16 + i) * (2k + 1) * pi / 64) * S[k]
+  // but only 32 of them are unique: V[16] = 0, V[32 - i] = -V[i] and
+  // V[96 - i] = V[i]. So the matrix only calculates V[0..15] and
+  // V[33..48] (see Synthesis_StoreV).
+  for (k = 0; k < 32; k++)
+  {
+    for (i = 0; i < 32; i++)
+    {
+      UINT n = (i < 16 ? i : i + 17);
+
+      SynthesisMatrix[k][i] = (FLOAT)cos((16 + n) * (2 * k + 1) * DCCU_PI / 64);
+    }
+  }
+
+  // Scale factor n is 2 * 2^(-n/3). Index 63 is not allowed.
+  for (i = 0; i < 63; i++)
+  {
+    ScaleFactorTable[i] = (FLOAT)(2.0 * pow(2.0, -(double)i / 3.0));
+  }
+
+  ScaleFactorTable[63] = 0;
+
+  // Samples of n bits are dequantized to 2 * (x + 1) / (2^n - 1)
+  for (i = 2; i < 16; i++)
+  {
+    DequantizeTable[i] = (FLOAT)(2.0 / ((1 << i) - 1));
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Store the V vector of the synthesis filter from the 32 unique values
+void
+Synthesis_StoreV(
+  FLOAT *v,                             // Output V vector (64 values)
+  const FLOAT *a)                       // V[0..15] and V[33..48]
+{
+  UINT i;
+
+  v[16] = 0;
+
+  for (i = 0; i < 16; i++)
+  {
+    v[i] = a[i];
+    v[32 - i] = -a[i];
+    v[33 + i] = a[16 + i];
+  }
+
+  for (i = 33; i < 48; i++)
+  {
+    v[96 - i] = v[i];
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Synthesis filter for one block of 32 subband samples
+//
+// This is the synthesis filter from ISO 11172-3 (figure A.2). The new V
+// vector is stored in the ring buffer at vindex (the caller moves vindex
+// back by one for each block) and the output is calculated from the V
+// vectors of the last 16 blocks:
+//   out[j] = sum(i = 0..7) of V(2i)[j] * D[64i + j]
+//                            + V(2i + 1)[32 + j] * D[64i + 32 + j]
+// where V(n) is the V vector from n blocks ago.
+void
+Synthesis_Scalar(
+  FLOAT (*v)[64],                       // Ring buffer with 16 V vectors
+  UINT vindex,                          // Index of new V vector
+  const FLOAT *samples,                 // 32 subband samples
+  FLOAT *output)                        // Output 32 PCM samples
+{
+  FLOAT a[32];
+  UINT i;
+  UINT j;
+  UINT k;
+
+  // Matrixing
+  for (i = 0; i < 32; i++)
+  {
+    a[i] = 0;
+  }
+
+  for (k = 0; k < 32; k++)
+  {
+    for (i = 0; i < 32; i++)
+    {
+      a[i] += samples[k] * SynthesisMatrix[k][i];
+    }
+  }
+
+  Synthesis_StoreV(v[vindex], a);
+
+  // Windowing
+  for (j = 0; j < 32; j++)
+  {
+    FLOAT sum = 0;
+
+    for (i = 0; i < 8; i++)
+    {
+      sum += v[(vindex + 2 * i) & 15][j] * SynthesisWindow[64 * i + j];
+      sum += v[(vindex + 2 * i + 1) & 15][32 + j] * SynthesisWindow[64 * i + 32 + j];
+    }
+
+    output[j] = sum;
+  }
+}
+
+
+#ifdef DCCU_SSE2
+//---------------------------------------------------------------------------
+// Synthesis filter for one block of 32 subband samples, using SSE2
+//
+// This does the same as Synthesis_Scalar, 4 values at a time. The results
+// can differ in the last bit because the additions are done in a
+// different order.
+void
+Synthesis_SSE2(
+  FLOAT (*v)[64],                       // Ring buffer with 16 V vectors
+  UINT vindex,                          // Index of new V vector
+  const FLOAT *samples,                 // 32 subband samples
+  FLOAT *output)                        // Output 32 PCM samples
+{
+  __m128 sum[8];
+  FLOAT a[32];
+  UINT i;
+  UINT j;
+  UINT k;
+
+  // Matrixing
+  for (i = 0; i < 8; i++)
+  {
+    sum[i] = _mm_setzero_ps();
+  }
+
+  for (k = 0; k < 32; k++)
+  {
+    __m128 s = _mm_set1_ps(samples[k]);
+
+    for (i = 0; i < 8; i++)
+    {
+      sum[i] = _mm_add_ps(sum[i], _mm_mul_ps(s, _mm_loadu_ps(&SynthesisMatrix[k][4 * i])));
+    }
+  }
+
+  for (i = 0; i < 8; i++)
+  {
+    _mm_storeu_ps(&a[4 * i], sum[i]);
+  }
+
+  Synthesis_StoreV(v[vindex], a);
+
+  // Windowing
+  for (j = 0; j < 32; j += 4)
+  {
+    __m128 s0 = _mm_setzero_ps();
+    __m128 s1 = _mm_setzero_ps();
+
+    for (i = 0; i < 8; i++)
+    {
+      s0 = _mm_add_ps(s0, _mm_mul_ps(
+        _mm_loadu_ps(&v[(vindex + 2 * i) & 15][j]),
+        _mm_loadu_ps(&SynthesisWindow[64 * i + j])));
+      s1 = _mm_add_ps(s1, _mm_mul_ps(
+        _mm_loadu_ps(&v[(vindex + 2 * i + 1) & 15][32 + j]),
+        _mm_loadu_ps(&SynthesisWindow[64 * i + 32 + j])));
+    }
+
+    _mm_storeu_ps(&output[j], _mm_add_ps(s0, s1));
+  }
+}
+#endif
+
+
+//---------------------------------------------------------------------------
+// Synthesis filter, using the fastest available implementation
+void
+Synthesis(
+  FLOAT (*v)[64],                       // Ring buffer with 16 V vectors
+  UINT vindex,                          // Index of new V vector
+  const FLOAT *samples,                 // 32 subband samples
+  FLOAT *output)                        // Output 32 PCM samples
+{
+#ifdef DCCU_SSE2
+  Synthesis_SSE2(v, vindex, samples, output);
+#else
+  Synthesis_Scalar(v, vindex, samples, output);
+#endif
+}
+
+
+//---------------------------------------------------------------------------
+// Read bits from a frame
+//
+// At most 17 bits can be read at a time. This reads up to 2 bytes beyond
+// the last bit.
+UINT                                    // Returns bits
+decoder_ReadBits(
+  LPCBYTE data,                         // Data to read
+  UINT *ppos,                           // Bit position, updated
+  UINT numbits)                         // Number of bits
+{
+  UINT pos = *ppos;
+  UINT window = ((UINT)data[pos >> 3] << 16) | ((UINT)data[(pos >> 3) + 1] << 8) | data[(pos >> 3) + 2];
+
+  *ppos = pos + numbits;
+
+  return (window >> (24 - (pos & 7) - numbits)) & ((1 << numbits) - 1);
+}
+
+
+//---------------------------------------------------------------------------
+// Destroy a decoder
+void
+decoder_Destroy(
+  HDECODER hd)                          // Decoder handle
+{
+  if (hd)
+  {
+    free(hd);
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Create a Layer 1 decoder
+ERR                                     // Returns error code
+decoder_Create(
+  HDECODER *phd)                        // Ptr to handle; must point to NULL
+{
+  ERR result = ERR_OK;
+  HDECODER hd = NULL;
+
+  if (!result)
+  {
+    if ((!phd) || (*phd))
+    {
+      result = ERR_PARAMETER;
+    }
+  }
+
+  if (!result)
+  {
+    // The synthesis filter starts with silence
+    if (!(hd = (HDECODER)calloc(1, sizeof(DECODER))))
+    {
+      result = ERR_MALLOC;
+    }
+  }
+
+  if (phd)
+  {
+    *phd = hd;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Decode a Layer 1 frame to 16 bit stereo PCM
+//
+// The frame must have a valid header (see GetFrameSize). A frame with an
+// invalid bit allocation, or one that needs more bits than the frame
+// has, is decoded as silence.
+void
+decoder_DecodeFrame(
+  HDECODER hd,                          // Decoder handle
+  LPCBYTE frame,                        // Frame with valid header
+  UINT framesize,                       // Frame size in bytes
+  SHORT *pcm)                           // Output 384 stereo samples
+{
+  BYTE data[MAX_FRAME_SIZE + 4];
+  BYTE numbits[2][32];
+  FLOAT scale[2][32];
+  FLOAT samples[2][32];
+  FLOAT output[32];
+  BOOL valid = TRUE;
+  UINT bound = 32;
+  UINT needed;
+  UINT pos;
+  UINT sb;
+  UINT ch;
+  UINT s;
+  UINT j;
+
+  // The bit reader may read a little beyond the end of the frame, so
+  // work on a copy of the frame with some zeroes after it.
+  if (framesize > MAX_FRAME_SIZE)
+  {
+    framesize = MAX_FRAME_SIZE;
+    valid = FALSE;
+  }
+
+  memcpy(data, frame, framesize);
+  memset(data + framesize, 0, 4);
+
+  // In joint stereo mode, the subbands from the bound upwards have one
+  // allocation and one set of samples for both channels
+  if ((data[3] & 0xC0) == 0x40)
+  {
+    bound = ((data[3] >> 4) & 0x03) * 4 + 4;
+  }
+
+  // Skip the header and the CRC (if any)
+  pos = ((data[1] & 0x01) ? 32 : 48);
+
+  // Bit allocation
+  for (sb = 0; sb < 32; sb++)
+  {
+    for (ch = 0; ch < 2; ch++)
+    {
+      if ((ch == 0) || (sb < bound))
+      {
+        UINT allocation = decoder_ReadBits(data, &pos, 4);
+
+        if (allocation == 15)
+        {
+          valid = FALSE;
+        }
+
+        numbits[ch][sb] = (BYTE)(allocation ? allocation + 1 : 0);
+      }
+      else
+      {
+        numbits[ch][sb] = numbits[0][sb];
+      }
+    }
+  }
+
+  // Make sure the scale factors and samples fit in the frame
+  needed = pos;
+
+  for (sb = 0; sb < 32; sb++)
+  {
+    for (ch = 0; ch < 2; ch++)
+    {
+      if (numbits[ch][sb])
+      {
+        needed += 6;
+
+        if ((ch == 0) || (sb < bound))
+        {
+          needed += 12 * numbits[ch][sb];
+        }
+      }
+    }
+  }
+
+  if ((!valid) || (needed > framesize * 8))
+  {
+    // Decode silence, so the synthesis filter fades out smoothly
+    memset(numbits, 0, sizeof(numbits));
+  }
+
+  // Scale factors
+  for (sb = 0; sb < 32; sb++)
+  {
+    for (ch = 0; ch < 2; ch++)
+    {
+      scale[ch][sb] = (numbits[ch][sb] ? ScaleFactorTable[decoder_ReadBits(data, &pos, 6)] : 0);
+    }
+  }
+
+  // Samples: 12 blocks of 32 subbands
+  for (s = 0; s < 12; s++)
+  {
+    for (sb = 0; sb < 32; sb++)
+    {
+      FLOAT value = 0;
+
+      for (ch = 0; ch < 2; ch++)
+      {
+        if ((ch == 0) || (sb < bound))
+        {
+          UINT n = numbits[ch][sb];
+
+          value = 0;
+
+          if (n)
+          {
+            // The most significant bit is inverted, the rest is a
+            // two's complement fraction
+            INT x = (INT)(decoder_ReadBits(data, &pos, n) ^ (1 << (n - 1)));
+
+            x -= (x & (1 << (n - 1))) << 1;
+            value = (FLOAT)(x + 1) * DequantizeTable[n];
+          }
+        }
+
+        samples[ch][sb] = value * scale[ch][sb];
+      }
+    }
+
+    hd->vindex = (hd->vindex - 1) & 15;
+
+    for (ch = 0; ch < 2; ch++)
+    {
+      Synthesis(hd->v[ch], hd->vindex, samples[ch], output);
+
+      for (j = 0; j < 32; j++)
+      {
+        FLOAT f = output[j] * 32768.0f;
+        LONG l;
+
+        if (f >= 32767.0f)
+        {
+          l = 32767;
+        }
+        else if (f <= -32768.0f)
+        {
+          l = -32768;
+        }
+        else
+        {
+          l = (LONG)(f + (f >= 0 ? 0.5f : -0.5f));
+        }
+
+        pcm[(s * 32 + j) * 2 + ch] = (SHORT)l;
+      }
+    }
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Store a little-endian value in a buffer
+void
+StoreLE(
+  LPBYTE p,                             // Where to store the value
+  UINT32 value,                         // Value to store
+  UINT numbytes)                        // Number of bytes
+{
+  UINT i;
+
+  for (i = 0; i < numbytes; i++)
+  {
+    p[i] = (BYTE)(value >> (i * 8));
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Load a little-endian value from a buffer
+UINT32                                  // Returns value
+LoadLE(
+  LPCBYTE p,                            // Where to load the value from
+  UINT numbytes)                        // Number of bytes
+{
+  UINT32 result = 0;
+  UINT i;
+
+  for (i = numbytes; i > 0; i--)
+  {
+    result = (result << 8) | p[i - 1];
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Count the bits that are set in a 32 bit value
+UINT                                    // Returns number of bits set
+BitCount(
+  UINT32 value)                         // Value
+{
+  value = value - ((value >> 1) & 0x55555555);
+  value = (value & 0x33333333) + ((value >> 2) & 0x33333333);
+  value = (value + (value >> 4)) & 0x0F0F0F0F;
+
+  return (value * 0x01010101) >> 24;
+}
+
+
+//---------------------------------------------------------------------------
+// Destroy a frame index
+void
+frameindex_Destroy(
+  HFRAMEINDEX hfi)                      // Frame index handle
+{
+  if (hfi)
+  {
+    free(hfi->padding);
+    free(hfi->padcount);
+    free(hfi->segments);
+    free(hfi);
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Create an empty frame index
+ERR                                     // Returns error code
+frameindex_Create(
+  HFRAMEINDEX *phfi)                    // Ptr to handle; must point to NULL
+{
+  ERR result = ERR_OK;
+  HFRAMEINDEX hfi = NULL;
+
+  if (!result)
+  {
+    if ((!phfi) || (*phfi))
+    {
+      result = ERR_PARAMETER;
+    }
+  }
+
+  if (!result)
+  {
+    if (!(hfi = (HFRAMEINDEX)calloc(1, sizeof(FRAMEINDEX))))
+    {
+      result = ERR_MALLOC;
+    }
+  }
+
+  if (phfi)
+  {
+    *phfi = hfi;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Add a frame to the end of a frame index
+ERR                                     // Returns error code
+frameindex_Add(
+  HFRAMEINDEX hfi,                      // Frame index handle
+  UINT64 offset,                        // File offset of frame
+  LPCBYTE frame,                        // Frame with valid header
+  UINT framesize)                       // Frame size in bytes
+{
+  ERR result = ERR_OK;
+  BOOL padded = ((frame[2] & 0x02) != 0);
+  UINT32 basesize = framesize - (padded ? 4 : 0);
+
+  if ((!result) && (hfi->numframes == hfi->maxframes))
+  {
+    // Make room for more bits in the bitmap
+    UINT32 maxframes = (hfi->maxframes ? hfi->maxframes * 2 : 65536);
+    UINT32 *padding = (UINT32 *)realloc(hfi->padding, maxframes / 8);
+
+    if (!padding)
+    {
+      result = ERR_MALLOC;
+    }
+    else
+    {
+      memset(padding + hfi->maxframes / 32, 0, (maxframes - hfi->maxframes) / 8);
+      hfi->padding = padding;
+      hfi->maxframes = maxframes;
+    }
+  }
+
+  if ( (!result)
+    && ( (!hfi->numsegments)
+      || (offset != hfi->nextoffset)
+      || (basesize != hfi->segments[hfi->numsegments - 1].framesize)))
+  {
+    // The frame isn't where the previous frame ends, or it has a
+    // different size. Start a new segment.
+    if (hfi->numsegments == hfi->maxsegments)
+    {
+      UINT32 maxsegments = (hfi->maxsegments ? hfi->maxsegments * 2 : 16);
+      FRAMESEGMENT *segments = (FRAMESEGMENT *)realloc(hfi->segments, maxsegments * sizeof(FRAMESEGMENT));
+
+      if (!segments)
+      {
+        result = ERR_MALLOC;
+      }
+      else
+      {
+        hfi->segments = segments;
+        hfi->maxsegments = maxsegments;
+      }
+    }
+
+    if (!result)
+    {
+      FRAMESEGMENT *psegment = &hfi->segments[hfi->numsegments++];
+
+      psegment->offset = offset;
+      psegment->firstframe = hfi->numframes;
+      psegment->framesize = basesize;
+    }
+  }
+
+  if (!result)
+  {
+    if (padded)
+    {
+      hfi->padding[hfi->numframes / 32] |= (UINT32)1 << (hfi->numframes % 32);
+    }
+
+    hfi->numframes++;
+    hfi->nextoffset = offset + framesize;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Get the location of a frame from a frame index
+//
+// The index must have been loaded by frameindex_Load. This takes the
+// same time for every frame, regardless of the size of the file.
+ERR                                     // Returns error code
+frameindex_GetFrame(
+  HFRAMEINDEX hfi,                      // Frame index handle
+  UINT32 frame,                         // Frame number
+  UINT64 *poffset,                      // Output file offset of frame
+  UINT *pframesize)                     // Output frame size
+{
+  ERR result = ERR_OK;
+
+  if (!result)
+  {
+    if ((!hfi) || (!hfi->padcount) || (frame >= hfi->numframes))
+    {
+      result = ERR_PARAMETER;
+    }
+  }
+
+  if (!result)
+  {
+    const FRAMESEGMENT *psegment;
+    UINT32 first;
+    UINT32 numpadded;
+    UINT lo = 0;
+    UINT hi = hfi->numsegments - 1;
+
+    // Find the last segment that starts at or before the frame
+    while (lo < hi)
+    {
+      UINT mid = (lo + hi + 1) / 2;
+
+      if (hfi->segments[mid].firstframe <= frame)
+      {
+        lo = mid;
+      }
+      else
+      {
+        hi = mid - 1;
+      }
+    }
+
+    psegment = &hfi->segments[lo];
+    first = psegment->firstframe;
+
+    // Count the padded frames in the segment before this frame
+    numpadded =
+        hfi->padcount[frame / 32]
+      + BitCount(hfi->padding[frame / 32] & (((UINT32)1 << (frame % 32)) - 1))
+      - hfi->padcount[first / 32]
+      - BitCount(hfi->padding[first / 32] & (((UINT32)1 << (first % 32)) - 1));
+
+    *poffset = psegment->offset + (UINT64)(frame - first) * psegment->framesize + numpadded * 4;
+    *pframesize = psegment->framesize + ((hfi->padding[frame / 32] >> (frame % 32)) & 1) * 4;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Save a frame index to an index file
+//
+// The index file has a 32 byte header, followed by the segments (16 bytes
+// each) and the padding bitmap (one bit per frame, in 32 bit words).
+// All values are little-endian:
+//   0  "DCCUIDX1"
+//   8  Size of the indexed file (64 bits)
+//   16 Last write time of the indexed file (64 bits)
+//   24 Number of frames
+//   28 Number of segments
+// Each segment has the file offset (64 bits), first frame number and
+// frame size without padding slot (see FRAMESEGMENT).
+ERR                                     // Returns error code
+frameindex_Save(
+  HFRAMEINDEX hfi,                      // Frame index handle
+  LPCSTR indexname,                     // Index file name
+  LPCSTR filename)                      // Name of the indexed file
+{
+  ERR result = ERR_OK;
+  FILE *f = NULL;
+  BYTE header[32];
+  UINT32 i;
+
+  if (!result)
+  {
+    if ((!hfi) || (!GetFileInfo(filename, &hfi->filesize, &hfi->filetime)))
+    {
+      result = ERR_PARAMETER;
+    }
+  }
+
+  if (!result)
+  {
+    if (!(f = fopen(indexname, "wb")))
+    {
+      result = ERR_OUTPUT_FILE_OPEN;
+    }
+  }
+
+  if (!result)
+  {
+    memcpy(header, "DCCUIDX1", 8);
+    StoreLE(header + 8, (UINT32)hfi->filesize, 4);
+    StoreLE(header + 12, (UINT32)(hfi->filesize >> 32), 4);
+    StoreLE(header + 16, (UINT32)hfi->filetime, 4);
+    StoreLE(header + 20, (UINT32)(hfi->filetime >> 32), 4);
+    StoreLE(header + 24, hfi->numframes, 4);
+    StoreLE(header + 28, hfi->numsegments, 4);
+
+    if (!fwrite(header, sizeof(header), 1, f))
+    {
+      result = ERR_OUTPUT_FILE_WRITE;
+    }
+  }
+
+  for (i = 0; (!result) && (i < hfi->numsegments); i++)
+  {
+    BYTE segment[16];
+
+    StoreLE(segment, (UINT32)hfi->segments[i].offset, 4);
+    StoreLE(segment + 4, (UINT32)(hfi->segments[i].offset >> 32), 4);
+    StoreLE(segment + 8, hfi->segments[i].firstframe, 4);
+    StoreLE(segment + 12, hfi->segments[i].framesize, 4);
+
+    if (!fwrite(segment, sizeof(segment), 1, f))
+    {
+      result = ERR_OUTPUT_FILE_WRITE;
+    }
+  }
+
+  if ((!result) && (hfi->numframes))
+  {
+    // Windows only runs on little-endian processors, so the bitmap can
+    // be written as is
+    if (!fwrite(hfi->padding, (hfi->numframes + 31) / 32 * 4, 1, f))
+    {
+      result = ERR_OUTPUT_FILE_WRITE;
+    }
+  }
+
+  if (f)
+  {
+    if ((fclose(f)) && (!result))
+    {
+      result = ERR_OUTPUT_FILE_WRITE;
+    }
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Load a frame index from an index file
+//
+// The index must be empty (see frameindex_Create). If the indexed file
+// was changed after the index was saved, the index is not loaded.
+ERR                                     // Returns error code
+frameindex_Load(
+  HFRAMEINDEX hfi,                      // Frame index handle
+  LPCSTR indexname,                     // Index file name
+  LPCSTR filename)                      // Name of the indexed file
+{
+  ERR result = ERR_OK;
+  FILE *f = NULL;
+  BYTE header[32];
+  UINT64 filesize;
+  UINT64 filetime;
+  UINT64 indexsize;
+  UINT64 indextime;
+  UINT32 numwords = 0;
+  UINT32 i;
+
+  if (!result)
+  {
+    if ((!hfi) || (hfi->numframes) || (hfi->numsegments))
+    {
+      result = ERR_PARAMETER;
+    }
+  }
+
+  if (!result)
+  {
+    if (!GetFileInfo(filename, &filesize, &filetime))
+    {
+      result = ERR_INPUT_FILE_OPEN;
+    }
+  }
+
+  if (!result)
+  {
+    if ( (!(f = fopen(indexname, "rb")))
+      || (!fread(header, sizeof(header), 1, f))
+      || (memcmp(header, "DCCUIDX1", 8))
+      || (LoadLE(header + 8, 4) != (UINT32)filesize)
+      || (LoadLE(header + 12, 4) != (UINT32)(filesize >> 32))
+      || (LoadLE(header + 16, 4) != (UINT32)filetime)
+      || (LoadLE(header + 20, 4) != (UINT32)(filetime >> 32)))
+    {
+      result = ERR_INDEX_INVALID;
+    }
+  }
+
+  if (!result)
+  {
+    hfi->filesize = filesize;
+    hfi->filetime = filetime;
+    hfi->numframes = LoadLE(header + 24, 4);
+    hfi->numsegments = LoadLE(header + 28, 4);
+    numwords = (hfi->numframes + 31) / 32;
+
+    // Every frame is in a segment and every segment has frames. The
+    // numbers must not make the allocations below overflow, and the
+    // index file must be exactly big enough for the segments and the
+    // bitmap.
+    if ( ((!hfi->numframes) != (!hfi->numsegments))
+      || (hfi->numsegments > hfi->numframes)
+      || (hfi->numframes > (UINT32)-1 - 31)
+      || (hfi->numsegments > (UINT32)-1 / sizeof(FRAMESEGMENT))
+      || (!GetFileInfo(indexname, &indexsize, &indextime))
+      || (indexsize != sizeof(header) + (UINT64)hfi->numsegments * 16 + (UINT64)numwords * 4))
+    {
+      result = ERR_INDEX_INVALID;
+    }
+  }
+
+  if ((!result) && (hfi->numframes))
+  {
+    hfi->maxframes = numwords * 32;
+    hfi->maxsegments = hfi->numsegments;
+
+    if ( (!(hfi->segments = (FRAMESEGMENT *)malloc(hfi->numsegments * sizeof(FRAMESEGMENT))))
+      || (!(hfi->padding = (UINT32 *)malloc(numwords * 4)))
+      || (!(hfi->padcount = (UINT32 *)malloc(numwords * 4))))
+    {
+      result = ERR_MALLOC;
+    }
+  }
+
+  for (i = 0; (!result) && (i < hfi->numsegments); i++)
+  {
+    BYTE segment[16];
+
+    if (!fread(segment, sizeof(segment), 1, f))
+    {
+      result = ERR_INDEX_INVALID;
+    }
+    else
+    {
+      hfi->segments[i].offset = ((UINT64)LoadLE(segment + 4, 4) << 32) | LoadLE(segment, 4);
+      hfi->segments[i].firstframe = LoadLE(segment + 8, 4);
+      hfi->segments[i].framesize = LoadLE(segment + 12, 4);
+
+      // The first segment must start at the first frame, and the
+      // others must be in order
+      if ( (hfi->segments[i].firstframe >= hfi->numframes)
+        || ((!i) && (hfi->segments[i].firstframe))
+        || ((i) && (hfi->segments[i].firstframe <= hfi->segments[i - 1].firstframe)))
+      {
+        result = ERR_INDEX_INVALID;
+      }
+    }
+  }
+
+  if ((!result) && (hfi->numframes))
+  {
+    UINT32 numpadded = 0;
+
+    if (!fread(hfi->padding, numwords * 4, 1, f))
+    {
+      result = ERR_INDEX_INVALID;
+    }
+
+    // Count the padded frames before each word of the bitmap, so that
+    // frameindex_GetFrame doesn't have to
+    for (i = 0; (!result) && (i < numwords); i++)
+    {
+      hfi->padcount[i] = numpadded;
+      numpadded += BitCount(hfi->padding[i]);
+    }
+  }
+
+  if (f)
+  {
+    fclose(f);
+  }
+
+  if ((result) && (result != ERR_PARAMETER))
+  {
+    // Leave the index empty, so that it can be used to build a new one
+    free(hfi->padding);
+    free(hfi->padcount);
+    free(hfi->segments);
+    memset(hfi, 0, sizeof(FRAMEINDEX));
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Add a name to a cache entry
+//
+// Names are stored with their full path (see GetFullName), so that the
+// cache works the same from any current directory.
+BOOL                                    // Returns FALSE if out of memory
+cacheentry_AddName(
+  CACHEENTRY *pentry,                   // Cache entry
+  LPCSTR name)                          // Name to add
+{
+  BOOL result = TRUE;
+  CHAR buffer[MAX_PATH];
+  LPCSTR fullname = GetFullName(name, buffer);
+  UINT len = strlen(fullname) + 1;
+  LPSTR names = (LPSTR)realloc(pentry->names, pentry->namessize + len);
+
+  if (!names)
+  {
+    result = FALSE;
+  }
+  else
+  {
+    memcpy(names + pentry->namessize, fullname, len);
+
+    pentry->names = names;
+    pentry->namessize += len;
+    pentry->numnames++;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Initialize a cache
+void
+cache_Init(
+  HCACHE hcache,                        // Cache to initialize
+  LPCSTR filename)                      // Cache file; NULL=no cache
+{
+  memset(hcache, 0, sizeof(*hcache));
+  hcache->filename = filename;
+
+  InitializeCriticalSection(&hcache->lock);
+}
+
+
+//---------------------------------------------------------------------------
+// Free a cache
+void
+cache_Destroy(
+  HCACHE hcache)                        // Cache
+{
+  UINT i;
+
+  for (i = 0; i < hcache->numentries; i++)
+  {
+    free(hcache->entries[i].names);
+  }
+
+  free(hcache->entries);
+  free(hcache->table);
+
+  DeleteCriticalSection(&hcache->lock);
+}
+
+
+//---------------------------------------------------------------------------
+// Find the entry that has a name as source file or as output file
+//
+// The slots in the hash table don't say which name of the entry they're
+// for, so the names of each entry in the search are compared. The name is
+// looked up by its full path, like it was stored (see cacheentry_AddName).
+UINT                                    // Returns entry + 1; 0=not found
+cache_Find(
+  HCACHE hcache,                        // Cache
+  LPCSTR name,                          // Name to find
+  BOOL output)                          // FALSE=source; TRUE=output
+{
+  UINT result = 0;
+  UINT mask = hcache->tablesize - 1;
+  CHAR fullname[MAX_PATH];
+  UINT i;
+
+  name = GetFullName(name, fullname);
+
+  for (i = HashName(name) & mask; (hcache->tablesize) && (!result) && (hcache->table[i]); i = (i + 1) & mask)
+  {
+    const CACHEENTRY *pentry = &hcache->entries[hcache->table[i] - 1];
+    LPCSTR s = pentry->names;
+    UINT n;
+
+    for (n = 0; n < pentry->numnames; n++, s += strlen(s) + 1)
+    {
+      if (((n != 0) == output) && (!stricmp(s, name)))
+      {
+        result = hcache->table[i];
+        break;
+      }
+    }
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Add slots for the names of an entry to the hash table of a cache
+//
+// The table must have room for them. A name doesn't need a slot if the
+// search for the name already passes a slot of the same entry.
+void
+cache_AddSlots(
+  HCACHE hcache,                        // Cache
+  UINT entry)                           // Entry number
+{
+  const CACHEENTRY *pentry = &hcache->entries[entry];
+  UINT mask = hcache->tablesize - 1;
+  LPCSTR s = pentry->names;
+  UINT n;
+
+  for (n = 0; n < pentry->numnames; n++, s += strlen(s) + 1)
+  {
+    UINT i;
+
+    for (i = HashName(s) & mask; (hcache->table[i]) && (hcache->table[i] != entry + 1); i = (i + 1) & mask)
+    {
+      // Nothing
+    }
+
+    if (!hcache->table[i])
+    {
+      hcache->table[i] = entry + 1;
+      hcache->numslots++;
+    }
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Store an entry in a cache
+//
+// If the cache has an entry for the same source file, it's replaced. The
+// cache takes over the names of the entry. The table only grows; slots of
+// names that an entry doesn't have anymore are harmless (see cache_Find),
+// and they're left out when the table is made bigger.
+ERR                                     // Returns error code
+cache_Update(
+  HCACHE hcache,                        // Cache
+  CACHEENTRY *pentry)                   // Entry to store; names taken
+{
+  ERR result = ERR_OK;
+  UINT entry;
+
+  EnterCriticalSection(&hcache->lock);
+
+  if ((entry = cache_Find(hcache, pentry->names, FALSE)) != 0)
+  {
+    entry--;
+    free(hcache->entries[entry].names);
+  }
+  else if (hcache->numentries == hcache->maxentries)
+  {
+    UINT maxentries = (hcache->maxentries ? hcache->maxentries * 2 : 256);
+    CACHEENTRY *entries = (CACHEENTRY *)realloc(hcache->entries, maxentries * sizeof(CACHEENTRY));
+
+    if (!entries)
+    {
+      result = ERR_MALLOC;
+    }
+    else
+    {
+      hcache->entries = entries;
+      hcache->maxentries = maxentries;
+      entry = hcache->numentries++;
+    }
+  }
+  else
+  {
+    entry = hcache->numentries++;
+  }
+
+  if (!result)
+  {
+    hcache->entries[entry] = *pentry;
+    hcache->changed = TRUE;
+    pentry->names = NULL;
+    pentry->numnames = 0;
+    pentry->namessize = 0;
+
+    // Keep the table at most half full
+    if ((hcache->numslots + hcache->entries[entry].numnames) * 2 > hcache->tablesize)
+    {
+      UINT numnames = 0;
+      UINT tablesize = (hcache->tablesize ? hcache->tablesize : 1024);
+      UINT *table;
+      UINT i;
+
+      for (i = 0; i < hcache->numentries; i++)
+      {
+        numnames += hcache->entries[i].numnames;
+      }
+
+      while (numnames * 2 > tablesize)
+      {
+        tablesize *= 2;
+      }
+
+      if (!(table = (UINT *)calloc(tablesize, sizeof(UINT))))
+      {
+        result = ERR_MALLOC;
+      }
+      else
+      {
+        free(hcache->table);
+        hcache->table = table;
+        hcache->tablesize = tablesize;
+        hcache->numslots = 0;
+
+        for (i = 0; i < hcache->numentries; i++)
+        {
+          if (i != entry)
+          {
+            cache_AddSlots(hcache, i);
+          }
+        }
+      }
+    }
+
+    if (!result)
+    {
+      cache_AddSlots(hcache, entry);
+    }
+  }
+
+  LeaveCriticalSection(&hcache->lock);
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Start a file hash
+//
+// The hash starts at the given offset, which must be at the start of a
+// block. If the end isn't known, it's set when the end of the file is
+// reached (see inputstream_ReadFile).
+void
+filehash_Init(
+  FILEHASH *ph,                         // File hash
+  UINT64 offset,                        // File offset of first byte
+  UINT64 end)                           // File offset to stop; -1=EOF
+{
+  memset(ph, 0, sizeof(*ph));
+
+  ph->block = ((UINT64)0xCBF29CE4 << 32) | 0x84222325;
+  ph->start = offset;
+  ph->offset = offset;
+  ph->end = end;
+  ph->valid = TRUE;
+}
+
+
+//---------------------------------------------------------------------------
+// Mix the hash of a block with its block number
+//
+// This is the final step of MurmurHash3. Blocks are added up, so the
+// block number makes sure that blocks that trade places are noticed.
+UINT64                                  // Returns value to add to total
+filehash_MixBlock(
+  UINT64 hash,                          // Hash of block
+  UINT64 blockno)                       // Block number in file
+{
+  hash ^= blockno * (((UINT64)0x9E3779B9 << 32) | 0x7F4A7C15);
+
+  hash ^= hash >> 33;
+  hash *= ((UINT64)0xFF51AFD7 << 32) | 0xED558CCD;
+  hash ^= hash >> 33;
+  hash *= ((UINT64)0xC4CEB9FE << 32) | 0x1A85EC53;
+  hash ^= hash >> 33;
+
+  return hash;
+}
+
+
+//---------------------------------------------------------------------------
+// Add data to a file hash
+//
+// The data can overlap with data that was added before; only the part
+// after it is hashed. If there's a gap between the data that was hashed
+// and the new data, the hash can't be finished (see filehash_Get).
+//
+// Each block is hashed with a variant of FNV-1a that takes 8 bytes at a
+// time, to keep up with the speed of the disk; it's not meant to be secure
+// against files that are made to have the same hash.
+void
+filehash_Add(
+  FILEHASH *ph,                         // File hash
+  LPCBYTE data,                         // Data
+  UINT64 dataoffset,                    // File offset of data
+  size_t size)                          // Number of bytes
+{
+  const UINT64 prime = ((UINT64)0x00000100 << 32) | 0x000001B3;
+  UINT64 block = ph->block;
+  UINT64 offset = ph->offset;
+  UINT64 end = dataoffset + size;
+
+  if ((dataoffset > offset) && (offset < ph->end))
+  {
+    ph->valid = FALSE;
+  }
+
+  if (end > ph->end)
+  {
+    end = ph->end;
+  }
+
+  if ((ph->valid) && (offset < end))
+  {
+    data += (size_t)(offset - dataoffset);
+  }
+
+  while ((ph->valid) && (offset < end))
+  {
+    UINT64 blockend = (offset / CACHE_HASH_BLOCK_SIZE + 1) * CACHE_HASH_BLOCK_SIZE;
+    UINT64 stop = (blockend < end ? blockend : end);
+    UINT64 word;
+
+    // Finish the word that was started by the previous data
+    while ((offset & 7) && (offset < stop))
+    {
+      ph->word[offset & 7] = *data++;
+
+      if (!(++offset & 7))
+      {
+        memcpy(&word, ph->word, 8);
+
+        block = (block ^ word) * prime;
+        block ^= block >> 32;
+      }
+    }
+
+    while (stop - offset >= 8)
+    {
+      memcpy(&word, data, 8);
+
+      block = (block ^ word) * prime;
+      block ^= block >> 32;
+
+      data += 8;
+      offset += 8;
+    }
+
+    // Keep the start of a word for the next data
+    while (offset < stop)
+    {
+      ph->word[offset++ & 7] = *data++;
+    }
+
+    if (offset == blockend)
+    {
+      ph->total += filehash_MixBlock(block, offset / CACHE_HASH_BLOCK_SIZE - 1);
+      block = ((UINT64)0xCBF29CE4 << 32) | 0x84222325;
+    }
+  }
+
+  ph->block = block;
+  ph->offset = offset;
+}
+
+
+//---------------------------------------------------------------------------
+// Add the hash of the next part of a file to a file hash
+//
+// The part must start where the file hash is now, at the start of a
+// block, and must be finished.
+void
+filehash_AddPart(
+  FILEHASH *ph,                         // File hash
+  const FILEHASH *ppart)                // Hash of the next part
+{
+  if ( (!ppart->valid)
+    || (ppart->offset != ppart->end)
+    || (ppart->start != ph->offset)
+    || (ph->offset % CACHE_HASH_BLOCK_SIZE))
+  {
+    ph->valid = FALSE;
+  }
+  else
+  {
+    ph->total += ppart->total;
+    ph->block = ppart->block;
+    ph->offset = ppart->offset;
+
+    memcpy(ph->word, ppart->word, sizeof(ph->word));
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Get the result of a file hash
+//
+// The hash is only complete if all the data up to the end was added.
+BOOL                                    // Returns TRUE=complete
+filehash_Get(
+  const FILEHASH *ph,                   // File hash
+  UINT64 *phash)                        // Output: hash
+{
+  const UINT64 prime = ((UINT64)0x00000100 << 32) | 0x000001B3;
+  UINT64 hash = ph->total;
+
+  if (ph->offset % CACHE_HASH_BLOCK_SIZE)
+  {
+    // The last block is shorter; its last bytes are hashed one by one
+    UINT64 block = ph->block;
+    UINT i;
+
+    for (i = 0; i < (UINT)(ph->offset & 7); i++)
+    {
+      block = (block ^ ph->word[i]) * prime;
+    }
+
+    hash += filehash_MixBlock(block, ph->offset / CACHE_HASH_BLOCK_SIZE);
+  }
+
+  *phash = hash;
+
+  return ((ph->valid) && (ph->offset == ph->end));
+}
+
+
+//---------------------------------------------------------------------------
+// Calculate the hash of a source file for the cache
+//
+// The conversion calculates the hash from the data it reads (see
+// ProcessFile); this reads the file only to calculate the hash, for
+// files of which only the last write time changed.
+BOOL                                    // Returns TRUE=success
+cache_GetHash(
+  LPCSTR filename,                      // Source file
+  UINT64 *phash)                        // Output: hash
+{
+  BOOL result = FALSE;
+  FILEHASH hash;
+  LPBYTE buffer = (LPBYTE)malloc(CACHE_HASH_BLOCK_SIZE);
+  HANDLE hfile = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+    NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+  filehash_Init(&hash, 0, (UINT64)-1);
+
+  if ((buffer) && (hfile != INVALID_HANDLE_VALUE))
+  {
+    DWORD numread;
+
+    while ((result = ReadFile(hfile, buffer, CACHE_HASH_BLOCK_SIZE, &numread, NULL)) && (numread))
+    {
+      filehash_Add(&hash, buffer, hash.offset, numread);
+    }
+
+    hash.end = hash.offset;
+  }
+
+  if (hfile != INVALID_HANDLE_VALUE)
+  {
+    CloseHandle(hfile);
+  }
+
+  free(buffer);
+
+  filehash_Get(&hash, phash);
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Load a cache from the cache file
+//
+// If the cache file doesn't exist yet, the cache stays empty. The cache
+// file has a 12 byte header, followed by the entries. All values are
+// little-endian:
+//   0  "DCCUCCH1"
+//   8  Number of entries
+// Each entry has a 32 byte header with the size, last write time and hash
+// of the source file (64 bits each), the number of names and the number
+// of bytes in the names, followed by the names (see CACHEENTRY).
+ERR                                     // Returns error code
+cache_Load(
+  HCACHE hcache)                        // Cache
+{
+  ERR result = ERR_OK;
+  FILE *f = NULL;
+  BYTE header[12];
+  UINT32 numentries = 0;
+  UINT32 i;
+
+  if ((hcache->filename) && ((f = fopen(hcache->filename, "rb")) != NULL))
+  {
+    if ( (!fread(header, sizeof(header), 1, f))
+      || (memcmp(header, "DCCUCCH1", 8)))
+    {
+      result = ERR_CACHE_INVALID;
+    }
+    else
+    {
+      numentries = LoadLE(header + 8, 4);
+    }
+
+    for (i = 0; (!result) && (i < numentries); i++)
+    {
+      BYTE record[32];
+      CACHEENTRY entry;
+      UINT numnames = 0;
+      UINT n;
+
+      memset(&entry, 0, sizeof(entry));
+
+      if (!fread(record, sizeof(record), 1, f))
+      {
+        result = ERR_CACHE_INVALID;
+      }
+      else
+      {
+        entry.filesize = ((UINT64)LoadLE(record + 4, 4) << 32) | LoadLE(record, 4);
+        entry.filetime = ((UINT64)LoadLE(record + 12, 4) << 32) | LoadLE(record + 8, 4);
+        entry.hash = ((UINT64)LoadLE(record + 20, 4) << 32) | LoadLE(record + 16, 4);
+        entry.numnames = LoadLE(record + 24, 4);
+        entry.namessize = LoadLE(record + 28, 4);
+
+        // Each name takes 1 to MAX_PATH bytes
+        if ( (!entry.numnames)
+          || (entry.numnames > (UINT)-1 / MAX_PATH)
+          || (entry.numnames > entry.namessize)
+          || (entry.namessize > entry.numnames * MAX_PATH))
+        {
+          result = ERR_CACHE_INVALID;
+        }
+        else if (!(entry.names = (LPSTR)malloc(entry.namessize)))
+        {
+          result = ERR_MALLOC;
+        }
+        else if (!fread(entry.names, entry.namessize, 1, f))
+        {
+          result = ERR_CACHE_INVALID;
+        }
+      }
+
+      if (!result)
+      {
+        // Every name must be terminated
+        for (n = 0; n < entry.namessize; n++)
+        {
+          if (!entry.names[n])
+          {
+            numnames++;
+          }
+        }
+
+        if ((numnames != entry.numnames) || (entry.names[entry.namessize - 1]))
+        {
+          result = ERR_CACHE_INVALID;
+        }
+      }
+
+      if (!result)
+      {
+        result = cache_Update(hcache, &entry);
+      }
+
+      free(entry.names);
+    }
+
+    fclose(f);
+
+    if (result == ERR_CACHE_INVALID)
+    {
+      Console_Printf("Cache file %s is damaged\n", hcache->filename);
+    }
+  }
+
+  hcache->changed = FALSE;
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Save a cache to the cache file, if it was changed
+//
+// The cache is written to a temporary file first, which then replaces the
+// cache file, so that the cache file is never incomplete.
+ERR                                     // Returns error code
+cache_Save(
+  HCACHE hcache)                        // Cache
+{
+  ERR result = ERR_OK;
+  CHAR tempname[MAX_PATH];
+  FILE *f = NULL;
+  BYTE header[12];
+  UINT i;
+
+  if ((hcache->filename) && (hcache->changed))
+  {
+    if (strlen(hcache->filename) + 1 >= MAX_PATH)
+    {
+      result = ERR_OUTPUT_FILE_OPEN;
+    }
+    else
+    {
+      sprintf(tempname, "%s~", hcache->filename); // safe
+
+      if (!(f = fopen(tempname, "wb")))
+      {
+        result = ERR_OUTPUT_FILE_OPEN;
+      }
+    }
+  }
+
+  if ((!result) && (f))
+  {
+    memcpy(header, "DCCUCCH1", 8);
+    StoreLE(header + 8, hcache->numentries, 4);
+
+    if (!fwrite(header, sizeof(header), 1, f))
+    {
+      result = ERR_OUTPUT_FILE_WRITE;
+    }
+  }
+
+  for (i = 0; (!result) && (f) && (i < hcache->numentries); i++)
+  {
+    const CACHEENTRY *pentry = &hcache->entries[i];
+    BYTE record[32];
+
+    StoreLE(record, (UINT32)pentry->filesize, 4);
+    StoreLE(record + 4, (UINT32)(pentry->filesize >> 32), 4);
+    StoreLE(record + 8, (UINT32)pentry->filetime, 4);
+    StoreLE(record + 12, (UINT32)(pentry->filetime >> 32), 4);
+    StoreLE(record + 16, (UINT32)pentry->hash, 4);
+    StoreLE(record + 20, (UINT32)(pentry->hash >> 32), 4);
+    StoreLE(record + 24, pentry->numnames, 4);
+    StoreLE(record + 28, pentry->namessize, 4);
+
+    if ( (!fwrite(record, sizeof(record), 1, f))
+      || (!fwrite(pentry->names, pentry->namessize, 1, f)))
+    {
+      result = ERR_OUTPUT_FILE_WRITE;
+    }
+  }
+
+  if (f)
+  {
+    if ((fclose(f)) && (!result))
+    {
+      result = ERR_OUTPUT_FILE_WRITE;
+    }
+
+    if (result)
+    {
+      DeleteFile(tempname);
+    }
+    else if (!MoveFileReplace(tempname, hcache->filename))
+    {
+      result = ERR_OUTPUT_FILE_WRITE;
+    }
+    else
+    {
+      hcache->changed = FALSE;
+    }
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Destroy a ring of buffers
+//
+// The threads that use the ring must be finished.
+void
+ring_Destroy(
+  HRING hring)                          // Ring handle
+{
+  if (hring)
+  {
+    if (hring->hempty)
+    {
+      CloseHandle(hring->hempty);
+    }
+
+    if (hring->hfull)
+    {
+      CloseHandle(hring->hfull);
+    }
+
+    if (hring->buffers)
+    {
+      VirtualFree(hring->buffers, 0, MEM_RELEASE);
+    }
+
+    free(hring);
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Create a ring of buffers
+//
+// All buffers are empty at the start. The buffers are allocated with
+// VirtualAlloc, so they're aligned to a page. That makes them usable for
+// unbuffered I/O (FILE_FLAG_NO_BUFFERING), if the buffer size is a
+// multiple of the sector size.
+ERR                                     // Returns error code
+ring_Create(
+  HRING *phring,                        // Ptr to handle; must point to NULL
+  UINT buffersize)                      // Size of each buffer
+{
+  ERR result = ERR_OK;
+  HRING hr = NULL;
+
+  if (!result)
+  {
+    if ((!phring) || (*phring) || (!buffersize))
+    {
+      result = ERR_PARAMETER;
+    }
+  }
+
+  if (!result)
+  {
+    if ( (!(hr = (HRING)calloc(1, sizeof(RING))))
+      || (!(hr->buffers = (LPBYTE)VirtualAlloc(NULL, RING_BUFFERS * (SIZE_T)buffersize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE))))
+    {
+      result = ERR_MALLOC;
+    }
+  }
+
+  if (!result)
+  {
+    hr->emptyindex = 0;
+    hr->fullindex = 0;
+    hr->consumerindex = 0;
+    hr->buffersize = buffersize;
+
+    if ( (!(hr->hempty = CreateSemaphore(NULL, RING_BUFFERS, RING_BUFFERS, NULL)))
+      || (!(hr->hfull = CreateSemaphore(NULL, 0, RING_BUFFERS, NULL))))
+    {
+      result = ERR_MALLOC;
+    }
+  }
+
+  if (result)
+  {
+    ring_Destroy(hr);
+    hr = NULL;
+  }
+
+  if (phring)
+  {
+    *phring = hr;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Get an empty buffer to fill (producer)
+//
+// If requested, this waits until the consumer has given back a buffer.
+// The buffers must be passed on with ring_PutFull in the same order.
+LPBYTE                                  // Returns buffer; NULL=none yet
+ring_GetEmpty(
+  HRING hring,                          // Ring handle
+  BOOL wait)                            // TRUE=Wait for a buffer
+{
+  LPBYTE result = NULL;
+
+  if (WaitForSingleObject(hring->hempty, (wait ? INFINITE : 0)) == WAIT_OBJECT_0)
+  {
+    result = hring->buffers + hring->emptyindex * (size_t)hring->buffersize;
+    hring->emptyindex = (hring->emptyindex + 1) % RING_BUFFERS;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Pass the oldest buffer from ring_GetEmpty on to the consumer (producer)
+void
+ring_PutFull(
+  HRING hring,                          // Ring handle
+  UINT size)                            // Number of bytes; 0=end of data
+{
+  hring->sizes[hring->fullindex] = size;
+  hring->fullindex = (hring->fullindex + 1) % RING_BUFFERS;
+
+  ReleaseSemaphore(hring->hfull, 1, NULL);
+}
+
+
+//---------------------------------------------------------------------------
+// Get the next full buffer (consumer)
+//
+// If requested, this waits until the producer has passed on a buffer.
+// The buffers must be given back with ring_PutEmpty in the same order,
+// except a buffer with size 0, which is the last one.
+LPBYTE                                  // Returns buffer; NULL=none yet
+ring_GetFull(
+  HRING hring,                          // Ring handle
+  PUINT psize,                          // Output number of bytes
+  BOOL wait)                            // TRUE=Wait for a buffer
+{
+  LPBYTE result = NULL;
+
+  if (WaitForSingleObject(hring->hfull, (wait ? INFINITE : 0)) == WAIT_OBJECT_0)
+  {
+    *psize = hring->sizes[hring->consumerindex];
+
+    result = hring->buffers + hring->consumerindex * (size_t)hring->buffersize;
+    hring->consumerindex = (hring->consumerindex + 1) % RING_BUFFERS;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Give the oldest buffer from ring_GetFull back to the producer (consumer)
+void
+ring_PutEmpty(
+  HRING hring)                          // Ring handle
+{
+  ReleaseSemaphore(hring->hempty, 1, NULL);
+}
+
+
+//---------------------------------------------------------------------------
+// Wait until the consumer has processed all full buffers (producer)
+//
+// The producer must be holding one buffer that it got from ring_GetEmpty,
+// so all other buffers are empty when this returns.
+void
+ring_Drain(
+  HRING hring)                          // Ring handle
+{
+  UINT i;
+
+  for (i = 0; i < RING_BUFFERS - 1; i++)
+  {
+    WaitForSingleObject(hring->hempty, INFINITE);
+  }
+
+  ReleaseSemaphore(hring->hempty, RING_BUFFERS - 1, NULL);
+}
+
+
+//---------------------------------------------------------------------------
+// Write the LVL buffer to the LVL file
+ERR                                     // Returns error code
+outputstream_FlushLevels(
+  HOUTPUTSTREAM hso)                    // Output stream handle
+{
+  ERR result = ERR_OK;
+
+  if (!result)
+  {
+    if (!hso)
+    {
+      result = ERR_PARAMETER;
+    }
+  }
+
+  if ((!result) && (hso->lvlindex))
+  {
+    if (hso->pstats)
+    {
+      hso->pstats->writes++;
+      hso->pstats->byteswritten += hso->lvlindex;
+    }
+
+    if ((!hso->flvl) || (!fwrite(hso->lvlbuffer, hso->lvlindex, 1, hso->flvl)))
+    {
+      result = ERR_OUTPUT_FILE_WRITE;
+    }
+
+    // Don't try to write the same data again if it failed
+    hso->lvlindex = 0;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Write a buffer to the output file
+//
+// This is called by the writer thread if there is one.
+ERR                                     // Returns error code
+outputstream_WriteData(
+  HOUTPUTSTREAM hso,                    // Output stream handle
+  LPCBYTE data,                         // Data to write
+  UINT size)                            // Number of bytes
+{
+  ERR result = ERR_OK;
+
+  if (hso->hout)
+  {
+    DWORD written;
+
+    if ( (!WriteFile(hso->hout, data, size, &written, NULL))
+      || (written != size))
+    {
+      result = ERR_OUTPUT_FILE_WRITE;
+    }
+  }
+  else if ((!hso->fout) || (!fwrite(data, size, 1, hso->fout)))
+  {
+    result = ERR_OUTPUT_FILE_WRITE;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Thread function that writes the full buffers of the ring
+//
+// With overlapped I/O (see outputstream_StartWriter), the thread opens its
+// own handle to the output file, and starts writing the next buffers while
+// the earlier writes are still in progress. Each buffer is given back when
+// its write is done. Standard output is always written with fwrite.
+//
+// After a write error, the rest of the buffers are only given back, so
+// the conversion doesn't get stuck. The error is reported by
+// outputstream_Flush.
+unsigned __stdcall                      // Returns 0
+outputstream_WriterThread(
+  void *param)                          // Output stream handle
+{
+  HOUTPUTSTREAM hso = (HOUTPUTSTREAM)param;
+  DWORD fileflags = hso->fileflags;
+  OVERLAPPED ov[RING_BUFFERS];
+  BOOL issued[RING_BUFFERS];            // TRUE=Overlapped write started
+  UINT sizes[RING_BUFFERS];
+  HANDLE hfile = NULL;
+  UINT segment = 0;
+  UINT64 offset = 0;
+  UINT first = 0;                       // Slot of oldest buffer
+  UINT numpending = 0;                  // Number of buffers held
+  BOOL stop = FALSE;
+  UINT i;
+
+  memset(ov, 0, sizeof(ov));
+
+  for (i = 0; i < RING_BUFFERS; i++)
+  {
+    if ((fileflags) && (!(ov[i].hEvent = CreateEvent(NULL, TRUE, FALSE, NULL))))
+    {
+      fileflags = 0;
+    }
+  }
+
+  while ((!stop) || (numpending))
+  {
+    UINT size = 0;
+    LPBYTE data = NULL;
+
+    // Only wait for a full buffer if there are no writes to finish
+    if ((!stop) && (numpending < RING_BUFFERS))
+    {
+      data = ring_GetFull(hso->hring, &size, !numpending);
+    }
+
+    if (data)
+    {
+      UINT slot = (first + numpending) % RING_BUFFERS;
+
+      if (!size)
+      {
+        // Told to stop; this buffer isn't given back
+        stop = TRUE;
+        continue;
+      }
+
+      issued[slot] = FALSE;
+      sizes[slot] = size;
+      numpending++;
+
+      if (!hso->writeresult)
+      {
+        // Each segment (see outputstream_NextSegment) has its own file.
+        // All writes to the previous file are done by then, because the
+        // stream waits for them before it closes a file.
+        if ((fileflags) && (!hso->is_stdout) && ((!hfile) || (segment != hso->segment)))
+        {
+          if (hfile)
+          {
+            CloseHandle(hfile);
+          }
+
+          hfile = CreateFile(hso->outname, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+            NULL, OPEN_EXISTING, fileflags, NULL);
+
+          if (hfile == INVALID_HANDLE_VALUE)
+          {
+            hfile = NULL;
+          }
+
+          segment = hso->segment;
+          offset = 0;
+        }
+
+        if (hfile)
+        {
+          ov[slot].Offset = (DWORD)offset;
+          ov[slot].OffsetHigh = (DWORD)(offset >> 32);
+          offset += size;
+
+          if ( (WriteFile(hfile, data, size, NULL, &ov[slot]))
+            || (GetLastError() == ERROR_IO_PENDING))
+          {
+            // Continue with the next buffer while this one is written
+            issued[slot] = TRUE;
+            continue;
+          }
+
+          hso->writeresult = ERR_OUTPUT_FILE_WRITE;
+        }
+        else
+        {
+          hso->writeresult = outputstream_WriteData(hso, data, size);
+        }
+      }
+    }
+
+    if (numpending)
+    {
+      // Finish the oldest write and give the buffer back
+      if (issued[first])
+      {
+        DWORD written;
+
+        if ( ((!GetOverlappedResult(hfile, &ov[first], &written, TRUE)) || (written != sizes[first]))
+          && (!hso->writeresult))
+        {
+          hso->writeresult = ERR_OUTPUT_FILE_WRITE;
+        }
+      }
+
+      first = (first + 1) % RING_BUFFERS;
+      numpending--;
+
+      ring_PutEmpty(hso->hring);
+    }
+  }
+
+  if (hfile)
+  {
+    CloseHandle(hfile);
+  }
+
+  for (i = 0; i < RING_BUFFERS; i++)
+  {
+    if (ov[i].hEvent)
+    {
+      CloseHandle(ov[i].hEvent);
+    }
+  }
+
+  return 0;
+}
+
+
+//---------------------------------------------------------------------------
+// Start a writer thread for an output stream
+//
+// This must be done before anything is written. If the thread can't be
+// started, the data is written by the current thread as usual.
+//
+// If CreateFile flags are given (which must include FILE_FLAG_OVERLAPPED),
+// the writer thread keeps several overlapped writes going at once.
+void
+outputstream_StartWriter(
+  HOUTPUTSTREAM hso,                    // Output stream handle
+  DWORD fileflags)                      // CreateFile flags; 0=use fwrite
+{
+  if ((!hso->hring) && (!hso->bufferindex) && (!ring_Create(&hso->hring, hso->buffersize)))
+  {
+    hso->writeresult = ERR_OK;
+    hso->fileflags = fileflags;
+    hso->data = ring_GetEmpty(hso->hring, TRUE);
+
+    if (!(hso->hwriter = (HANDLE)_beginthreadex(NULL, 0, outputstream_WriterThread, hso, 0, NULL)))
+    {
+      ring_Destroy(hso->hring);
+      hso->hring = NULL;
+      hso->data = hso->buffer;
+    }
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Wait until the writer thread (if any) has written all buffers
+//
+// The output buffer must be flushed first.
+ERR                                     // Returns error code
+outputstream_Drain(
+  HOUTPUTSTREAM hso)                    // Output stream handle
+{
+  ERR result = ERR_OK;
+
+  if (hso->hring)
+  {
+    STAGE stage = Stats_Switch(hso->pstats, STAGE_WRITE);
+
+    ring_Drain(hso->hring);
+    result = hso->writeresult;
+
+    Stats_Switch(hso->pstats, stage);
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Stop the writer thread (if any)
+//
+// The output buffer must be flushed and drained first.
+void
+outputstream_StopWriter(
+  HOUTPUTSTREAM hso)                    // Output stream handle
+{
+  if (hso->hring)
+  {
+    // Pass an empty buffer to tell the thread to stop
+    ring_PutFull(hso->hring, 0);
+
+    WaitForSingleObject(hso->hwriter, INFINITE);
+    CloseHandle(hso->hwriter);
+    hso->hwriter = NULL;
+
+    ring_Destroy(hso->hring);
+    hso->hring = NULL;
+    hso->data = hso->buffer;
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Write the output buffer to the output file
+//
+// This also writes the LVL buffer, if any.
+//
+// With a writer thread, the buffer is passed to the writer thread, and
+// the stream continues with the next buffer of the ring. Errors of the
+// writer thread are returned by the next flush, or by outputstream_Drain.
+ERR                                     // Returns error code
+outputstream_Flush(
+  HOUTPUTSTREAM hso)                    // Output stream handle
+{
+  ERR result = ERR_OK;
+
+  if (!result)
+  {
+    if (!hso)
+    {
+      result = ERR_PARAMETER;
+    }
+  }
+
+  if ((!result) && (hso->bufferindex))
+  {
+    STAGE stage = Stats_Switch(hso->pstats, STAGE_WRITE);
+
+    if (hso->pstats)
+    {
+      hso->pstats->writes++;
+      hso->pstats->byteswritten += hso->bufferindex;
+    }
+
+    if (hso->hring)
+    {
+      ring_PutFull(hso->hring, hso->bufferindex);
+      hso->data = ring_GetEmpty(hso->hring, TRUE);
+
+      result = hso->writeresult;
+    }
+    else
+    {
+      result = outputstream_WriteData(hso, hso->data, hso->bufferindex);
+    }
+
+    // Don't try to write the same data again if it failed
+    hso->bufferindex = 0;
+
+    Stats_Switch(hso->pstats, stage);
+  }
+
+  if (!result)
+  {
+    result = outputstream_FlushLevels(hso);
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Append data to the output buffer
+//
+// The buffer is written to the file whenever it's full, so all writes
+// to the file (except the last one) have the same size as the buffer.
+// Without a writer thread, data that's at least as big as the buffer is
+// written to the file directly if the buffer is empty, instead of going
+// through the buffer.
+ERR                                     // Returns error code
+outputstream_Write(
+  HOUTPUTSTREAM hso,                    // Output stream handle
+  LPCBYTE data,                         // Data to write
+  UINT size)                            // Number of bytes
+{
+  ERR result = ERR_OK;
+
+  if ((data) && (size >= hso->buffersize) && (!hso->bufferindex) && (!hso->hring))
+  {
+    STAGE stage = Stats_Switch(hso->pstats, STAGE_WRITE);
+
+    if (hso->pstats)
+    {
+      hso->pstats->writes++;
+      hso->pstats->byteswritten += size;
+    }
+
+    result = outputstream_WriteData(hso, data, size);
+    size = 0;
+
+    Stats_Switch(hso->pstats, stage);
+  }
+
+  while ((!result) && (size))
+  {
+    UINT chunksize = hso->buffersize - hso->bufferindex;
+
+    if (chunksize > size)
+    {
+      chunksize = size;
+    }
+
+    if (data)
+    {
+      memcpy(hso->data + hso->bufferindex, data, chunksize);
+      data += chunksize;
+    }
+    else
+    {
+      // No data means write zeroes
+      memset(hso->data + hso->bufferindex, 0, chunksize);
+    }
+
+    hso->bufferindex += chunksize;
+    size -= chunksize;
+
+    if (hso->bufferindex == hso->buffersize)
+    {
+      result = outputstream_Flush(hso);
+    }
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Generate the header of a WAV file
+//
+// The sizes in the header are based on the number of frames that were
+// written so far. WAV files can't be larger than 4GB, so the sizes stop
+// there (at 44.1kHz that's after about 6 hours and 45 minutes).
+void
+outputstream_GetWavHeader(
+  HOUTPUTSTREAM hso,                    // Output stream handle
+  LPBYTE header)                        // Output WAV_HEADER_SIZE bytes
+{
+  UINT32 samplerate = GetSampleRate(hso->rateid);
+  UINT64 datasize = (UINT64)hso->numframes * SAMPLES_PER_FRAME * 4;
+
+  // The header on standard output can't be updated afterwards, so it gets
+  // the maximum size. Programs that read WAV data from a pipe are used to
+  // that, and read until the end of the data.
+  if ((hso->is_stdout) || (datasize > 0xFFFFFFFF - (WAV_HEADER_SIZE - 8)))
+  {
+    datasize = 0xFFFFFFFF - (WAV_HEADER_SIZE - 8);
+  }
+
+  memcpy(header, "RIFF", 4);
+  StoreLE(header + 4, (UINT32)datasize + (WAV_HEADER_SIZE - 8), 4);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  StoreLE(header + 16, 16, 4);          // Size of format chunk
+  StoreLE(header + 20, 1, 2);           // PCM
+  StoreLE(header + 22, 2, 2);           // Number of channels
+  StoreLE(header + 24, samplerate, 4);  // Sample rate
+  StoreLE(header + 28, samplerate * 4, 4); // Bytes per second
+  StoreLE(header + 32, 4, 2);           // Bytes per sample frame
+  StoreLE(header + 34, 16, 2);          // Bits per sample
+  memcpy(header + 36, "data", 4);
+  StoreLE(header + 40, (UINT32)datasize, 4);
+}
+
+
+//---------------------------------------------------------------------------
+// Close the output file(s) of an output stream
+//
+// This writes the TRK file and updates the WAV header, so it can only be
+// done when the last frame of the file was written.
+void
+outputstream_Close(
+  HOUTPUTSTREAM hso)                    // Output stream handle
+{
+  if ((hso->fout) || (hso->hout))
+  {
+    // Normally the buffer was already flushed by the caller, which
+    // handles the errors.
+    outputstream_Flush(hso);
+    outputstream_Drain(hso);
+  }
+
+  if ((hso->fout) && (hso->is_wav) && (!hso->is_stdout))
+  {
+    // Now that the number of frames is known, update the WAV header
+    BYTE header[WAV_HEADER_SIZE];
+
+    outputstream_GetWavHeader(hso, header);
+
+    if (!fseek(hso->fout, 0, SEEK_SET))
+    {
+      fwrite(header, sizeof(header), 1, hso->fout);
+    }
+  }
+
+  if (hso->is_stdout)
+  {
+    if (hso->fout)
+    {
+      fflush(hso->fout);
+      hso->fout = NULL;
+    }
+  }
+  else if (hso->fout)
+  {
+    fclose(hso->fout);
+    hso->fout = NULL;
+  }
+
+  if (hso->hout)
+  {
+    CloseHandle(hso->hout);
+    hso->hout = NULL;
+  }
+
+  if (hso->flvl)
+  {
+    // The levels were written by outputstream_Flush
+    fclose(hso->flvl);
+    hso->flvl = NULL;
+  }
+
+  if (hso->ftrk)
+  {
+    LPCSTR basename;
+    LPCSTR extension = GetFileExtension(hso->outname, &basename);
+    LPCSTR longbasename;
+    LPCSTR longextension = GetFileExtension(hso->trkfilename, &longbasename);
+
+    if (extension && longextension)
+    {
+      UINT namelen = extension - basename;
+      UINT longnamelen = longextension - longbasename;
+
+      if (longnamelen > 40)
+      {
+        longnamelen = 40;
+      }
+
+      fprintf(hso->ftrk,
+        "A-IO"
+        "=5 Track{"
+          "%u \"%s\""                   // Artist name (length first)
+          "=5 Stack{"
+            "1 4 ["
+              "=8 Fragment{"
+                "%u \"%.*s\""           // Filename (length first)
+                "%u "                   // Number of frames
+                "0 "                    // Skip this many frames at start?
+              "}"
+            "]"
+          "}"
+          "c1 {0 0 []}"
+          "%u "                         // sample rate ID
+          "%u \"%.*s\""                 // Title (length first)
+          "%u "                         // Number of frames
+        "}",
+
+        4, "DCCU",                      // Artist name (TODO allow specifying from command line)
+        namelen, namelen, basename,     // File name
+        hso->numframes,                 // Number of frames
+        hso->rateid,                    // Sample rate ID
+        longnamelen, longnamelen, longbasename, // Title (TODO allow specifying from command line)
+        hso->numframes                  // Number of frames
+      );
+    }
+    else
+    {
+      // TODO: Something went wrong parsing the file name. This shouldn't happen
+    }
+
+    fclose(hso->ftrk);
+    hso->ftrk = NULL;
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Destroy an output stream
+void outputstream_Destroy(
+  HOUTPUTSTREAM hso)                    // Output stream handle
+{
+  if (hso)
+  {
+    outputstream_Close(hso);
+    outputstream_StopWriter(hso);
+
+    decoder_Destroy(hso->hdecoder);
+
+    free(hso);
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Reserve the names of the output files of an output stream
+//
+// With a name index, the names are checked and reserved in the index (see
+// nameindex_Reserve). Otherwise, the disk is checked.
+ERR                                     // Returns error code
+outputstream_ReserveNames(
+  HOUTPUTSTREAM hs,                     // Output stream handle
+  LPCSTR filename,                      // File name; ""=none
+  LPCSTR filename2)                     // Second file name; NULL=none
+{
+  ERR result = ERR_OK;
+
+  if (hs->hnames)
+  {
+    LPCSTR filenames[2];
+
+    filenames[0] = filename;
+    filenames[1] = (filename2 ? filename2 : "");
+
+    result = nameindex_Reserve(hs->hnames, filenames, 2);
+  }
+  else if ((FileExists(filename)) || ((filename2) && (FileExists(filename2))))
+  {
+    result = ERR_OUTPUT_FILE_EXISTS;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Choose the short names of the MPP and LVL files
+//
+// DCC-Studio can't handle long file names, so the base name is shortened
+// to 8 characters (see ReplaceFileExtension). Input files with long names
+// that start the same get the same short name that way. If the name was
+// shortened and it's already taken, a tilde and a number are put at the
+// end of the base name instead, e.g. MYRECO~1.MPP, until both names are
+// free. Names that didn't have to be shortened are used as they are.
+ERR                                     // Returns error code
+outputstream_SetShortNames(
+  HOUTPUTSTREAM hs,                     // Output stream handle
+  UINT number)                          // Segment number (1=first)
+{
+  ERR result = ERR_OK;
+  CHAR shortname[MAX_PATH];
+  CHAR longname[MAX_PATH];
+  BOOL shortened = FALSE;
+  BOOL done = FALSE;
+  UINT tilde;
+
+  if ( (!ReplaceFileExtension(hs->infilename, shortname, NULL, "MPP", TRUE))
+    || ((number > 1) && (!AddFileNumber(shortname, '_', number, TRUE)))
+    || (!ReplaceFileExtension(hs->infilename, longname, NULL, "MPP", FALSE))
+    || ((number > 1) && (!AddFileNumber(longname, '_', number, FALSE))))
+  {
+    result = ERR_OUTPUT_FILE_EXISTS; // TODO: not always the correct error code
+  }
+  else
+  {
+    shortened = (stricmp(shortname, longname) != 0);
+  }
+
+  for (tilde = 0; (!result) && (!done); tilde++)
+  {
+    strcpy(hs->outname, shortname); // safe
+
+    if ( ((tilde) && (!AddFileNumber(hs->outname, '~', tilde, TRUE)))
+      || (!ReplaceFileExtension(hs->outname, hs->lvlfilename, NULL, "LVL", FALSE)))
+    {
+      result = ERR_OUTPUT_FILE_EXISTS; // TODO: not always the correct error code
+    }
+    else
+    {
+      result = outputstream_ReserveNames(hs, hs->outname, hs->lvlfilename);
+
+      if (!result)
+      {
+        done = TRUE;
+      }
+      else if ((result == ERR_OUTPUT_FILE_EXISTS) && (shortened) && (tilde < MAX_SHORT_NAME_NUMBER))
+      {
+        // Try the next number
+        result = ERR_OK;
+      }
+    }
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Switch an output stream to temporary file names for the cache
+//
+// The files are written under the same names with a tilde at the end (see
+// outputstream_Commit). The base names don't change, so the TRK file
+// still refers to the right MPP file. The names are reserved for this
+// stream, so a temporary file that's left over from a conversion that
+// was interrupted is deleted.
+ERR                                     // Returns error code
+outputstream_SetTempNames(
+  HOUTPUTSTREAM hs)                     // Output stream handle
+{
+  ERR result = ERR_OK;
+  LPSTR names[3];
+  UINT i;
+
+  names[0] = hs->outname;
+  names[1] = hs->trkfilename;
+  names[2] = hs->lvlfilename;
+
+  for (i = 0; (!result) && (i < 3); i++)
+  {
+    hs->created[i] = FALSE;
+
+    if (!*names[i])
+    {
+      // Not used for this kind of output
+    }
+    else if (strlen(names[i]) + 1 >= MAX_PATH)
+    {
+      result = ERR_OUTPUT_FILE_OPEN;
+    }
+    else
+    {
+      strcat(names[i], "~"); // safe
+
+      DeleteFile(names[i]);
+    }
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Remember that an output file of an output stream was created
+//
+// With the cache, the name of the file is added to the cache entry, so
+// that outputstream_Commit knows which files to give their own names.
+ERR                                     // Returns error code
+outputstream_SetCreated(
+  HOUTPUTSTREAM hso,                    // Output stream handle
+  UINT file)                            // 0=Output, 1=TRK, 2=LVL file
+{
+  ERR result = ERR_OK;
+
+  if ((hso->pentry) && (!hso->created[file]))
+  {
+    CHAR name[MAX_PATH];
+
+    strcpy(name, (!file ? hso->outname : (file == 1 ? hso->trkfilename : hso->lvlfilename))); // safe
+
+    // Leave out the tilde (see outputstream_SetTempNames)
+    name[strlen(name) - 1] = '\0';
+
+    if (!cacheentry_AddName(hso->pentry, name))
+    {
+      result = ERR_MALLOC;
+    }
+    else
+    {
+      hso->created[file] = TRUE;
+    }
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Release the names of the output files that weren't created
+//
+// This is only needed with the cache. It's done at the end of each
+// segment, so that the names can be used for other files.
+void
+outputstream_ReleaseNames(
+  HOUTPUTSTREAM hso)                    // Output stream handle
+{
+  LPCSTR names[3];
+  UINT i;
+
+  names[0] = hso->outname;
+  names[1] = hso->trkfilename;
+  names[2] = hso->lvlfilename;
+
+  for (i = 0; (hso->pentry) && (hso->hnames) && (i < 3); i++)
+  {
+    if ((*names[i]) && (!hso->created[i]))
+    {
+      CHAR name[MAX_PATH];
+
+      strcpy(name, names[i]); // safe
+      name[strlen(name) - 1] = '\0';
+
+      nameindex_Release(hso->hnames, name);
+    }
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Give the output files of an output stream their own names
+//
+// This is only needed with the cache (see outputstream_SetTempNames). If
+// the conversion was successful, the temporary files replace the files
+// with the names in the cache entry; only the names of files that were
+// created are in the entry (see outputstream_SetCreated). If the
+// conversion failed, the temporary files are deleted, so the files of the
+// previous conversion (if any) stay as they were.
+ERR                                     // Returns error code
+outputstream_Commit(
+  HOUTPUTSTREAM hso,                    // Output stream handle (NULL=none)
+  ERR result)                           // Result of the conversion
+{
+  if ((hso) && (hso->pentry))
+  {
+    CACHEENTRY *pentry = hso->pentry;
+    LPSTR names = pentry->names;
+    UINT numnames = pentry->numnames;
+    LPCSTR s = names;
+    UINT n;
+
+    outputstream_Close(hso);
+    outputstream_ReleaseNames(hso);
+
+    pentry->names = NULL;
+    pentry->numnames = 0;
+    pentry->namessize = 0;
+
+    for (n = 0; n < numnames; n++, s += strlen(s) + 1)
+    {
+      CHAR tempname[MAX_PATH];
+
+      sprintf(tempname, "%s~", s); // safe (see outputstream_SetTempNames)
+
+      if (!n)
+      {
+        // The first name is the source file
+        if ((!cacheentry_AddName(pentry, s)) && (!result))
+        {
+          result = ERR_MALLOC;
+        }
+      }
+      else if (result)
+      {
+        DeleteFile(tempname);
+      }
+      else if (!MoveFileReplace(tempname, s))
+      {
+        DeleteFile(tempname);
+        result = ERR_OUTPUT_FILE_WRITE;
+      }
+      else if (!cacheentry_AddName(pentry, s))
+      {
+        result = ERR_MALLOC;
+      }
+    }
+
+    free(names);
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Generate the output file name(s) of an output stream
+//
+// The names are generated from the input file name. After the first
+// segment (see outputstream_NextSegment), the segment number is added
+// to the names.
+ERR                                     // Returns error code
+outputstream_SetNames(
+  HOUTPUTSTREAM hs)                     // Output stream handle
+{
+  ERR result = ERR_OK;
+  LPCSTR infilename = hs->infilename;
+  UINT number = hs->segment + 1;
+
+  // Generate our file name(s) from the input file name
+  // And check that the output file doesn't exist
+  // TODO: fix copy/paste
+  if (hs->is_mpp)
+  {
+    if (!result)
+    {
+      result = outputstream_SetShortNames(hs, number);
+    }
+
+    if ( (!result)
+      && ( (!ReplaceFileExtension(infilename, hs->trkfilename, NULL, "TRK", FALSE))
+        || ((hs->segment) && (!AddFileNumber(hs->trkfilename, '_', number, FALSE)))
+        || (outputstream_ReserveNames(hs, hs->trkfilename, NULL))))
+    {
+      result = ERR_OUTPUT_FILE_EXISTS; // TODO: not always the correct error code
+    }
+  }
+  else if (hs->is_wav)
+  {
+    if ( (!result)
+      && ( (!ReplaceFileExtension(infilename, hs->outname, NULL, "WAV", FALSE))
+        || ((hs->segment) && (!AddFileNumber(hs->outname, '_', number, FALSE)))
+        || (outputstream_ReserveNames(hs, hs->outname, NULL))))
+    {
+      result = ERR_OUTPUT_FILE_EXISTS; // TODO: not always the correct error code
+    }
+  }
+  else
+  {
+    if ( (!result)
+      && ( (!ReplaceFileExtension(infilename, hs->outname, NULL, "MP1", FALSE))
+        || ((hs->segment) && (!AddFileNumber(hs->outname, '_', number, FALSE)))
+        || (outputstream_ReserveNames(hs, hs->outname, NULL))))
+    {
+      result = ERR_OUTPUT_FILE_EXISTS; // TODO: not always the correct error code
+    }
+  }
+
+  if ((!result) && (hs->pentry))
+  {
+    result = outputstream_SetTempNames(hs);
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Close the current output file(s) and continue with a new set of files
+//
+// This is used when the sample rate changes. The new files are opened
+// when the next frame is processed.
+ERR                                     // Returns error code
+outputstream_NextSegment(
+  HOUTPUTSTREAM hso)                    // Output stream handle
+{
+  ERR result = ERR_OK;
+
+  if (!result)
+  {
+    result = outputstream_Flush(hso);
+  }
+
+  if (!result)
+  {
+    outputstream_Close(hso);
+    outputstream_ReleaseNames(hso);
+
+    hso->prevframes += hso->numframes;
+    hso->numframes = 0;
+    hso->rateid = RATEID_UNKNOWN;
+    hso->segment++;
+
+    if (hso->hdecoder)
+    {
+      // Start the new file with a clean synthesis filter
+      memset(hso->hdecoder, 0, sizeof(DECODER));
+    }
+
+    result = outputstream_SetNames(hso);
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Create an output stream
+ERR
+outputstream_Create(
+  HOUTPUTSTREAM *phso,                  // Ptr to handle; must point to NULL
+  LPCSTR infilename,                      // File to open
+  BOOL is_mpp,                          // TRUE=MPP, FALSE=MP1
+  BOOL is_wav,                          // TRUE=WAV (is_mpp must be FALSE)
+  UINT buffersize,                      // Buffer size in bytes
+  HNAMEINDEX hnames,                    // Names in use; NULL=check disk
+  CACHEENTRY *pentry)                   // Cache entry; NULL=no cache
+{
+  ERR result = ERR_OK;
+  HOUTPUTSTREAM hs = NULL;
+
+  if (!result)
+  {
+    if ((!phso) || (*phso) || (!infilename) || (!*infilename) || (buffersize < MIN_OUTPUT_BUFFER_SIZE) || ((is_mpp) && (is_wav)))
+    {
+      result = ERR_PARAMETER;
+    }
+    else if (strlen(infilename) >= MAX_PATH)
+    {
+      result = ERR_INPUT_FILE_NAME;
+    }
+  }
+
+  if (!result)
+  {
+    if (!(hs = (HOUTPUTSTREAM)calloc(1, sizeof(OUTPUTSTREAM) + buffersize)))
+    {
+      result = ERR_MALLOC;
+    }
+  }
+
+  if ((!result) && (is_wav))
+  {
+    result = decoder_Create(&hs->hdecoder);
+  }
+
+  if (!result)
+  {
+    strcpy(hs->infilename, infilename); // safe
+    hs->hout = NULL;
+    hs->is_mpp = is_mpp;
+    hs->is_wav = is_wav;
+    hs->is_stdout = !strcmp(infilename, STDIO_FILENAME);
+    hs->rateid = RATEID_UNKNOWN;
+    hs->numframes = 0;
+    hs->prevframes = 0;
+    hs->segment = 0;
+    hs->data = hs->buffer;
+    hs->bufferindex = 0;
+    hs->buffersize = buffersize;
+    hs->hnames = hnames;
+    hs->pentry = pentry;
+
+    // Data from standard input goes to standard output, so there are no
+    // file names to generate. No TRK or LVL file is generated either.
+    if (!hs->is_stdout)
+    {
+      result = outputstream_SetNames(hs);
+    }
+  }
+
+  if (phso)
+  {
+    *phso = hs;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Create an output stream that writes MP1 data into an existing file,
+// starting at the given offset
+//
+// This is used when several threads write parts of the same file. Each
+// stream has its own file handle, so each one has its own file pointer.
+ERR
+outputstream_CreateAt(
+  HOUTPUTSTREAM *phso,                  // Ptr to handle; must point to NULL
+  LPCSTR outname,                       // File to write
+  UINT64 offset,                        // File offset to start writing
+  UINT buffersize)                      // Buffer size in bytes
+{
+  ERR result = ERR_OK;
+  HOUTPUTSTREAM hs = NULL;
+
+  if (!result)
+  {
+    if ((!phso) || (*phso) || (!outname) || (!*outname) || (buffersize < MIN_OUTPUT_BUFFER_SIZE))
+    {
+      result = ERR_PARAMETER;
+    }
+  }
+
+  if (!result)
+  {
+    if (!(hs = (HOUTPUTSTREAM)calloc(1, sizeof(OUTPUTSTREAM) + buffersize)))
+    {
+      result = ERR_MALLOC;
+    }
+  }
+
+  if (!result)
+  {
+    strcpy(hs->outname, outname); // safe
+    hs->is_mpp = FALSE;
+    hs->rateid = RATEID_UNKNOWN;
+    hs->numframes = 0;
+    hs->data = hs->buffer;
+    hs->bufferindex = 0;
+    hs->buffersize = buffersize;
+
+    hs->hout = CreateFile(outname, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+      NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (hs->hout == INVALID_HANDLE_VALUE)
+    {
+      hs->hout = NULL;
+      result = ERR_OUTPUT_FILE_OPEN;
+    }
+  }
+
+  if (!result)
+  {
+    LONG offsethigh = (LONG)(offset >> 32);
+
+    if ( (SetFilePointer(hs->hout, (LONG)offset, &offsethigh, FILE_BEGIN) == INVALID_SET_FILE_POINTER)
+      && (GetLastError() != NO_ERROR))
+    {
+      result = ERR_OUTPUT_FILE_WRITE;
+    }
+  }
+
+  if (result)
+  {
+    outputstream_Destroy(hs);
+    hs = NULL;
+  }
+
+  if (phso)
+  {
+    *phso = hs;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Add the levels of a frame to the LVL file
+//
+// The LVL file has 2 bytes per frame; one per channel. DCC-Studio uses
+// them to show the waveform.
+ERR                                     // Returns error code
+outputstream_AddLevels(
+  HOUTPUTSTREAM hso,                    // Output stream with LVL file
+  LPCBYTE frame)                        // Frame with valid header
+{
+  ERR result = ERR_OK;
+
+  GetFrameLevels(frame, hso->lvlbuffer + hso->lvlindex);
+  hso->lvlindex += 2;
+
+  if (hso->lvlindex == sizeof(hso->lvlbuffer))
+  {
+    result = outputstream_FlushLevels(hso);
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Process a frame to an output stream
+ERR                                     // Returns error code
+outputstream_ProcessFrame(
+  HOUTPUTSTREAM hso,                    // Output stream handle
+  LPCBYTE buffer,                       // Frame to write
+  size_t framesize,                     // Size of frame in bytes
+  RATEID rateid)                        // Rate ID of frame
+{
+  ERR result = ERR_OK;
+
+  if (!result)
+  {
+    if ((!hso) || (!buffer) || (rateid == RATEID_UNKNOWN))
+    {
+      result = ERR_PARAMETER;
+    }
+  }
+
+  if (!result)
+  {
+    // Make sure the rate ID hasn't changed.
+    //
+    // DCC-Studio reads tapes with mixed sample rates into a single MPP
+    // file, with the last sample rate in the header, so it can't play
+    // them back. MPP and WAV files can only have one sample rate, and
+    // many players don't like rate changes in MP1 files either. So when
+    // the rate changes, continue with a new set of output files.
+    //
+    // The rate of a stream that writes part of a file is never known,
+    // but parts have only one stride and therefore only one rate.
+    //
+    // Standard output can't be split. Rate changes are okay in MP1 data.
+    if ((hso->rateid != RATEID_UNKNOWN) && (rateid != hso->rateid))
+    {
+      if (!hso->is_stdout)
+      {
+        result = outputstream_NextSegment(hso);
+      }
+      else if ((hso->is_mpp) || (hso->is_wav))
+      {
+        result = ERR_SAMPLERATE_MISMATCH;
+      }
+      else
+      {
+        hso->rateid = rateid;
+      }
+    }
+  }
+
+  if (!result)
+  {
+    // If the file(s) isn't/aren't open yet, open it/them now
+    if ((!hso->fout) && (!hso->hout))
+    {
+      if (hso->is_stdout)
+      {
+        // Standard output may be a pipe, so the data is only ever
+        // written in order, without seeking
+        _setmode(_fileno(stdout), _O_BINARY);
+        hso->fout = stdout;
+      }
+      else
+      {
+        hso->fout = fopen(hso->outname, "wb");
+
+        if (hso->fout)
+        {
+          result = outputstream_SetCreated(hso, 0);
+        }
+      }
+
+      if (!hso->fout)
+      {
+        result = ERR_OUTPUT_FILE_OPEN;
+      }
+      else if (!result)
+      {
+        // All data goes through our own buffer, so there's no need for
+        // the C runtime library to buffer it again.
+        setvbuf(hso->fout, NULL, _IONBF, 0);
+
+        hso->rateid = rateid;
+
+        // The file was opened successfully and we're at the start of it.
+        if (hso->is_mpp)
+        {
+          // MPP files need a two byte header representing the sample
+          // frequency so that DCC-Studio can seek in the file
+          BYTE header[2];
+
+          header[0] = (BYTE)rateid;
+          header[1] = 0;
+
+          result = outputstream_Write(hso, header, sizeof(header));
+
+          if ((!result) && (!hso->is_stdout))
+          {
+            // Generate a .TRK file too
+            hso->ftrk = fopen(hso->trkfilename, "w");
+            if (!hso->ftrk)
+            {
+              result = ERR_OUTPUT_FILE_OPEN;
+            }
+            else
+            {
+              result = outputstream_SetCreated(hso, 1);
+            }
+          }
+
+          if ((!result) && (!hso->is_stdout))
+          {
+            // Generate an LVL file too
+            hso->flvl = fopen(hso->lvlfilename, "wb");
+            if (!hso->flvl)
+            {
+              result = ERR_OUTPUT_FILE_OPEN;
+            }
+            else
+            {
+              result = outputstream_SetCreated(hso, 2);
+            }
+          }
+        }
+        else if (hso->is_wav)
+        {
+          // The WAV header is written again when the file is closed,
+          // when the size of the data is known
+          BYTE header[WAV_HEADER_SIZE];
+
+          outputstream_GetWavHeader(hso, header);
+
+          result = outputstream_Write(hso, header, sizeof(header));
+        }
+      }
+    }
+  }
+
+  if (!result)
+  {
+    if (hso->is_wav)
+    {
+      // Decode the frame and write the samples
+      SHORT pcm[SAMPLES_PER_FRAME * 2];
+
+      decoder_DecodeFrame(hso->hdecoder, buffer, (UINT)framesize, pcm);
+
+      result = outputstream_Write(hso, (LPCBYTE)pcm, sizeof(pcm));
+    }
+    else
+    {
+      // Write the frame in pieces: the header, and the data without the
+      // CRC (if any) and without the padding slot (if writing MPP). The
+      // rest of the frame is filled with zeroes.
+      //
+      // At 44.1kHz, the frame size can be 416 or 420 bytes because the
+      // bit rate is not evenly divisible by the sample rate. DCC-Studio
+      // pretends that all frames are 420 bytes to make it easier to seek
+      // in the MPP file. We need to mimic that behavior. The DCC System
+      // Description describes padding slots as "dummy", implying that the
+      // slot must be blank.
+      UINT total = (UINT)framesize;
+      UINT keep = (UINT)framesize;
+      UINT used;
+
+      if ((hso->is_mpp) && (rateid == RATEID_44100))
+      {
+        total = 420;
+        keep = 416;
+      }
+
+      if (!(buffer[1] & 0x01))
+      {
+        // Change the header to indicate there's no CRC anymore, and
+        // leave out the CRC
+        BYTE header[4];
+        UINT datasize = (keep - 4 < framesize - 6 ? keep - 4 : (UINT)framesize - 6);
+
+        memcpy(header, buffer, 4);
+        header[1] |= 0x01;
+
+        result = outputstream_Write(hso, header, 4);
+
+        if (!result)
+        {
+          result = outputstream_Write(hso, buffer + 6, datasize);
+        }
+
+        used = 4 + datasize;
+      }
+      else
+      {
+        result = outputstream_Write(hso, buffer, keep);
+
+        used = keep;
+      }
+
+      if ((!result) && (used < total))
+      {
+        result = outputstream_Write(hso, NULL, total - used);
+      }
+    }
+  }
+
+  if ((!result) && (hso->flvl))
+  {
+    result = outputstream_AddLevels(hso, buffer);
+  }
+
+  if (!result)
+  {
+    // TODO: This could overflow but by the time that happens, DCC-Studio
+    // TODO:   probably won't be able to read the file anyway because of
+    // TODO:   other limitations such as a maximum file size of 2^32.
+    hso->numframes++;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Thread function that reads the input file into the ring of buffers
+//
+// With overlapped I/O (see inputstream_StartReader), the thread opens its
+// own handle to the input file, and keeps a read going for each empty
+// buffer. The buffers are passed on in order, as soon as their reads are
+// done. Standard input is always read with fread.
+//
+// At the end of the file, or when the thread is told to stop, an empty
+// buffer is passed on and the thread ends.
+unsigned __stdcall                      // Returns 0
+inputstream_ReaderThread(
+  void *param)                          // Input stream handle
+{
+  HINPUTSTREAM hsi = (HINPUTSTREAM)param;
+  HRING hring = hsi->hring;
+  DWORD fileflags = hsi->fileflags;
+  OVERLAPPED ov[RING_BUFFERS];
+  BOOL issued[RING_BUFFERS];            // TRUE=Overlapped read started
+  UINT sizes[RING_BUFFERS];
+  HANDLE hfile = NULL;
+  UINT64 offset = 0;
+  UINT first = 0;                       // Slot of oldest buffer
+  UINT numpending = 0;                  // Number of buffers held
+  BOOL ended = FALSE;                   // TRUE=Don't read anymore
+  BOOL sentend = FALSE;                 // TRUE=Empty buffer passed on
+  ERR result = ERR_INPUT_FILE_EOF;
+  UINT i;
+
+  memset(ov, 0, sizeof(ov));
+
+  for (i = 0; i < RING_BUFFERS; i++)
+  {
+    if ((fileflags) && (!(ov[i].hEvent = CreateEvent(NULL, TRUE, FALSE, NULL))))
+    {
+      fileflags = 0;
+    }
+  }
+
+  if ((fileflags) && (hsi->fin != stdin))
+  {
+    hfile = CreateFile(hsi->filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+      NULL, OPEN_EXISTING, fileflags, NULL);
+
+    if (hfile == INVALID_HANDLE_VALUE)
+    {
+      hfile = NULL;
+    }
+  }
+
+  for (;;)
+  {
+    LPBYTE data = NULL;
+
+    // Only wait for an empty buffer if there are no reads to finish
+    if ((!ended) && (numpending < RING_BUFFERS))
+    {
+      data = ring_GetEmpty(hring, !numpending);
+    }
+
+    if (data)
+    {
+      UINT slot = (first + numpending) % RING_BUFFERS;
+
+      issued[slot] = FALSE;
+      sizes[slot] = 0;
+      numpending++;
+
+      if (hsi->stopreader)
+      {
+        ended = TRUE;
+      }
+      else if (hfile)
+      {
+        ov[slot].Offset = (DWORD)offset;
+        ov[slot].OffsetHigh = (DWORD)(offset >> 32);
+        offset += hring->buffersize;
+
+        if ( (ReadFile(hfile, data, hring->buffersize, NULL, &ov[slot]))
+          || (GetLastError() == ERROR_IO_PENDING))
+        {
+          // Start reading the next buffer while this one is read
+          issued[slot] = TRUE;
+          continue;
+        }
+
+        if (GetLastError() != ERROR_HANDLE_EOF)
+        {
+          result = ERR_INPUT_FILE_READ;
+        }
+
+        ended = TRUE;
+      }
+      else
+      {
+        sizes[slot] = (UINT)fread(data, 1, hring->buffersize, hsi->fin);
+
+        if ((!sizes[slot]) && (ferror(hsi->fin)))
+        {
+          result = ERR_INPUT_FILE_READ;
+        }
+      }
+    }
+
+    if (!numpending)
+    {
+      break;
+    }
+
+    // Finish the oldest read and pass the buffer on
+    if (issued[first])
+    {
+      DWORD numread;
+
+      if (!GetOverlappedResult(hfile, &ov[first], &numread, TRUE))
+      {
+        if ((GetLastError() != ERROR_HANDLE_EOF) && (!ended))
+        {
+          result = ERR_INPUT_FILE_READ;
+        }
+
+        numread = 0;
+      }
+
+      sizes[first] = numread;
+    }
+
+    // A short read means the end of the file was reached
+    if (sizes[first] < hring->buffersize)
+    {
+      ended = TRUE;
+    }
+
+    if (!sentend)
+    {
+      if (!sizes[first])
+      {
+        hsi->readresult = result;
+        sentend = TRUE;
+      }
+
+      ring_PutFull(hring, sizes[first]);
+    }
+
+    first = (first + 1) % RING_BUFFERS;
+    numpending--;
+  }
+
+  if (!sentend)
+  {
+    // The last read filled its buffer exactly, or came up short
+    ring_GetEmpty(hring, TRUE);
+    hsi->readresult = result;
+    ring_PutFull(hring, 0);
+  }
+
+  if (hfile)
+  {
+    CloseHandle(hfile);
+  }
+
+  for (i = 0; i < RING_BUFFERS; i++)
+  {
+    if (ov[i].hEvent)
+    {
+      CloseHandle(ov[i].hEvent);
+    }
+  }
+
+  return 0;
+}
+
+
+//---------------------------------------------------------------------------
+// Start a reader thread for an input stream
+//
+// This must be done before anything is read. The file is read into the
+// buffer from then on, even if it's memory mapped: reading a mapped file
+// happens when the data is used, so it doesn't overlap with anything.
+// If the thread can't be started, the current thread reads the file as
+// usual.
+//
+// If CreateFile flags are given (which must include FILE_FLAG_OVERLAPPED),
+// the reader thread keeps several overlapped reads going at once. The
+// buffers of the ring are suitable for FILE_FLAG_NO_BUFFERING.
+void
+inputstream_StartReader(
+  HINPUTSTREAM hsi,                     // Input stream handle
+  DWORD fileflags)                      // CreateFile flags; 0=use fread
+{
+  if ((!hsi->hring) && (!hsi->endindex) && (!ring_Create(&hsi->hring, READER_BUFFER_SIZE)))
+  {
+    if (hsi->hmapping)
+    {
+      if (hsi->data)
+      {
+        UnmapViewOfFile(hsi->data);
+      }
+
+      CloseHandle(hsi->hmapping);
+      hsi->hmapping   = NULL;
+      hsi->data       = hsi->buffer;
+      hsi->startindex = 0;
+      hsi->endindex   = 0;
+      hsi->dataoffset = 0;
+    }
+
+    hsi->fileflags = fileflags;
+    hsi->readresult = ERR_OK;
+    hsi->stopreader = FALSE;
+    hsi->readerdone = FALSE;
+    hsi->chunk = NULL;
+
+    if (!(hsi->hreader = (HANDLE)_beginthreadex(NULL, 0, inputstream_ReaderThread, hsi, 0, NULL)))
+    {
+      ring_Destroy(hsi->hring);
+      hsi->hring = NULL;
+    }
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Stop the reader thread (if any)
+//
+// Buffers that were read but not used are given back to the ring until
+// the thread notices that it has to stop.
+void
+inputstream_StopReader(
+  HINPUTSTREAM hsi)                     // Input stream handle
+{
+  if (hsi->hring)
+  {
+    hsi->stopreader = TRUE;
+
+    if (hsi->chunk)
+    {
+      ring_PutEmpty(hsi->hring);
+      hsi->chunk = NULL;
+    }
+
+    while (!hsi->readerdone)
+    {
+      UINT size;
+
+      ring_GetFull(hsi->hring, &size, TRUE);
+
+      if (size)
+      {
+        ring_PutEmpty(hsi->hring);
+      }
+      else
+      {
+        hsi->readerdone = TRUE;
+      }
+    }
+
+    WaitForSingleObject(hsi->hreader, INFINITE);
+    CloseHandle(hsi->hreader);
+    hsi->hreader = NULL;
+
+    ring_Destroy(hsi->hring);
+    hsi->hring = NULL;
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Copy data from the ring of buffers of the reader thread
+//
+// This waits for the reader thread if necessary, and returns less than
+// the requested number of bytes only at the end of the file.
+size_t                                  // Returns number of bytes copied
+inputstream_ReadRing(
+  HINPUTSTREAM hsi,                     // Input stream handle
+  LPBYTE dest,                          // Destination
+  size_t size)                          // Number of bytes requested
+{
+  size_t total = 0;
+
+  while ((total < size) && (!hsi->readerdone))
+  {
+    UINT chunksize;
+
+    if (!hsi->chunk)
+    {
+      hsi->chunk = ring_GetFull(hsi->hring, &hsi->chunksize, TRUE);
+      hsi->chunkindex = 0;
+
+      if (!hsi->chunksize)
+      {
+        // The reader thread is done
+        hsi->chunk = NULL;
+        hsi->readerdone = TRUE;
+        break;
+      }
+    }
+
+    chunksize = hsi->chunksize - hsi->chunkindex;
+    if (chunksize > size - total)
+    {
+      chunksize = (UINT)(size - total);
+    }
+
+    memcpy(dest + total, hsi->chunk + hsi->chunkindex, chunksize);
+    total += chunksize;
+    hsi->chunkindex += chunksize;
+
+    if (hsi->chunkindex == hsi->chunksize)
+    {
+      ring_PutEmpty(hsi->hring);
+      hsi->chunk = NULL;
+    }
+  }
+
+  return total;
+}
+
+
+//---------------------------------------------------------------------------
+// Destroy input stream
+void
+inputstream_Destroy(
+  HINPUTSTREAM hsi)                     // Input stream handle
+{
+  if (hsi)
+  {
+    inputstream_StopReader(hsi);
+
+    if (hsi->hmapping)
+    {
+      if (hsi->data)
+      {
+        UnmapViewOfFile(hsi->data);
+      }
+
+      CloseHandle(hsi->hmapping);
+    }
+
+    if ((hsi->fin) && (hsi->fin != stdin))
+    {
+      fclose(hsi->fin);
+    }
+
+    free(hsi);
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Map a view of the input file, starting at the given offset
+//
+// The offset is rounded down to the allocation granularity of the system.
+// The start index is adjusted so that it keeps pointing to the same
+// location in the file.
+ERR                                     // Returns error code
+inputstream_MapView(
+  HINPUTSTREAM hsi,                     // Input stream handle
+  UINT64 offset)                        // File offset to map
+{
+  ERR result = ERR_OK;
+  UINT64 viewoffset;
+  UINT64 viewsize;
+  LPBYTE view = NULL;
+
+  if (!result)
+  {
+    if ((!hsi) || (!hsi->hmapping) || (offset > hsi->filesize))
+    {
+      result = ERR_PARAMETER;
+    }
+  }
+
+  if (!result)
+  {
+    SYSTEM_INFO si;
+
+    GetSystemInfo(&si);
+
+    viewoffset = offset - (offset % si.dwAllocationGranularity);
+    viewsize = hsi->filesize - viewoffset;
+    if (viewsize > INPUT_VIEW_SIZE)
+    {
+      viewsize = INPUT_VIEW_SIZE;
+    }
+
+    // The input data is never changed (see inputstream_CopyFrame), so
+    // the view is read-only.
+    view = (LPBYTE)MapViewOfFile(hsi->hmapping, FILE_MAP_READ,
+      (DWORD)(viewoffset >> 32), (DWORD)viewoffset, (SIZE_T)viewsize);
+
+    if (!view)
+    {
+      result = ERR_INPUT_FILE_READ;
+    }
+  }
+
+  if (!result)
+  {
+    if (hsi->pstats)
+    {
+      // Only count the part of the view that wasn't mapped before
+      UINT64 oldend = hsi->dataoffset + hsi->endindex;
+
+      hsi->pstats->refills++;
+
+      if (viewoffset + viewsize > oldend)
+      {
+        hsi->pstats->bytesread += viewoffset + viewsize - oldend;
+      }
+    }
+
+    if (hsi->phash)
+    {
+      filehash_Add(hsi->phash, view, viewoffset, (size_t)viewsize);
+    }
+
+    if (hsi->data)
+    {
+      UnmapViewOfFile(hsi->data);
+    }
+
+    hsi->startindex = (UINT)(hsi->dataoffset + hsi->startindex - viewoffset);
+    hsi->endindex   = (UINT)viewsize;
+    hsi->dataoffset = viewoffset;
+    hsi->data       = view;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Try to memory map the input file
+//
+// Files that can't be mapped (e.g. pipes or empty files) are read into the
+// buffer instead; in that case the function returns an error but the
+// input stream is still usable.
+//
+// The first view is mapped by inputstream_ReadFile.
+ERR                                     // Returns error code
+inputstream_MapFile(
+  HINPUTSTREAM hsi)                     // Input stream handle
+{
+  ERR result = ERR_OK;
+  HANDLE hfile = INVALID_HANDLE_VALUE;
+
+  if (!result)
+  {
+    if ((!hsi) || (!hsi->fin) || (hsi->hmapping))
+    {
+      result = ERR_PARAMETER;
+    }
+  }
+
+  if (!result)
+  {
+    DWORD sizelow;
+    DWORD sizehigh = 0;
+
+    // Only regular files on disk can be mapped
+    hfile = (HANDLE)_get_osfhandle(_fileno(hsi->fin));
+
+    if ( (hfile == INVALID_HANDLE_VALUE)
+      || (GetFileType(hfile) != FILE_TYPE_DISK))
+    {
+      result = ERR_INPUT_FILE_OPEN;
+    }
+    else
+    {
+      sizelow = GetFileSize(hfile, &sizehigh);
+
+      if ((sizelow == INVALID_FILE_SIZE) && (GetLastError() != NO_ERROR))
+      {
+        result = ERR_INPUT_FILE_READ;
+      }
+      else
+      {
+        hsi->filesize = ((UINT64)sizehigh << 32) | sizelow;
+      }
+    }
+  }
+
+  if (!result)
+  {
+    // Empty files can't be mapped
+    if (!hsi->filesize)
+    {
+      result = ERR_INPUT_FILE_EOF;
+    }
+  }
+
+  if (!result)
+  {
+    if (!(hsi->hmapping = CreateFileMapping(hfile, NULL, PAGE_READONLY, 0, 0, NULL)))
+    {
+      result = ERR_INPUT_FILE_OPEN;
+    }
+  }
+
+  if (!result)
+  {
+    // No data is available until the first view is mapped
+    hsi->data = NULL;
+    hsi->startindex = 0;
+    hsi->endindex = 0;
+  }
+  else
+  {
+    // Fall back to buffered reading
+    hsi->data = hsi->buffer;
+    hsi->filesize = 0;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Create input stream
+ERR                                     // Returns error code
+inputstream_Create(
+  HINPUTSTREAM *phsi,                   // Ptr to handle; must point to NULL
+  LPCSTR filename,                      // File to open
+  size_t buffersize,                    // Buffer size in bytes
+  BOOL is_mpp)                          // TRUE=MPP, FALSE=MP1
+{
+  ERR result = ERR_OK;
+  HINPUTSTREAM hs = NULL;
+
+  if (!result)
+  {
+    if ((!phsi) || (!filename) || (!buffersize) || (*phsi))
+    {
+      result = ERR_PARAMETER;
+    }
+    else if (strlen(filename) >= MAX_PATH)
+    {
+      result = ERR_INPUT_FILE_NAME;
+    }
+  }
+
+  if (!result)
+  {
+    if (!(hs = (HINPUTSTREAM)calloc(1, sizeof(INPUTSTREAM) + buffersize)))
+    {
+      result = ERR_MALLOC;
+    }
+  }
+
+  if (!result)
+  {
+    // Initialize file handle
+    if (!strcmp(filename, STDIO_FILENAME))
+    {
+      _setmode(_fileno(stdin), _O_BINARY);
+      hs->fin = stdin;
+    }
+    else if (!(hs->fin = fopen(filename, "rb")))
+    {
+      result = ERR_INPUT_FILE_OPEN;
+    }
+  }
+
+  if (!result)
+  {
+    // Initialize other members. Yes this is redundant after calloc but these
+    // explicit initializations will show future programmers that we know
+    // what we're doing.
+    hs->hmapping   = NULL;
+    hs->data       = hs->buffer;
+    hs->startindex = 0;
+    hs->endindex   = 0;
+    hs->dataoffset = 0;
+    hs->filesize   = 0;
+    hs->rateid     = RATEID_UNKNOWN;
+    hs->framesize  = 0;
+    hs->is_mpp     = is_mpp;
+    hs->stride     = 0;
+    hs->padding    = 0;
+    hs->checkcrc   = FALSE;
+    hs->frameno    = 0;
+
+    strcpy(hs->filename, filename); // safe
+
+    hs->buffersize = buffersize;
+
+    // Use a memory mapped view of the file if possible. If this fails,
+    // the data is read into the buffer.
+    //
+    // Standard input may be redirected from a file. That file can only be
+    // mapped if nothing was read from it yet, because the mapping always
+    // starts at the beginning of the file.
+    if ((hs->fin != stdin) || (!ftell(hs->fin)))
+    {
+      inputstream_MapFile(hs);
+    }
+  }
+
+  if (result)
+  {
+    // If something went wrong, destroy the instance
+    inputstream_Destroy(hs);
+    hs = NULL;
+  }
+
+  // Feedback
+  if (phsi)
+  {
+    *phsi = hs;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Limit a memory mapped input stream to a part of the file
+//
+// After this, the stream starts at the given offset, and behaves as if the
+// file ends at the given end offset. This only works if the file is
+// memory mapped, and must be done before anything is read.
+ERR                                     // Returns error code
+inputstream_SetRange(
+  HINPUTSTREAM hsi,                     // Input stream handle
+  UINT64 offset,                        // File offset of start of range
+  UINT64 endoffset)                     // File offset of end of range
+{
+  ERR result = ERR_OK;
+
+  if (!result)
+  {
+    if ((!hsi) || (hsi->data) || (offset >= endoffset))
+    {
+      result = ERR_PARAMETER;
+    }
+  }
+
+  if (!result)
+  {
+    if ((!hsi->hmapping) || (endoffset > hsi->filesize))
+    {
+      result = ERR_INPUT_FILE_READ;
+    }
+  }
+
+  if (!result)
+  {
+    hsi->filesize   = endoffset;
+    hsi->dataoffset = offset;
+    hsi->startindex = 0;
+    hsi->endindex   = 0;
+
+    // Map the first view now; inputstream_ReadFile would fall back to
+    // reading the start of the file if this fails.
+    result = inputstream_MapView(hsi, offset);
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Read data into the input buffer if possible
+//
+// This is used when the input file isn't memory mapped.
+ERR                                     // Returns error code
+inputstream_FillBuffer(
+  HINPUTSTREAM hsi)                     // Input stream handle
+{
+  ERR result = ERR_OK;
+
+  if (!result)
+  {
+    if (!hsi)
+    {
+      result = ERR_PARAMETER;
+    }
+  }
+
+  if (!result)
+  {
+    // If there is any data in the buffer that hasn't been processed yet,
+    // move it to the start of the buffer, overwriting any data that was
+    // already processed before.
+    if (hsi->startindex)
+    {
+      // The data doesn't start at the top of the buffer so it may need to be
+      // moved.
+      if (hsi->endindex != hsi->startindex)
+      {
+        // There is unprocessed data in the buffer. Move it to the top.
+        memmove(hsi->buffer, hsi->buffer + hsi->startindex, hsi->endindex - hsi->startindex);
+        hsi->endindex -= hsi->startindex;
+        hsi->dataoffset += hsi->startindex;
+      }
+      else
+      {
+        // The unprocessed data has zero length.
+        // So to move it to the start of the buffer, all we need to do is reset
+        // the index.
+        hsi->endindex = 0;
+        hsi->dataoffset += hsi->startindex;
+      }
+
+      // The start of the unused data is now at the top of the buffer so reset
+      // the index.
+      hsi->startindex = 0;
+    }
+  }
+
+  // At this point, the buffer starts with unprocessed data and ends with
+  // space for new data.
+
+  if (!result)
+  {
+    // Make sure we have buffer space available to read data, otherwise
+    // we'll end up in an infinite loop.
+    if (hsi->endindex == hsi->buffersize)
+    {
+      result = ERR_INTERNAL;
+    }
+  }
+
+  if (!result)
+  {
+    size_t read_length;
+
+    // Read data starting at the end of the unhandled bytes
+    if (hsi->hring)
+    {
+      read_length = inputstream_ReadRing(hsi, hsi->buffer + hsi->endindex, hsi->buffersize - hsi->endindex);
+    }
+    else
+    {
+      read_length = fread(hsi->buffer + hsi->endindex, 1, hsi->buffersize - hsi->endindex, hsi->fin);
+    }
+
+    hsi->endindex += read_length;
+
+    if (hsi->pstats)
+    {
+      hsi->pstats->refills++;
+      hsi->pstats->bytesread += read_length;
+    }
+
+    if (hsi->phash)
+    {
+      filehash_Add(hsi->phash, hsi->buffer, hsi->dataoffset, hsi->endindex);
+    }
+
+    if (!read_length)
+    {
+      if (hsi->hring)
+      {
+        result = hsi->readresult;
+      }
+      else
+      {
+        result = (ferror(hsi->fin) ? ERR_INPUT_FILE_READ : ERR_INPUT_FILE_EOF);
+      }
+    }
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Make more input data available if possible
+ERR                                     // Returns error code
+inputstream_ReadFile(
+  HINPUTSTREAM hsi)                     // Input stream handle
+{
+  ERR result = ERR_OK;
+
+  if (!result)
+  {
+    if (!hsi)
+    {
+      result = ERR_PARAMETER;
+    }
+  }
+
+  if (!result)
+  {
+    if (hsi->hmapping)
+    {
+      // The file is memory mapped, so there is nothing to read or move.
+      // If the view doesn't reach the end of the file, map a new view
+      // that starts at the current frame.
+      if (hsi->dataoffset + hsi->endindex >= hsi->filesize)
+      {
+        result = ERR_INPUT_FILE_EOF;
+      }
+      else
+      {
+        result = inputstream_MapView(hsi, hsi->dataoffset + hsi->startindex);
+      }
+
+      if ((result == ERR_INPUT_FILE_READ) && (!hsi->data))
+      {
+        // The first view couldn't be mapped (e.g. because there's not
+        // enough address space). Use the buffer instead.
+        CloseHandle(hsi->hmapping);
+        hsi->hmapping = NULL;
+        hsi->data = hsi->buffer;
+
+        result = inputstream_FillBuffer(hsi);
+      }
+    }
+    else
+    {
+      result = inputstream_FillBuffer(hsi);
+    }
+  }
+
+  if ((result == ERR_INPUT_FILE_EOF) && (hsi->phash) && (hsi->phash->end == (UINT64)-1))
+  {
+    // All the data was hashed
+    hsi->phash->end = hsi->phash->offset;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Find the next frame in an MPP file at the known stride
+//
+// At the start of the file, this checks the rate ID in the MPP file header
+// and uses it to determine the stride.
+//
+// After that, it only checks if there's a valid header with the expected
+// sample rate where the next frame is expected. If not, the file is
+// corrupt (or has multiple sample rates), so the stride is reset and the
+// caller has to search for the next frame instead.
+ERR                                     // Returns error code
+inputstream_GetStrideFrame(
+  HINPUTSTREAM hsi)                     // Input stream handle
+{
+  ERR result = ERR_OK;
+  UINT available = 0;
+
+  if (!result)
+  {
+    if (!hsi)
+    {
+      result = ERR_PARAMETER;
+    }
+    else
+    {
+      available = hsi->endindex - hsi->startindex;
+    }
+  }
+
+  if ((!result) && (hsi->is_mpp) && (!hsi->dataoffset) && (!hsi->startindex))
+  {
+    // We're at the start of the MPP file. Check the MPP header.
+    if (available < 2)
+    {
+      result = ERR_INSUFFICIENT_DATA;
+    }
+    else
+    {
+      // If the header is invalid, let the caller search for frames.
+      // The header will be skipped as garbage.
+      if (!hsi->data[1])
+      {
+        hsi->stride = GetMppStride((RATEID)hsi->data[0]);
+      }
+
+      if (hsi->stride)
+      {
+        hsi->startindex += 2;
+        available -= 2;
+      }
+      else
+      {
+        result = ERR_SYNC;
+      }
+    }
+  }
+
+  if (!result)
+  {
+    if (!hsi->stride)
+    {
+      result = ERR_SYNC;
+    }
+    else if (available < hsi->padding + 4)
+    {
+      result = ERR_INSUFFICIENT_DATA;
+    }
+    else
+    {
+      // Skip the padding after the previous frame
+      hsi->startindex += hsi->padding;
+      hsi->padding = 0;
+    }
+  }
+
+  if (!result)
+  {
+    LPCBYTE frame = hsi->data + hsi->startindex;
+    const HEADERINFO *phi = &HeaderTable[HEADER_KEY(frame)];
+
+    if ( (frame[0] != 0xFF)
+      || (phi->err != ERR_OK)
+      || (GetMppStride((RATEID)phi->rateid) != hsi->stride))
+    {
+      // The frame isn't where we expected it
+      hsi->stride = 0;
+      hsi->padding = 0;
+      result = ERR_SYNC;
+    }
+    else
+    {
+      hsi->framesize = phi->numslots * 4;
+      hsi->rateid = (RATEID)phi->rateid;
+    }
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Remove the current frame from the input stream
+void
+inputstream_NextFrame(
+  HINPUTSTREAM hsi)                     // Input stream handle
+{
+  hsi->startindex += hsi->framesize;
+  hsi->frameno++;
+
+  // In MPP files, the padding after the frame (if any) is skipped when
+  // the next frame is retrieved.
+  if (hsi->stride)
+  {
+    hsi->padding = hsi->stride - hsi->framesize;
+  }
+
+  hsi->framesize = 0;
+  hsi->rateid = RATEID_UNKNOWN;
+}
+
+
+//---------------------------------------------------------------------------
+// Check the CRC of the current frame
+//
+// A bad CRC means the frame was damaged (e.g. in a bad capture). The frame
+// is converted anyway, because leaving it out would change the timing of
+// the rest of the audio, but it's reported.
+void
+inputstream_CheckCrc(
+  HINPUTSTREAM hsi,                     // Input stream handle
+  LPCBYTE frame)                        // Current frame; must have a CRC
+{
+  if (GetFrameCrc(frame) != ((frame[4] << 8) | frame[5]))
+  {
+    hsi->numcrcerrors++;
+
+    if (hsi->pstats)
+    {
+      hsi->pstats->crcerrors++;
+    }
+
+    Console_Printf("%s: CRC error in frame %u (offset %.0f)\n",
+      hsi->filename,
+      hsi->frameno,
+      (double)(INT64)(frame - hsi->data + hsi->dataoffset));
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Copy a frame from the input stream to the output stream if possible
+ERR                                     // Returns error code
+inputstream_CopyFrame(
+  HINPUTSTREAM hsi,                     // Input stream handle
+  HOUTPUTSTREAM hso)                    // Output stream handle
+{
+  ERR result = ERR_OK;
+
+  if (!result)
+  {
+    if (!hsi)
+    {
+      result = ERR_PARAMETER;
+    }
+  }
+
+  if (!result)
+  {
+    // If we don't have a framesize yet, see if we can calculate it now.
+    // For MPP files, try to find the frame at the known stride first.
+    if ((!hsi->framesize) && (hsi->is_mpp))
+    {
+      result = inputstream_GetStrideFrame(hsi);
+
+      if (result == ERR_SYNC)
+      {
+        // Search for the frame instead
+        result = ERR_OK;
+      }
+    }
+
+    if ((!result) && (!hsi->framesize))
+    {
+      for(;;)
+      {
+        UINT skipsize;
+
+        result = GetFrameSize(hsi->data + hsi->startindex, hsi->endindex - hsi->startindex, &hsi->framesize, &skipsize, &hsi->rateid);
+
+        if ( (result == ERR_SYNC)
+          || (result == ERR_DATA_NOT_MPEG1)
+          || (result == ERR_DATA_NOT_LAYER1)
+          || (result == ERR_DATA_NOT_384KBPS)
+          || (result == ERR_DATA_BAD_CHANMODE))
+        {
+          if (!skipsize)
+          {
+            skipsize = 1;
+          }
+
+          // Skip unusable data if possible
+          if ((hsi->startindex + skipsize) <= hsi->endindex)
+          {
+            if (hsi->pstats)
+            {
+              hsi->pstats->bytesskipped[result] += skipsize;
+            }
+
+            hsi->startindex += skipsize;
+            continue;
+          }
+          else
+          {
+            // Need more input
+            result = ERR_INSUFFICIENT_DATA;
+          }
+        }
+
+        break;
+      }
+
+      if ((!result) && (hsi->is_mpp))
+      {
+        // We found a frame in the MPP file by searching for it. Assume
+        // that the next frames follow at the stride for this sample rate.
+        hsi->stride = GetMppStride(hsi->rateid);
+      }
+    }
+  }
+
+  if (!result)
+  {
+    // Check if we finally have a frame size
+    if (!hsi->framesize)
+    {
+      result = ERR_INSUFFICIENT_DATA;
+    }
+  }
+
+  if (!result)
+  {
+    // Check if the entire frame is in the buffer
+    if (hsi->endindex - hsi->startindex < hsi->framesize)
+    {
+      result = ERR_INSUFFICIENT_DATA;
+    }
+  }
+
+  // The CRC (if any) is left out and the padding slot is cleared by
+  // outputstream_ProcessFrame while writing the frame, so the input data
+  // is never changed. Here they're only counted.
+  if (!result)
+  {
+    LPCBYTE frame = hsi->data + hsi->startindex;
+    BOOL crc = !(frame[1] & 0x01);
+
+    if ((crc) && (hsi->pstats))
+    {
+      hsi->pstats->crcstripped++;
+    }
+
+    if ((crc) && (hsi->checkcrc))
+    {
+      inputstream_CheckCrc(hsi, frame);
+    }
+
+    // Check if there's any data in the padding slot, if writing to MPP.
+    // Without the CRC, the last two bytes of the slot come from the data
+    // in front of it, so only the bytes after that are checked.
+    if ((hso->is_mpp) && (hsi->framesize == 420))
+    {
+      UINT i;
+
+      for (i = (crc ? 418 : 416); (i < 420) && (!frame[i]); i++)
+      {
+      }
+
+      if (i < 420)
+      {
+        hsi->numpaddingslots++;
+
+        if (hsi->pstats)
+        {
+          hsi->pstats->paddingcleared++;
+        }
+      }
+    }
+  }
+
+  if (!result)
+  {
+    // Call the output function to process the frame.
+    result = outputstream_ProcessFrame(hso, hsi->data + hsi->startindex, hsi->framesize, hsi->rateid);
+  }
+
+  if ((!result) && (hsi->hindex))
+  {
+    // The CRC may have been removed from the frame but the frame size
+    // and the padding bit are still the same as in the file
+    result = frameindex_Add(hsi->hindex, hsi->dataoffset + hsi->startindex, hsi->data + hsi->startindex, hsi->framesize);
+  }
+
+  if (!result)
+  {
+    inputstream_NextFrame(hsi);
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Copy the bytes of a frame
+//
+// When the size is known at compile time, compilers tend to inline memcpy
+// as a string instruction (rep movs), which is slower for the few hundred
+// bytes of a frame than copying 16 bytes at a time.
+DCCU_FORCEINLINE void
+CopyFrameBytes(
+  LPBYTE dest,                          // Destination
+  LPCBYTE src,                          // Source
+  UINT size)                            // Number of bytes
+{
+#ifdef DCCU_SSE2
+  while (size >= 16)
+  {
+    _mm_storeu_si128((__m128i *)dest, _mm_loadu_si128((const __m128i *)src));
+    dest += 16;
+    src += 16;
+    size -= 16;
+  }
+#endif
+
+  memcpy(dest, src, size);
+}
+
+
+//---------------------------------------------------------------------------
+// Copy frames of one kind from an input stream to an output stream
+//
+// This does the same as calling inputstream_CopyFrame for each frame, but
+// only for frames that have the given sample rate and CRC setting, are
+// converted in the given direction, and fit in the output buffer without
+// flushing it in the middle of a frame. The parameters are constants in
+// each caller (see DEFINE_COPYFRAMES), so the compiler generates a
+// separate loop for each kind of frame, without the checks that don't
+// apply to it.
+//
+// The function returns ERR_OK when it finds a frame that it can't
+// handle; inputstream_CopyFrame takes care of that one. It returns
+// ERR_INSUFFICIENT_DATA when more input is needed.
+DCCU_FORCEINLINE ERR                    // Returns error code
+inputstream_CopyFramesOf(
+  HINPUTSTREAM hsi,                     // Input stream handle
+  HOUTPUTSTREAM hso,                    // Output stream handle
+  BOOL to_mpp,                          // TRUE=MP1 to MPP; FALSE=MPP to MP1
+  RATEID rateid,                        // Sample rate of the frames
+  BOOL crc)                             // TRUE=Frames have a CRC
+{
+  ERR result = ERR_OK;
+  const UINT stride = (rateid == RATEID_44100 ? 420 : (rateid == RATEID_48000 ? 384 : 576));
+
+  // In MPP files, only frames at the stride are handled here
+  if ((!to_mpp) && (hsi->stride != stride))
+  {
+    return ERR_OK;
+  }
+
+  for (;;)
+  {
+    LPCBYTE frame;
+    const HEADERINFO *phi;
+    UINT framesize;
+    UINT keep;
+    UINT total;
+    UINT used;
+    LPBYTE out;
+
+    if (hsi->endindex - hsi->startindex < hsi->padding + 4)
+    {
+      result = ERR_INSUFFICIENT_DATA;
+      break;
+    }
+
+    frame = hsi->data + hsi->startindex + hsi->padding;
+    phi = &HeaderTable[HEADER_KEY(frame)];
+    framesize = phi->numslots * 4;
+
+    // At 44.1kHz, the frame size depends on the padding bit; at the other
+    // rates, it must be the stride. The MPP output for 44.1kHz always
+    // takes 420 bytes, of which the last 4 bytes are cleared.
+    keep = ((to_mpp) && (rateid == RATEID_44100) ? 416 : framesize);
+    total = (to_mpp ? stride : framesize);
+
+    if ( (frame[0] != 0xFF)
+      || (phi->err != ERR_OK)
+      || ((RATEID)phi->rateid != rateid)
+      || ((!(frame[1] & 0x01)) != crc)
+      || ((rateid != RATEID_44100) && (framesize != stride))
+      || (hso->buffersize - hso->bufferindex < total))
+    {
+      break;
+    }
+
+    if (hsi->endindex - hsi->startindex - hsi->padding < framesize)
+    {
+      result = ERR_INSUFFICIENT_DATA;
+      break;
+    }
+
+    // Count and check the CRC and padding slot like inputstream_CopyFrame
+    if (crc)
+    {
+      if (hsi->pstats)
+      {
+        hsi->pstats->crcstripped++;
+      }
+
+      if (hsi->checkcrc)
+      {
+        inputstream_CheckCrc(hsi, frame);
+      }
+    }
+
+    if ((to_mpp) && (rateid == RATEID_44100) && (framesize == 420))
+    {
+      if ((frame[418] | frame[419] | (crc ? 0 : frame[416] | frame[417])) != 0)
+      {
+        hsi->numpaddingslots++;
+
+        if (hsi->pstats)
+        {
+          hsi->pstats->paddingcleared++;
+        }
+      }
+    }
+
+    // Write the frame like outputstream_ProcessFrame, straight into the
+    // output buffer
+    out = hso->data + hso->bufferindex;
+
+    if (crc)
+    {
+      UINT datasize = (keep - 4 < framesize - 6 ? keep - 4 : framesize - 6);
+
+      memcpy(out, frame, 4);
+      out[1] |= 0x01;
+      CopyFrameBytes(out + 4, frame + 6, datasize);
+
+      used = 4 + datasize;
+    }
+    else
+    {
+      CopyFrameBytes(out, frame, keep);
+
+      used = keep;
+    }
+
+    // Clear what's left of the frame: the padding slot of 44.1kHz frames
+    // in MPP files, and the space of the CRC that was left out
+    if (used < total)
+    {
+      memset(out + used, 0, total - used);
+    }
+
+    hso->bufferindex += total;
+
+    if (hso->bufferindex == hso->buffersize)
+    {
+      result = outputstream_Flush(hso);
+    }
+
+    if ((!result) && (hso->flvl))
+    {
+      result = outputstream_AddLevels(hso, frame);
+    }
+
+    if (result)
+    {
+      break;
+    }
+
+    hso->numframes++;
+
+    // Go to the next frame like inputstream_NextFrame
+    hsi->startindex += hsi->padding + framesize;
+    hsi->padding = (to_mpp ? 0 : stride - framesize);
+    hsi->frameno++;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Generate a function that copies frames of one kind
+#define DEFINE_COPYFRAMES(name, to_mpp, rateid, crc) \
+ERR name(HINPUTSTREAM hsi, HOUTPUTSTREAM hso) \
+{ \
+  return inputstream_CopyFramesOf(hsi, hso, to_mpp, rateid, crc); \
+}
+
+DEFINE_COPYFRAMES(CopyFrames_ToMpp32,    TRUE,  RATEID_32000, FALSE)
+DEFINE_COPYFRAMES(CopyFrames_ToMpp32Crc, TRUE,  RATEID_32000, TRUE)
+DEFINE_COPYFRAMES(CopyFrames_ToMpp44,    TRUE,  RATEID_44100, FALSE)
+DEFINE_COPYFRAMES(CopyFrames_ToMpp44Crc, TRUE,  RATEID_44100, TRUE)
+DEFINE_COPYFRAMES(CopyFrames_ToMpp48,    TRUE,  RATEID_48000, FALSE)
+DEFINE_COPYFRAMES(CopyFrames_ToMpp48Crc, TRUE,  RATEID_48000, TRUE)
+DEFINE_COPYFRAMES(CopyFrames_ToMp132,    FALSE, RATEID_32000, FALSE)
+DEFINE_COPYFRAMES(CopyFrames_ToMp132Crc, FALSE, RATEID_32000, TRUE)
+DEFINE_COPYFRAMES(CopyFrames_ToMp144,    FALSE, RATEID_44100, FALSE)
+DEFINE_COPYFRAMES(CopyFrames_ToMp144Crc, FALSE, RATEID_44100, TRUE)
+DEFINE_COPYFRAMES(CopyFrames_ToMp148,    FALSE, RATEID_48000, FALSE)
+DEFINE_COPYFRAMES(CopyFrames_ToMp148Crc, FALSE, RATEID_48000, TRUE)
+
+
+//---------------------------------------------------------------------------
+// Copy one or more frames from an input stream to an output stream
+//
+// The first frame is copied by inputstream_CopyFrame, which handles every
+// situation. The frames after it are copied by the function that's made
+// for their direction, sample rate and CRC setting, for as long as they
+// are like that. Mixed sample rates, mixed CRCs, frames that have to be
+// searched for, WAV output and frame indexes are left to
+// inputstream_CopyFrame.
+ERR                                     // Returns error code
+inputstream_CopyFrames(
+  HINPUTSTREAM hsi,                     // Input stream handle
+  HOUTPUTSTREAM hso)                    // Output stream handle
+{
+  ERR result = inputstream_CopyFrame(hsi, hso);
+
+  if ( (!result)
+    && (!hso->is_wav)
+    && (!hsi->hindex)
+    && (hsi->endindex - hsi->startindex >= hsi->padding + 4))
+  {
+    // The output rate is the rate of the frame that was just copied. The
+    // CRC setting of the next frame chooses the function.
+    BOOL crc = !(hsi->data[hsi->startindex + hsi->padding + 1] & 0x01);
+    ERR (*copyframes)(HINPUTSTREAM, HOUTPUTSTREAM) = NULL;
+
+    switch (hso->rateid)
+    {
+    case RATEID_32000:
+      copyframes = (hso->is_mpp ? (crc ? CopyFrames_ToMpp32Crc : CopyFrames_ToMpp32) : (crc ? CopyFrames_ToMp132Crc : CopyFrames_ToMp132));
+      break;
+
+    case RATEID_44100:
+      copyframes = (hso->is_mpp ? (crc ? CopyFrames_ToMpp44Crc : CopyFrames_ToMpp44) : (crc ? CopyFrames_ToMp144Crc : CopyFrames_ToMp144));
+      break;
+
+    case RATEID_48000:
+      copyframes = (hso->is_mpp ? (crc ? CopyFrames_ToMpp48Crc : CopyFrames_ToMpp48) : (crc ? CopyFrames_ToMp148Crc : CopyFrames_ToMp148));
+      break;
+
+    default:
+      break;
+    }
+
+    if (copyframes)
+    {
+      result = copyframes(hsi, hso);
+    }
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Run a thread function in multiple threads and wait until they're done
+//
+// Each thread gets a pointer to its own element of the parameter array.
+// If the parameter size is 0, all threads get the same parameter. If a
+// thread can't be started, the function is called by the current thread
+// instead, so the work always gets done.
+void
+RunThreads(
+  unsigned (__stdcall *threadfunc)(void *), // Thread function
+  LPBYTE params,                        // Array of thread parameters
+  size_t paramsize,                     // Size of each parameter; 0=shared
+  UINT numthreads)                      // Number of threads
+{
+  HANDLE hthreads[MAX_THREADS];
+  UINT numstarted = 0;
+  UINT i;
+
+  for (i = 0; (i < numthreads) && (i < MAX_THREADS); i++)
+  {
+    LPVOID pparam = params + i * paramsize;
+    HANDLE hthread = NULL;
+
+    // Don't bother with a thread if there's only one
+    if (numthreads > 1)
+    {
+      hthread = (HANDLE)_beginthreadex(NULL, 0, threadfunc, pparam, 0, NULL);
+    }
+
+    if (hthread)
+    {
+      hthreads[numstarted++] = hthread;
+    }
+    else
+    {
+      threadfunc(pparam);
+    }
+  }
+
+  if (numstarted)
+  {
+    WaitForMultipleObjects(numstarted, hthreads, TRUE, INFINITE);
+  }
+
+  for (i = 0; i < numstarted; i++)
+  {
+    CloseHandle(hthreads[i]);
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Count or convert the frames in one part of an MPP file
+//
+// Every frame must be at the stride. If it isn't, the function returns
+// ERR_SYNC and the caller has to convert the file the normal way.
+ERR                                     // Returns error code
+MppPart_Run(
+  MPPPART *ppart)                       // Part to process
+{
+  ERR result = ERR_OK;
+  HINPUTSTREAM hsi = NULL;
+  HOUTPUTSTREAM hso = NULL;
+  UINT numframes = 0;
+  UINT numpadded = 0;
+
+  if (!result)
+  {
+    result = inputstream_Create(&hsi, ppart->infilename, INPUT_BUFFER_SIZE, TRUE);
+  }
+
+  if ((!result) && (ppart->usestats) && (ppart->convert))
+  {
+    // The first view is mapped by inputstream_SetRange
+    hsi->pstats = &ppart->stats;
+    Stats_Switch(&ppart->stats, STAGE_READ);
+  }
+
+  if ((!result) && (ppart->usehash) && (ppart->convert))
+  {
+    // The first view is hashed by inputstream_SetRange too
+    hsi->phash = &ppart->hash;
+  }
+
+  if (!result)
+  {
+    result = inputstream_SetRange(hsi, ppart->inoffset, ppart->inend);
+  }
+
+  if ((!result) && (ppart->convert))
+  {
+    result = outputstream_CreateAt(&hso, ppart->outname, ppart->outoffset, ppart->buffersize);
+  }
+
+  if (!result)
+  {
+    hsi->stride = ppart->stride;
+    hsi->checkcrc = ppart->checkcrc;
+    hsi->frameno = ppart->firstframe;
+
+    if (hsi->pstats)
+    {
+      hso->pstats = hsi->pstats;
+      Stats_Switch(hsi->pstats, STAGE_SCAN);
+    }
+  }
+
+  while (!result)
+  {
+    if (!hsi->framesize)
+    {
+      result = inputstream_GetStrideFrame(hsi);
+    }
+
+    if (!result)
+    {
+      if (ppart->convert)
+      {
+        result = inputstream_CopyFrame(hsi, hso);
+      }
+      else if (hsi->endindex - hsi->startindex < hsi->framesize)
+      {
+        result = ERR_INSUFFICIENT_DATA;
+      }
+      else
+      {
+        if (hsi->framesize == 420)
+        {
+          numpadded++;
+        }
+
+        inputstream_NextFrame(hsi);
+      }
+    }
+
+    if (!result)
+    {
+      numframes++;
+    }
+    else if (result == ERR_INSUFFICIENT_DATA)
+    {
+      Stats_Switch(hsi->pstats, STAGE_READ);
+      result = inputstream_ReadFile(hsi);
+      Stats_Switch(hsi->pstats, STAGE_SCAN);
+
+      if (result == ERR_INPUT_FILE_EOF)
+      {
+        result = ERR_OK;
+        break;
+      }
+    }
+  }
+
+  if (!result)
+  {
+    if (ppart->convert)
+    {
+      // The output offsets of the other parts are based on the number of
+      // frames in this part, so it must match exactly.
+      if (numframes != ppart->numframes)
+      {
+        result = ERR_SYNC;
+      }
+      else
+      {
+        result = outputstream_Flush(hso);
+      }
+    }
+    else
+    {
+      ppart->numframes = numframes;
+      ppart->numpadded = numpadded;
+    }
+  }
+
+  Stats_Switch((hsi ? hsi->pstats : NULL), STAGE_NONE);
+
+  outputstream_Destroy(hso);
+  inputstream_Destroy(hsi);
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Thread function for MppPart_Run
+unsigned __stdcall                      // Returns 0
+MppPart_Thread(
+  void *pparam)                         // Part to process
+{
+  MPPPART *ppart = (MPPPART *)pparam;
+
+  ppart->result = MppPart_Run(ppart);
+
+  return 0;
+}
+
+
+//---------------------------------------------------------------------------
+// Convert an MPP file to MP1 by writing the frames straight from the
+// memory mapped input file
+//
+// The frames in an MPP file are at the stride, and the MP1 file is the
+// same frames without the 2-byte MPP header and without the 4 bytes of
+// filler after each 44.1kHz frame that has no padding slot. Each view of
+// the input file is checked (every frame must have a valid header without
+// CRC, so that the normal conversion wouldn't change it), and the frames
+// are written in runs: a run ends with the first frame that is shorter
+// than the stride. At 48kHz and 32kHz there are no short frames, so each
+// view is written with one write, without copying it into the output
+// buffer first. At 44.1kHz, a run is about 2 frames on average; the runs
+// are copied into the output buffer.
+//
+// If the file isn't like that, this returns with *pdone set to FALSE and
+// the caller should convert the file the normal way. This may happen after
+// part of the output file was written; the normal conversion overwrites it.
+// This is only used when the file gets one thread; with more threads,
+// ProcessMppParts is used instead.
+ERR                                     // Returns error code
+ProcessMppDirect(
+  LPCSTR infilename,                    // Input file name
+  HOUTPUTSTREAM hso,                    // Output stream (not opened yet)
+  UINT buffersize,                      // Output buffer size
+  STATS *pstats,                        // Statistics (NULL=none)
+  FILEHASH *phash,                      // Hash of input (NULL=none)
+  BOOL *pdone)                          // Output TRUE=file was converted
+{
+  ERR result = ERR_OK;
+  BOOL done = FALSE;
+  HINPUTSTREAM hsi = NULL;
+  HOUTPUTSTREAM hsout = NULL;
+  UINT stride = 0;
+  UINT32 numframes = 0;
+
+  // Problems that are found before the output file is created aren't
+  // reported; the normal conversion will run into them again.
+  if (!result)
+  {
+    result = inputstream_Create(&hsi, infilename, INPUT_BUFFER_SIZE, TRUE);
+  }
+
+  if (!result)
+  {
+    hsi->pstats = pstats;
+    hsi->phash = phash;
+
+    Stats_Switch(pstats, STAGE_READ);
+    result = inputstream_ReadFile(hsi);
+  }
+
+  if (!result)
+  {
+    // The whole file must be frames at the stride. Files that aren't
+    // mapped (or that are empty) are left to the normal conversion.
+    if ( (!hsi->hmapping)
+      || (hsi->endindex < 2)
+      || (hsi->data[1])
+      || (!(stride = GetMppStride((RATEID)hsi->data[0])))
+      || (hsi->filesize <= 2)
+      || ((hsi->filesize - 2) % stride))
+    {
+      result = ERR_SYNC;
+    }
+    else
+    {
+      hsi->startindex = 2;
+    }
+  }
+
+  if (!result)
+  {
+    // From here on, we're committed: errors are reported to the caller.
+    FILE *f = fopen(hso->outname, "wb");
+
+    done = TRUE;
+
+    if (!f)
+    {
+      result = ERR_OUTPUT_FILE_OPEN;
+    }
+    else
+    {
+      fclose(f);
+
+      result = outputstream_SetCreated(hso, 0);
+    }
+  }
+
+  if (!result)
+  {
+    result = outputstream_CreateAt(&hsout, hso->outname, 0, buffersize);
+  }
+
+  if (!result)
+  {
+    hsout->pstats = pstats;
+  }
+
+  while ((!result) && (done))
+  {
+    UINT start = hsi->startindex;
+    UINT index = start;
+
+    Stats_Switch(pstats, STAGE_SCAN);
+
+    while ((!result) && (hsi->endindex - index >= stride))
+    {
+      LPCBYTE frame = hsi->data + index;
+      const HEADERINFO *phi = &HeaderTable[HEADER_KEY(frame)];
+      UINT framesize = phi->numslots * 4;
+
+      if ( (frame[0] != 0xFF)
+        || (!(frame[1] & 1))
+        || (phi->err != ERR_OK)
+        || (GetMppStride((RATEID)phi->rateid) != stride)
+        || (framesize > stride))
+      {
+        // Not a frame, a frame with a CRC, or a different sample rate
+        done = FALSE;
+        break;
+      }
+
+      index += stride;
+      numframes++;
+
+      if (framesize < stride)
+      {
+        // End of a run; leave out the filler after the frame
+        result = outputstream_Write(hsout, hsi->data + start, index - start - (stride - framesize));
+        start = index;
+      }
+    }
+
+    if ((!result) && (done) && (index > start))
+    {
+      result = outputstream_Write(hsout, hsi->data + start, index - start);
+    }
+
+    hsi->startindex = index;
+
+    if ((!result) && (done))
+    {
+      Stats_Switch(pstats, STAGE_READ);
+
+      result = inputstream_ReadFile(hsi);
+
+      if (result == ERR_INPUT_FILE_EOF)
+      {
+        result = ERR_OK;
+        break;
+      }
+    }
+  }
+
+  if ((!result) && (done))
+  {
+    result = outputstream_Flush(hsout);
+  }
+
+  Stats_Switch(pstats, STAGE_NONE);
+
+  if ((done) && (!result))
+  {
+    hso->numframes = numframes;
+  }
+
+  outputstream_Destroy(hsout);
+  inputstream_Destroy(hsi);
+
+  if (!done)
+  {
+    result = ERR_OK;
+  }
+
+  if (pdone)
+  {
+    *pdone = done;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Convert a large MPP file to MP1 by converting parts of it at the same
+// time
+//
+// Frame n of an MPP file is at offset 2 + n * stride, so the file can be
+// cut into parts that are converted by separate threads. Each thread
+// writes its output at its own offset in the MP1 file. At 48kHz and 32kHz
+// all frames are the same size so the output offsets are easy to
+// calculate. At 44.1kHz, the output offset of a part depends on how many
+// frames before it have a padding slot, so the frames are counted first
+// (also in parallel; this only reads the headers).
+//
+// If the file is too small, can't be memory mapped, or turns out to have
+// frames that aren't at the stride (e.g. because the file is corrupt or
+// has multiple sample rates), this returns with *pdone set to FALSE, and
+// the caller should convert the file the normal way.
+ERR                                     // Returns error code
+ProcessMppParts(
+  LPCSTR infilename,                    // Input file name
+  HOUTPUTSTREAM hso,                    // Output stream (not opened yet)
+  UINT numthreads,                      // Number of threads to use
+  UINT buffersize,                      // Output buffer size per thread
+  BOOL checkcrc,                        // TRUE=Check CRCs of frames
+  STATS *pstats,                        // Statistics (NULL=none)
+  FILEHASH *phash,                      // Hash of input (NULL=none)
+  BOOL *pdone)                          // Output TRUE=file was converted
+{
+  ERR result = ERR_OK;
+  BOOL done = FALSE;
+  HINPUTSTREAM hsi = NULL;
+  MPPPART parts[MAX_THREADS];
+  UINT numparts = 0;
+  UINT stride = 0;
+  UINT64 filesize = 0;
+  UINT64 outoffset = 0;
+  UINT32 numframes = 0;
+  UINT i;
+
+  // Problems that are found before the output file is created aren't
+  // reported; the normal conversion will run into them again.
+  if (!result)
+  {
+    result = inputstream_Create(&hsi, infilename, INPUT_BUFFER_SIZE, TRUE);
+  }
+
+  if (!result)
+  {
+    // Only memory mapped files can be split up
+    if (!hsi->hmapping)
+    {
+      result = ERR_INPUT_FILE_READ;
+    }
+    else
+    {
+      result = inputstream_ReadFile(hsi);
+    }
+  }
+
+  if (!result)
+  {
+    // Get the stride from the MPP header
+    if ((hsi->endindex < 2) || (hsi->data[1]) || (!(stride = GetMppStride((RATEID)hsi->data[0]))))
+    {
+      result = ERR_SYNC;
+    }
+    else
+    {
+      filesize = hsi->filesize;
+    }
+  }
+
+  inputstream_Destroy(hsi);
+
+  if (!result)
+  {
+    // Divide the frames over the parts. The last part also gets whatever
+    // is left at the end of the file.
+    UINT64 totalframes = (filesize - 2) / stride;
+
+    numparts = numthreads;
+    if (numparts > MAX_THREADS)
+    {
+      numparts = MAX_THREADS;
+    }
+
+    if (numparts > totalframes / MIN_PART_FRAMES)
+    {
+      numparts = (UINT)(totalframes / MIN_PART_FRAMES);
+    }
+
+    if (numparts < 2)
+    {
+      result = ERR_INSUFFICIENT_DATA;
+    }
+    else
+    {
+      memset(parts, 0, sizeof(parts));
+
+      for (i = 0; i < numparts; i++)
+      {
+        UINT64 firstframe = totalframes * i / numparts;
+        UINT64 endframe = totalframes * (i + 1) / numparts;
+
+        parts[i].infilename = infilename;
+        parts[i].outname = hso->outname;
+        parts[i].stride = stride;
+        parts[i].buffersize = buffersize;
+        parts[i].checkcrc = checkcrc;
+        parts[i].firstframe = (UINT)firstframe;
+        parts[i].inoffset = 2 + firstframe * stride;
+        parts[i].inend = (i + 1 < numparts ? 2 + endframe * stride : filesize);
+        parts[i].numframes = (UINT)(endframe - firstframe);
+        parts[i].usestats = (pstats != NULL);
+        parts[i].usehash = (phash != NULL);
+      }
+    }
+  }
+
+  if ((!result) && (stride == 420))
+  {
+    // At 44.1kHz, count the frames with and without padding slot
+    RunThreads(MppPart_Thread, (LPBYTE)parts, sizeof(parts[0]), numparts);
+
+    for (i = 0; (i < numparts) && (!result); i++)
+    {
+      result = parts[i].result;
+    }
+  }
+
+  if (!result)
+  {
+    // Calculate where each part goes in the output file
+    for (i = 0; i < numparts; i++)
+    {
+      parts[i].outoffset = outoffset;
+      parts[i].convert = TRUE;
+
+      if (phash)
+      {
+        // Each part hashes the blocks from the one that its first frame
+        // is in, up to the one that the next part starts in. The first
+        // view of the part starts at that block (see inputstream_MapView).
+        filehash_Init(&parts[i].hash,
+          (i ? parts[i].inoffset - parts[i].inoffset % CACHE_HASH_BLOCK_SIZE : 0),
+          (i + 1 < numparts ? parts[i + 1].inoffset - parts[i + 1].inoffset % CACHE_HASH_BLOCK_SIZE : filesize));
+      }
+
+      if (stride == 420)
+      {
+        outoffset += (UINT64)parts[i].numframes * 416 + parts[i].numpadded * 4;
+      }
+      else
+      {
+        outoffset += (UINT64)parts[i].numframes * stride;
+      }
+
+      numframes += parts[i].numframes;
+    }
+  }
+
+  if (!result)
+  {
+    // From here on, we're committed: errors are reported to the caller.
+    // Create the output file; each part opens it separately.
+    FILE *f = fopen(hso->outname, "wb");
+
+    done = TRUE;
+
+    if (!f)
+    {
+      result = ERR_OUTPUT_FILE_OPEN;
+    }
+    else
+    {
+      fclose(f);
+
+      result = outputstream_SetCreated(hso, 0);
+    }
+  }
+
+  if ((!result) && (done))
+  {
+    Console_Printf("Converting %u parts at the same time\n", numparts);
+
+    RunThreads(MppPart_Thread, (LPBYTE)parts, sizeof(parts[0]), numparts);
+
+    for (i = 0; (i < numparts) && (!result); i++)
+    {
+      result = parts[i].result;
+    }
+
+    if (result == ERR_SYNC)
+    {
+      // A frame wasn't at the stride after all. The output file will be
+      // overwritten by the normal conversion.
+      done = FALSE;
+    }
+    else if (!result)
+    {
+      hso->numframes = numframes;
+
+      if (phash)
+      {
+        filehash_Init(phash, 0, filesize);
+
+        for (i = 0; i < numparts; i++)
+        {
+          filehash_AddPart(phash, &parts[i].hash);
+        }
+      }
+    }
+
+    if ((done) && (pstats))
+    {
+      // The times are the total of all threads
+      for (i = 0; i < numparts; i++)
+      {
+        Stats_Add(pstats, &parts[i].stats);
+      }
+    }
+  }
+
+  if (!done)
+  {
+    result = ERR_OK;
+  }
+
+  if (pdone)
+  {
+    *pdone = done;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Read a number from a TRK file
+BOOL                                    // Returns FALSE if there's no number
+TrkFile_ReadNumber(
+  LPCSTR *pp,                           // Ptr to position, updated
+  LPCSTR end,                           // End of data
+  UINT *pvalue)                         // Output value
+{
+  BOOL result = FALSE;
+  LPCSTR p = *pp;
+  UINT value = 0;
+
+  while ((p < end) && (*p == ' '))
+  {
+    p++;
+  }
+
+  while ((p < end) && (*p >= '0') && (*p <= '9'))
+  {
+    value = value * 10 + (*p++ - '0');
+    result = TRUE;
+  }
+
+  *pp = p;
+  *pvalue = value;
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Read a string from a TRK file
+//
+// Strings in TRK files are stored as the length of the string, followed
+// by the string itself in double quotes.
+BOOL                                    // Returns FALSE if there's no string
+TrkFile_ReadString(
+  LPCSTR *pp,                           // Ptr to position, updated
+  LPCSTR end,                           // End of data
+  LPSTR s,                              // Output string
+  UINT size)                            // Size of output buffer
+{
+  UINT len;
+  BOOL result = TrkFile_ReadNumber(pp, end, &len);
+  LPCSTR p = *pp;
+
+  if (result)
+  {
+    while ((p < end) && (*p == ' '))
+    {
+      p++;
+    }
+
+    result = (len < size) && ((UINT)(end - p) >= len + 2) && (p[0] == '"') && (p[len + 1] == '"');
+  }
+
+  if (result)
+  {
+    memcpy(s, p + 1, len);
+    s[len] = '\0';
+
+    *pp = p + len + 2;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Read the fragments from a TRK file
+//
+// The track that's stored in a TRK file consists of fragments of MPP
+// files (see outputstream_Destroy for the format). Each fragment has the
+// base name of the MPP file (in the same directory as the TRK file), the
+// number of frames and the number of frames to skip at the start of the
+// MPP file. The rest of the TRK file isn't needed to get the audio.
+//
+// The caller must free the array of fragments.
+ERR                                     // Returns error code
+TrkFile_Read(
+  LPCSTR trkfilename,                   // TRK file name
+  TRKFRAGMENT **ppfragments,            // Output array of fragments
+  UINT *pnumfragments)                  // Output number of fragments
+{
+  ERR result = ERR_OK;
+  static const char tag[] = "=8 Fragment{";
+  FILE *f = NULL;
+  LPSTR data = NULL;
+  long size = 0;
+  TRKFRAGMENT *pfragments = NULL;
+  UINT numfragments = 0;
+  UINT dirlen = 0;
+
+  if (!result)
+  {
+    if (!(f = fopen(trkfilename, "rb")))
+    {
+      result = ERR_INPUT_FILE_OPEN;
+    }
+  }
+
+  if (!result)
+  {
+    // TRK files are small, so read the entire file
+    if ( (fseek(f, 0, SEEK_END))
+      || ((size = ftell(f)) < 0)
+      || (fseek(f, 0, SEEK_SET)))
+    {
+      result = ERR_INPUT_FILE_READ;
+    }
+  }
+
+  if (!result)
+  {
+    if (!(data = (LPSTR)malloc(size + 1)))
+    {
+      result = ERR_MALLOC;
+    }
+    else if ((size) && (!fread(data, size, 1, f)))
+    {
+      result = ERR_INPUT_FILE_READ;
+    }
+  }
+
+  if (!result)
+  {
+    // The MPP files are in the same directory as the TRK file
+    LPCSTR basename;
+
+    GetFileExtension(trkfilename, &basename);
+    dirlen = (UINT)(basename - trkfilename);
+  }
+
+  if (!result)
+  {
+    LPCSTR p = data;
+    LPCSTR end = data + size;
+
+    while ((!result) && (end - p >= (long)sizeof(tag) - 1))
+    {
+      TRKFRAGMENT fragment;
+      CHAR name[MAX_PATH];
+
+      if (memcmp(p, tag, sizeof(tag) - 1))
+      {
+        p++;
+        continue;
+      }
+
+      p += sizeof(tag) - 1;
+
+      if ( (!TrkFile_ReadString(&p, end, name, sizeof(name)))
+        || (!TrkFile_ReadNumber(&p, end, &fragment.numframes))
+        || (!TrkFile_ReadNumber(&p, end, &fragment.skip))
+        || (dirlen + strlen(name) + 4 >= MAX_PATH))
+      {
+        result = ERR_TRACK_FILE;
+        break;
+      }
+
+      // The name of the MPP file is stored without the extension
+      memcpy(fragment.filename, trkfilename, dirlen);
+      strcpy(fragment.filename + dirlen, name); // safe
+
+      if (!*GetFileExtension(name, NULL))
+      {
+        strcat(fragment.filename, ".MPP"); // safe
+      }
+
+      if (!(numfragments & (numfragments - 1)))
+      {
+        // Make room for more fragments; the array size doubles at
+        // powers of 2
+        TRKFRAGMENT *pnew = (TRKFRAGMENT *)realloc(pfragments, (numfragments ? numfragments * 2 : 1) * sizeof(TRKFRAGMENT));
+
+        if (!pnew)
+        {
+          result = ERR_MALLOC;
+          break;
+        }
+
+        pfragments = pnew;
+      }
+
+      pfragments[numfragments++] = fragment;
+    }
+  }
+
+  if ((!result) && (!numfragments))
+  {
+    result = ERR_TRACK_FILE;
+  }
+
+  if (f)
+  {
+    fclose(f);
+  }
+
+  free(data);
+
+  if (result)
+  {
+    free(pfragments);
+    pfragments = NULL;
+    numfragments = 0;
+  }
+
+  *ppfragments = pfragments;
+  *pnumfragments = numfragments;
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Copy the frames of a TRK fragment to an output stream
+//
+// In MPP files, all frames are stored at the same distance (see
+// GetMppStride), so the first frame of the fragment can be found without
+// reading the frames in front of it.
+ERR                                     // Returns error code
+TrkFragment_Run(
+  const TRKFRAGMENT *pfragment,         // Fragment to copy
+  HOUTPUTSTREAM hso,                    // Output stream handle
+  BOOL checkcrc)                        // TRUE=Check CRCs of frames
+{
+  ERR result = ERR_OK;
+  HINPUTSTREAM hsi = NULL;
+  UINT stride = 0;
+  UINT numframes = 0;
+
+  if (!result)
+  {
+    FILE *f = fopen(pfragment->filename, "rb");
+
+    if (!f)
+    {
+      result = ERR_INPUT_FILE_OPEN;
+    }
+    else
+    {
+      // Get the stride from the MPP header
+      BYTE header[2];
+
+      if ((fread(header, sizeof(header), 1, f)) && (!header[1]))
+      {
+        stride = GetMppStride((RATEID)header[0]);
+      }
+
+      if (!stride)
+      {
+        result = ERR_DATA_BAD_SAMPLERATE;
+      }
+
+      fclose(f);
+    }
+  }
+
+  if ((!result) && (pfragment->numframes))
+  {
+    result = inputstream_Create(&hsi, pfragment->filename, INPUT_BUFFER_SIZE, TRUE);
+
+    if (!result)
+    {
+      // The first view is mapped by inputstream_SetRange
+      hsi->pstats = hso->pstats;
+      result = inputstream_SetRange(hsi,
+        2 + (UINT64)pfragment->skip * stride,
+        2 + ((UINT64)pfragment->skip + pfragment->numframes) * stride);
+    }
+
+    if (!result)
+    {
+      hsi->stride = stride;
+      hsi->checkcrc = checkcrc;
+      hsi->frameno = pfragment->skip;
+    }
+
+    while (!result)
+    {
+      result = inputstream_CopyFrame(hsi, hso);
+
+      if (!result)
+      {
+        numframes++;
+      }
+      else if (result == ERR_INSUFFICIENT_DATA)
+      {
+        Stats_Switch(hso->pstats, STAGE_READ);
+        result = inputstream_ReadFile(hsi);
+        Stats_Switch(hso->pstats, STAGE_SCAN);
+
+        if (result == ERR_INPUT_FILE_EOF)
+        {
+          result = ERR_OK;
+          break;
+        }
+      }
+    }
+  }
+
+  if (!result)
+  {
+    // If frames were missing or damaged, the audio would be shorter than
+    // the track says it is
+    if (numframes != pfragment->numframes)
+    {
+      result = ERR_INSUFFICIENT_DATA;
+    }
+  }
+
+  inputstream_Destroy(hsi);
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Process a TRK file
+//
+// The fragments of the track are copied from their MPP files to a single
+// MP1 file (or WAV file) that has the same base name as the TRK file.
+ERR                                     // Returns error code
+ProcessTrkFile(
+  LPCSTR infilename,                    // TRK file name
+  STATS *pstats,                        // Statistics (NULL=none)
+  HNAMEINDEX hnames,                    // Names in use; NULL=check disk
+  const OPTIONS *poptions)              // Command line options
+{
+  ERR result = ERR_OK;
+  HOUTPUTSTREAM hso = NULL;
+  TRKFRAGMENT *pfragments = NULL;
+  UINT numfragments = 0;
+  UINT i;
+
+  if (!result)
+  {
+    result = TrkFile_Read(infilename, &pfragments, &numfragments);
+  }
+
+  if (!result)
+  {
+    result = outputstream_Create(&hso, infilename, FALSE, poptions->wav, poptions->outbuffersize, hnames, NULL);
+  }
+
+  if (!result)
+  {
+    hso->pstats = pstats;
+    Stats_Switch(pstats, STAGE_SCAN);
+
+    Console_Printf("Processing %s (%u fragment%s)\n",
+      infilename,
+      numfragments,
+      (numfragments == 1 ? "" : "s"));
+
+    for (i = 0; (!result) && (i < numfragments); i++)
+    {
+      result = TrkFragment_Run(&pfragments[i], hso, !poptions->nocrccheck);
+
+      if (result)
+      {
+        Console_Printf("%s%sError %u in fragment %u (%s)\n",
+          (poptions->numthreads > 1 ? infilename : ""),
+          (poptions->numthreads > 1 ? ": " : ""),
+          result,
+          i + 1,
+          pfragments[i].filename);
+      }
+    }
+
+    if (!result)
+    {
+      // Write the rest of the output buffer
+      result = outputstream_Flush(hso);
+    }
+
+    Stats_Switch(pstats, STAGE_NONE);
+
+    if (pstats)
+    {
+      pstats->numframes = hso->prevframes + hso->numframes;
+    }
+
+    Console_Printf("%s%s%u frame%s DONE%s\n",
+      (poptions->numthreads > 1 ? infilename : ""),
+      (poptions->numthreads > 1 ? ": " : ""),
+      hso->prevframes + hso->numframes,
+      (hso->prevframes + hso->numframes == 1 ? "" : "s"),
+      (hso->segment ? " (NOTE: split into multiple files at sample rate changes)" : ""));
+  }
+
+  outputstream_Destroy(hso);
+  free(pfragments);
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Process input file
+ERR                                     // Returns error code
+ProcessFile(
+  LPCSTR infilename,                    // Input file name
+  BOOL output_is_mpp,                   // TRUE=Generate MPP file
+  BOOL output_is_wav,                   // TRUE=Generate WAV file
+  UINT numthreads,                      // Number of threads for this file
+  STATS *pstats,                        // Statistics (NULL=none)
+  HNAMEINDEX hnames,                    // Names in use; NULL=check disk
+  CACHEENTRY *pentry,                   // Cache entry; NULL=no cache
+  const OPTIONS *poptions)              // Command line options
+{
+  ERR result = ERR_OK;
+  HINPUTSTREAM hsi = NULL;
+  HOUTPUTSTREAM hso = NULL;
+  HFRAMEINDEX hindex = NULL;
+  CHAR indexname[MAX_PATH];
+  BOOL is_stdio = FALSE;
+  FILEHASH hash;
+
+  if (!result)
+  {
+    if ((!infilename) || (!*infilename))
+    {
+      result = ERR_PARAMETER;
+    }
+    else
+    {
+      is_stdio = !strcmp(infilename, STDIO_FILENAME);
+    }
+  }
+
+  if (!result)
+  {
+    result = inputstream_Create(&hsi, infilename, INPUT_BUFFER_SIZE, !output_is_mpp);
+  }
+
+  // Standard input has no name and no time stamp to check an index against
+  if ((!result) && (poptions->index) && (output_is_mpp) && (!is_stdio))
+  {
+    // Build an index of the MP1 file while it's being read, unless there
+    // is an index already that's still up to date
+    if (!ReplaceFileExtension(infilename, indexname, NULL, "IDX", FALSE))
+    {
+      result = ERR_INPUT_FILE_NAME;
+    }
+    else
+    {
+      result = frameindex_Create(&hindex);
+    }
+
+    if (!result)
+    {
+      if (!frameindex_Load(hindex, indexname, infilename))
+      {
+        frameindex_Destroy(hindex);
+        hindex = NULL;
+      }
+      else
+      {
+        hsi->hindex = hindex;
+      }
+    }
+  }
+
+  if (!result)
+  {
+    // When decoding to WAV, the input can be MPP or MP1
+    result = outputstream_Create(&hso, infilename, (output_is_mpp) && (!output_is_wav), output_is_wav, poptions->outbuffersize, hnames, pentry);
+  }
+
+  if (!result)
+  {
+    ERR inresult  = ERR_OK;
+    ERR outresult = ERR_OK;
+    UINT32 timestamp = GetTickCount();
+    BOOL done = FALSE;
+
+    Console_Printf("Processing %s\n", infilename);
+
+    // The hash for the cache is calculated from the data as it's read
+    filehash_Init(&hash, 0, (UINT64)-1);
+
+    // With more than one thread, an MPP file is converted in parts;
+    // with one thread, the frames are written straight from the file.
+    // Either way, files that turn out not to be suitable are converted
+    // the normal way.
+    if ((!output_is_mpp) && (!output_is_wav) && (!is_stdio) && (numthreads > 1))
+    {
+      // Try to convert parts of the MPP file at the same time
+      outresult = ProcessMppParts(infilename, hso, numthreads, poptions->outbuffersize, !poptions->nocrccheck, pstats, (pentry ? &hash : NULL), &done);
+    }
+    else if ((!output_is_mpp) && (!output_is_wav) && (!is_stdio))
+    {
+      // Try to write the frames without converting them one by one
+      outresult = ProcessMppDirect(infilename, hso, poptions->outbuffersize, pstats, (pentry ? &hash : NULL), &done);
+    }
+
+    if (!done)
+    {
+      hsi->pstats = pstats;
+      hso->pstats = pstats;
+      hsi->checkcrc = !poptions->nocrccheck;
+
+      if (pentry)
+      {
+        // Start over if the file was partly hashed above
+        filehash_Init(&hash, 0, (UINT64)-1);
+        hsi->phash = &hash;
+      }
+
+      if (poptions->pipeline)
+      {
+        // Read and write in separate threads, so the input and the
+        // output overlap with each other and with the conversion
+        DWORD fileflags = (poptions->overlapped ? FILE_FLAG_OVERLAPPED : 0);
+
+        inputstream_StartReader(hsi, (fileflags ? fileflags | FILE_FLAG_SEQUENTIAL_SCAN | (poptions->unbuffered ? FILE_FLAG_NO_BUFFERING : 0) : 0));
+        outputstream_StartWriter(hso, fileflags);
+      }
+    }
+
+    while ((!done) && (!inresult) && (!outresult))
+    {
+      BOOL eof = FALSE;
+
+      Stats_Switch(pstats, STAGE_READ);
+      inresult = inputstream_ReadFile(hsi);
+      Stats_Switch(pstats, STAGE_SCAN);
+      if (inresult == ERR_INPUT_FILE_EOF)
+      {
+        eof = TRUE;
+        inresult = ERR_OK;
+        break;
+      }
+
+      while (!outresult)
+      {
+        outresult = inputstream_CopyFrames(hsi, hso);
+        if (outresult == ERR_INSUFFICIENT_DATA)
+        {
+          outresult = ERR_OK;
+          break;
+        }
+
+        if (GetTickCount() - timestamp > 1000)
+        {
+          timestamp = GetTickCount();
+
+          if (poptions->numthreads > 1)
+          {
+            // Other files are being processed at the same time, so
+            // show the file name and use a separate line.
+            Console_Printf("%s: %u frame%s\n",
+              infilename,
+              hso->prevframes + hso->numframes,
+              (hso->prevframes + hso->numframes == 1 ? "" : "s"));
+          }
+          else
+          {
+            Console_Printf("%u frame%s\r",
+              hso->prevframes + hso->numframes,
+              (hso->prevframes + hso->numframes == 1 ? "" : "s"));
+          }
+        }
+      }
+
+      if (eof)
+      {
+        break;
+      }
+    }
+
+    if (!outresult)
+    {
+      // Write the rest of the output buffer
+      outresult = outputstream_Flush(hso);
+    }
+
+    if (!outresult)
+    {
+      outresult = outputstream_Drain(hso);
+    }
+
+    Stats_Switch(pstats, STAGE_NONE);
+
+    if (pstats)
+    {
+      pstats->numframes = hso->prevframes + hso->numframes;
+    }
+
+    if ((!inresult) && (!outresult) && (hindex))
+    {
+      outresult = frameindex_Save(hindex, indexname, infilename);
+    }
+
+    Console_Printf("%s%s%u frame%s DONE%s%s%s\n",
+      (poptions->numthreads > 1 ? infilename : ""),
+      (poptions->numthreads > 1 ? ": " : ""),
+      hso->prevframes + hso->numframes,
+      (hso->prevframes + hso->numframes == 1 ? "" : "s"),
+      (hso->segment ? " (NOTE: split into multiple files at sample rate changes)" : ""),
+      (hsi->numpaddingslots ? " (NOTE: nonzero padding slots detected and cleared)" : ""),
+      (hsi->numcrcerrors ? " (NOTE: frames with CRC errors detected)" : ""));
+
+    if (inresult)
+    {
+      result = inresult;
+    }
+    else if (outresult)
+    {
+      result = outresult;
+    }
+  }
+
+  if ((!result) && (pentry) && (!filehash_Get(&hash, &pentry->hash)))
+  {
+    // Not all of the file went through the hash; this shouldn't happen
+    cache_GetHash(infilename, &pentry->hash);
+  }
+
+  result = outputstream_Commit(hso, result);
+
+  outputstream_Destroy(hso);
+  inputstream_Destroy(hsi);
+  frameindex_Destroy(hindex);
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Initialize a job for an input file
+//
+// The file name extension determines what kind of output is generated.
+// For standard input, the --to option determines it instead. Problems with
+// the file name are stored in the result of the job, so that they are
+// reported in the same way as conversion errors.
+//
+// If the file was found in a directory search, the directory entry
+// provides the file size; otherwise the function looks it up.
+void
+Job_Init(
+  JOB *pjob,                            // Job to initialize
+  LPCSTR inputfilename,                 // Input file name
+  const WIN32_FIND_DATA *pfd,           // Directory entry; NULL=unknown
+  const OPTIONS *poptions)              // Command line options
+{
+  ERR result = ERR_OK;
+  BOOL output_is_mpp = FALSE;
+  BOOL output_is_wav = poptions->wav;
+  BOOL is_trk = FALSE;
+  BOOL is_stdio = FALSE;
+  UINT64 filesize = 0;
+
+  if (!result)
+  {
+    if (!*inputfilename)
+    {
+      result = ERR_INPUT_FILE_NAME;
+    }
+  }
+
+  if ((!result) && (!strcmp(inputfilename, STDIO_FILENAME)))
+  {
+    is_stdio = TRUE;
+
+    // Standard input is MP1 data, except when converting to MP1. When
+    // decoding to WAV, MPP data is okay too: the input stream finds
+    // the frames in between the MPP header and padding.
+    if (!poptions->to)
+    {
+      result = ERR_COMMAND;
+    }
+    else if (!stricmp(poptions->to, "MPP"))
+    {
+      output_is_mpp = TRUE;
+      output_is_wav = FALSE;
+    }
+    else if (!stricmp(poptions->to, "WAV"))
+    {
+      output_is_mpp = TRUE;
+      output_is_wav = TRUE;
+    }
+    else
+    {
+      output_is_wav = FALSE;
+    }
+  }
+  else if (!result)
+  {
+    LPCSTR extension = GetFileExtension(inputfilename, NULL);
+
+    if (extension)
+    {
+      if (!stricmp(extension, ".MP1"))
+      {
+        output_is_mpp = TRUE;
+      }
+      else if (!stricmp(extension, ".MPP"))
+      {
+        // Nothing to do
+      }
+      else if (!stricmp(extension, ".TRK"))
+      {
+        is_trk = TRUE;
+      }
+      else
+      {
+        // Filename extension not recognized
+        result = ERR_INPUT_FILE_NAME;
+      }
+    }
+    else
+    {
+      // File name has no extension
+      result = ERR_INPUT_FILE_NAME;
+    }
+  }
+
+  if ((!result) && (pfd))
+  {
+    filesize = ((UINT64)pfd->nFileSizeHigh << 32) | pfd->nFileSizeLow;
+  }
+  else if ((!result) && (!is_stdio))
+  {
+    // Get the file size so that large files can be started first.
+    // If this fails, the file is handled as if it's empty, and the
+    // error will be reported when we try to open it.
+    WIN32_FIND_DATA fd;
+    HANDLE hfind = FindFirstFile(inputfilename, &fd);
+
+    if (hfind != INVALID_HANDLE_VALUE)
+    {
+      filesize = ((UINT64)fd.nFileSizeHigh << 32) | fd.nFileSizeLow;
+
+      FindClose(hfind);
+    }
+  }
+
+  pjob->filename = inputfilename;
+  pjob->output_is_mpp = output_is_mpp;
+  pjob->output_is_wav = output_is_wav;
+  pjob->is_trk = is_trk;
+  pjob->filesize = filesize;
+  pjob->numthreads = 1;
+  pjob->result = result;
+}
+
+
+//---------------------------------------------------------------------------
+// Check the source file of a job against the cache
+//
+// A job can be skipped if its source file has the same size and last
+// write time as when it was converted, and the output files still exist.
+// If only the time is different, the hash of the entire file decides.
+// Otherwise, the hash is calculated by the conversion (see ProcessFile).
+//
+// If the job has to run, the names of the old output files are taken out
+// of the name index, so that the new output files can replace them. If
+// the cache can't be updated for a skipped job, the job's result is set.
+BOOL                                    // Returns TRUE to skip the job
+Job_CheckCache(
+  JOB *pjob,                            // Job
+  HCACHE hcache,                        // Cache
+  HNAMEINDEX hnames,                    // Names in output directories
+  CACHEENTRY *pentry,                   // New entry with source name
+  CACHEENTRY *pold)                     // Output: old entry, if any
+{
+  BOOL skip = FALSE;
+  UINT entry;
+  LPCSTR s;
+  UINT n;
+
+  // If this fails, the conversion reports the error
+  GetFileInfo(pjob->filename, &pentry->filesize, &pentry->filetime);
+
+  EnterCriticalSection(&hcache->lock);
+
+  if ((entry = cache_Find(hcache, pjob->filename, FALSE)) != 0)
+  {
+    *pold = hcache->entries[entry - 1];
+
+    if ((pold->names = (LPSTR)malloc(pold->namessize)) != NULL)
+    {
+      memcpy(pold->names, hcache->entries[entry - 1].names, pold->namessize);
+    }
+    else
+    {
+      // Convert the file as if it's not in the cache
+      memset(pold, 0, sizeof(*pold));
+    }
+  }
+
+  LeaveCriticalSection(&hcache->lock);
+
+  if ((pold->names) && (pentry->filesize == pold->filesize))
+  {
+    if (pentry->filetime == pold->filetime)
+    {
+      skip = TRUE;
+    }
+    else
+    {
+      skip = ((cache_GetHash(pjob->filename, &pentry->hash)) && (pentry->hash == pold->hash));
+    }
+
+    for (n = 0, s = pold->names; (skip) && (n < pold->numnames); n++, s += strlen(s) + 1)
+    {
+      if ((n) && (GetFileAttributes(s) == INVALID_FILE_ATTRIBUTES))
+      {
+        skip = FALSE;
+      }
+    }
+
+    if ((skip) && (pentry->filetime != pold->filetime))
+    {
+      // The file was touched; remember the new time so that the hash
+      // doesn't have to be calculated again next time
+      free(pentry->names);
+      pentry->names = pold->names;
+      pentry->numnames = pold->numnames;
+      pentry->namessize = pold->namessize;
+      pold->names = NULL;
+
+      pjob->result = cache_Update(hcache, pentry);
+    }
+
+    if (skip)
+    {
+      Console_Printf("%s: Not changed, skipped\n", pjob->filename);
+    }
+  }
+
+  if (!skip)
+  {
+    for (n = 0, s = pold->names; n < pold->numnames; n++, s += strlen(s) + 1)
+    {
+      if (n)
+      {
+        nameindex_Release(hnames, s);
+      }
+    }
+  }
+
+  return skip;
+}
+
+
+//---------------------------------------------------------------------------
+// Store the result of a job in the cache
+//
+// Old output files that weren't replaced by a new file with the same name
+// are deleted, unless another job is using the name now.
+ERR                                     // Returns error code
+Job_UpdateCache(
+  HCACHE hcache,                        // Cache
+  HNAMEINDEX hnames,                    // Names in output directories
+  CACHEENTRY *pentry,                   // New entry; names taken
+  const CACHEENTRY *pold)               // Old entry (numnames=0 if none)
+{
+  LPCSTR s;
+  UINT n;
+
+  for (n = 0, s = pold->names; n < pold->numnames; n++, s += strlen(s) + 1)
+  {
+    BOOL replaced = FALSE;
+    LPCSTR t = pentry->names;
+    UINT m;
+
+    for (m = 0; (n) && (!replaced) && (m < pentry->numnames); m++, t += strlen(t) + 1)
+    {
+      replaced = ((m) && (!stricmp(s, t)));
+    }
+
+    if ((n) && (!replaced))
+    {
+      nameindex_DeleteFile(hnames, s);
+    }
+  }
+
+  return cache_Update(hcache, pentry);
+}
+
+
+//---------------------------------------------------------------------------
+// Run a job
+//
+// With the cache, jobs for source files that didn't change are skipped.
+// TRK files are always converted, because their output depends on the MPP
+// files too.
+void
+Job_Run(
+  JOB *pjob,                            // Job to run
+  HNAMEINDEX hnames,                    // Names in output directories
+  HCACHE hcache,                        // Cache (filename=NULL: none)
+  const OPTIONS *poptions)              // Command line options
+{
+  STATS *pstats = (poptions->stats ? &pjob->stats : NULL);
+  CACHEENTRY entry;
+  CACHEENTRY old;
+  CACHEENTRY *pentry = NULL;
+  BOOL skip = FALSE;
+
+  memset(&entry, 0, sizeof(entry));
+  memset(&old, 0, sizeof(old));
+
+  if ( (!pjob->result)
+    && (hcache->filename)
+    && (!pjob->is_trk)
+    && (strcmp(pjob->filename, STDIO_FILENAME)))
+  {
+    if (!cacheentry_AddName(&entry, pjob->filename))
+    {
+      pjob->result = ERR_MALLOC;
+    }
+    else
+    {
+      pentry = &entry;
+      skip = Job_CheckCache(pjob, hcache, hnames, &entry, &old);
+    }
+  }
+
+  if (skip)
+  {
+    // Nothing to do
+  }
+  else if ((!pjob->result) && (pjob->is_trk))
+  {
+    pjob->result = ProcessTrkFile(pjob->filename, pstats, hnames, poptions);
+  }
+  else if (!pjob->result)
+  {
+    // We have an input file name and we know
+    // if we are creating an MPP file. Let's go!
+    pjob->result = ProcessFile(pjob->filename, pjob->output_is_mpp, pjob->output_is_wav, pjob->numthreads, pstats, hnames, pentry, poptions);
+  }
+
+  if ((!pjob->result) && (!skip) && (pentry))
+  {
+    pjob->result = Job_UpdateCache(hcache, hnames, &entry, &old);
+  }
+
+  free(entry.names);
+  free(old.names);
+
+  if (pjob->result)
+  {
+    // TODO: print error message
+    Console_Printf("Error %u processing file %s\n", pjob->result, pjob->filename);
+  }
+
+  if (pstats)
+  {
+    Stats_Print(pstats, "file", pjob->filename, 1, pjob->result, 0.0);
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Check if a job should be started before another job
+//
+// With multiple threads, the largest files are started first so that the
+// batch doesn't end with one big file being converted by itself. With
+// one thread, or for files of equal size, the command line order is kept.
+BOOL                                    // Returns TRUE if job 1 goes first
+JobQueue_IsBefore(
+  const JOBQUEUE *pqueue,               // Job queue
+  const JOB *pjob1,                     // First job
+  const JOB *pjob2)                     // Second job
+{
+  BOOL result;
+
+  if ((pqueue->bysize) && (pjob1->filesize != pjob2->filesize))
+  {
+    result = (pjob1->filesize > pjob2->filesize);
+  }
+  else
+  {
+    result = (pjob1->index < pjob2->index);
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Put a job in the heap of waiting jobs
+//
+// The heap is a binary tree in an array, with the job that should be
+// started first at the top. The caller must hold the lock, and the
+// array must have room for the job.
+void
+JobQueue_Push(
+  JOBQUEUE *pqueue,                     // Job queue
+  JOB *pjob)                            // Job to add
+{
+  UINT index = pqueue->numwaiting++;
+
+  // Move parents down until the job is in the right place
+  while (index)
+  {
+    UINT parent = (index - 1) / 2;
+
+    if (!JobQueue_IsBefore(pqueue, pjob, pqueue->waiting[parent]))
+    {
+      break;
+    }
+
+    pqueue->waiting[index] = pqueue->waiting[parent];
+    index = parent;
+  }
+
+  pqueue->waiting[index] = pjob;
+}
+
+
+//---------------------------------------------------------------------------
+// Take the job that should be started first from the heap
+//
+// The caller must hold the lock, and the heap must not be empty.
+JOB *                                   // Returns job
+JobQueue_Pop(
+  JOBQUEUE *pqueue)                     // Job queue
+{
+  JOB *result = pqueue->waiting[0];
+  JOB *plast = pqueue->waiting[--pqueue->numwaiting];
+  UINT index = 0;
+
+  // Move the last job down from the top until it's in the right place
+  for (;;)
+  {
+    UINT child = index * 2 + 1;
+
+    if (child >= pqueue->numwaiting)
+    {
+      break;
+    }
+
+    if ( (child + 1 < pqueue->numwaiting)
+      && (JobQueue_IsBefore(pqueue, pqueue->waiting[child + 1], pqueue->waiting[child])))
+    {
+      child++;
+    }
+
+    if (!JobQueue_IsBefore(pqueue, pqueue->waiting[child], plast))
+    {
+      break;
+    }
+
+    pqueue->waiting[index] = pqueue->waiting[child];
+    index = child;
+  }
+
+  pqueue->waiting[index] = plast;
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Worker thread that runs jobs from a job queue until there are none left
+//
+// The semaphore is released once for every job, and once for every thread
+// when no more jobs will be added (see JobQueue_Finish). A thread that
+// finds the heap empty after waiting for the semaphore is done.
+unsigned __stdcall                      // Returns 0
+JobQueue_Thread(
+  void *pparam)                         // Job queue
+{
+  JOBQUEUE *pqueue = (JOBQUEUE *)pparam;
+
+  for (;;)
+  {
+    JOB *pjob = NULL;
+
+    WaitForSingleObject(pqueue->hsemaphore, INFINITE);
+
+    EnterCriticalSection(&pqueue->lock);
+
+    if (pqueue->numwaiting)
+    {
+      pjob = JobQueue_Pop(pqueue);
+    }
+
+    LeaveCriticalSection(&pqueue->lock);
+
+    if (!pjob)
+    {
+      break;
+    }
+
+    Job_Run(pjob, &pqueue->names, &pqueue->cache, pqueue->poptions);
+  }
+
+  return 0;
+}
+
+
+//---------------------------------------------------------------------------
+// Initialize a job queue
+ERR                                     // Returns error code
+JobQueue_Init(
+  JOBQUEUE *pqueue,                     // Job queue to initialize
+  const OPTIONS *poptions)              // Command line options
+{
+  ERR result = ERR_OK;
+  double cpu;
+
+  memset(pqueue, 0, sizeof(*pqueue));
+  pqueue->bysize = (poptions->numthreads > 1);
+  pqueue->poptions = poptions;
+
+  Stats_GetTimes(&pqueue->start, &cpu);
+
+  InitializeCriticalSection(&pqueue->lock);
+  nameindex_Init(&pqueue->names);
+  cache_Init(&pqueue->cache, poptions->cache);
+
+  if (!(pqueue->hsemaphore = CreateSemaphore(NULL, 0, 0x7FFFFFFF, NULL)))
+  {
+    result = ERR_MALLOC;
+  }
+
+  if (!result)
+  {
+    result = cache_Load(&pqueue->cache);
+  }
+
+  if (result)
+  {
+    if (pqueue->hsemaphore)
+    {
+      CloseHandle(pqueue->hsemaphore);
+    }
+
+    cache_Destroy(&pqueue->cache);
+    nameindex_Destroy(&pqueue->names);
+    DeleteCriticalSection(&pqueue->lock);
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Start the worker threads of a job queue
+//
+// If no thread can be started, the jobs are run by the current thread
+// when the queue is finished.
+void
+JobQueue_Start(
+  JOBQUEUE *pqueue)                     // Job queue
+{
+  UINT i;
+
+  for (i = 0; i < pqueue->poptions->numthreads; i++)
+  {
+    HANDLE hthread = (HANDLE)_beginthreadex(NULL, 0, JobQueue_Thread, pqueue, 0, NULL);
+
+    if (hthread)
+    {
+      pqueue->hthreads[pqueue->numthreads++] = hthread;
+    }
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Add a job for an input file to a job queue
+//
+// The threads are started when the second job is added. Until then, it's
+// possible that there is only one file, which gets all the threads by
+// itself (see JobQueue_Finish).
+//
+// With the cache, files that were generated from another file in the
+// cache (e.g. MPP files that were converted from MP1 files in an earlier
+// run) are not added.
+ERR                                     // Returns error code
+JobQueue_Add(
+  JOBQUEUE *pqueue,                     // Job queue
+  LPCSTR inputfilename,                 // Input file name
+  const WIN32_FIND_DATA *pfd)           // Directory entry; NULL=unknown
+{
+  ERR result = ERR_OK;
+  JOB *pjob = NULL;
+
+  if (!result)
+  {
+    // The file name is stored behind the job
+    if (!(pjob = (JOB *)calloc(1, sizeof(JOB) + strlen(inputfilename) + 1)))
+    {
+      result = ERR_MALLOC;
+    }
+    else
+    {
+      strcpy((LPSTR)(pjob + 1), inputfilename); // safe
+
+      Job_Init(pjob, (LPCSTR)(pjob + 1), pfd, pqueue->poptions);
+      pjob->index = pqueue->numjobs;
+    }
+  }
+
+  if (!result)
+  {
+    EnterCriticalSection(&pqueue->lock);
+
+    if (pqueue->numjobs == pqueue->maxjobs)
+    {
+      UINT maxjobs = (pqueue->maxjobs ? pqueue->maxjobs * 2 : 64);
+      JOB **jobs = (JOB **)realloc(pqueue->jobs, maxjobs * sizeof(JOB *));
+
+      if (jobs)
+      {
+        pqueue->jobs = jobs;
+
+        if ((jobs = (JOB **)realloc(pqueue->waiting, maxjobs * sizeof(JOB *))) != NULL)
+        {
+          pqueue->waiting = jobs;
+          pqueue->maxjobs = maxjobs;
+        }
+      }
+
+      if (!jobs)
+      {
+        result = ERR_MALLOC;
+      }
+    }
+
+    if (!result)
+    {
+      pqueue->jobs[pqueue->numjobs++] = pjob;
+
+      JobQueue_Push(pqueue, pjob);
+    }
+
+    LeaveCriticalSection(&pqueue->lock);
+  }
+
+  if (!result)
+  {
+    ReleaseSemaphore(pqueue->hsemaphore, 1, NULL);
+
+    if (pqueue->numjobs == 2)
+    {
+      JobQueue_Start(pqueue);
+    }
+  }
+  else
+  {
+    free(pjob);
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Add jobs for the files in a directory that match a pattern
+//
+// All matching files in the directory are listed before they are added,
+// because the output files of jobs that are already running appear in the
+// same directory. Output files of jobs that were added earlier (e.g. for
+// another pattern) may already be in the list; they're recognized by
+// their names in the name index and skipped. Directories that are links are skipped, so that a link
+// to a parent directory doesn't make the search go around in circles.
+ERR                                     // Returns error code
+JobQueue_AddDirectory(
+  JOBQUEUE *pqueue,                     // Job queue
+  LPCSTR directory,                     // Directory, ending in separator
+  size_t dirlen,                        // Length of directory
+  LPCSTR pattern,                       // File name pattern
+  BOOL trk,                             // TRUE=Also find .TRK files
+  UINT *pnumfound)                      // Incremented for each file found
+{
+  ERR result = ERR_OK;
+  LPSTR path = NULL;
+  WIN32_FIND_DATA *pfiles = NULL;
+  UINT numfiles = 0;
+  UINT maxfiles = 0;
+  HANDLE hfind = INVALID_HANDLE_VALUE;
+  WIN32_FIND_DATA fd;
+  UINT i;
+
+  if (!result)
+  {
+    // Room for the directory, the pattern or a name, and a separator
+    size_t namelen = strlen(pattern);
+
+    if (!(path = (LPSTR)malloc(dirlen + (namelen > MAX_PATH ? namelen : MAX_PATH) + 2)))
+    {
+      result = ERR_MALLOC;
+    }
+    else
+    {
+      memcpy(path, directory, dirlen);
+      strcpy(path + dirlen, pattern); // safe
+    }
+  }
+
+  if ((!result) && ((hfind = FindFirstFile(path, &fd)) != INVALID_HANDLE_VALUE))
+  {
+    do
+    {
+      LPCSTR extension = GetFileExtension(fd.cFileName, NULL);
+
+      if ( (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+        && ( (!stricmp(extension, ".MP1"))
+          || (!stricmp(extension, ".MPP"))
+          || ((trk) && (!stricmp(extension, ".TRK")))))
+      {
+        if (numfiles == maxfiles)
+        {
+          UINT newmax = (maxfiles ? maxfiles * 2 : 64);
+          WIN32_FIND_DATA *pnew = (WIN32_FIND_DATA *)realloc(pfiles, newmax * sizeof(WIN32_FIND_DATA));
+
+          if (!pnew)
+          {
+            result = ERR_MALLOC;
+            break;
+          }
+
+          pfiles = pnew;
+          maxfiles = newmax;
+        }
+
+        pfiles[numfiles++] = fd;
+      }
+    } while (FindNextFile(hfind, &fd));
+
+    FindClose(hfind);
+  }
+
+  for (i = 0; (i < numfiles) && (!result); i++)
+  {
+    BOOL is_output = FALSE;
+
+    strcpy(path + dirlen, pfiles[i].cFileName); // safe
+
+    // Skip the output files of jobs that were started earlier, and
+    // files that the cache knows as output of another file
+    if (nameindex_IsReserved(&pqueue->names, path))
+    {
+      is_output = TRUE;
+    }
+    else if (pqueue->cache.filename)
+    {
+      EnterCriticalSection(&pqueue->cache.lock);
+      is_output = (cache_Find(&pqueue->cache, path, TRUE) != 0);
+      LeaveCriticalSection(&pqueue->cache.lock);
+
+      if (is_output)
+      {
+        Console_Printf("%s: Generated from another file in the cache, skipped\n", path);
+      }
+    }
+
+    if (!is_output)
+    {
+      result = JobQueue_Add(pqueue, path, &pfiles[i]);
+    }
+
+    (*pnumfound)++;
+  }
+
+  if ((!result) && (pqueue->poptions->recursive))
+  {
+    strcpy(path + dirlen, "*"); // safe
+
+    if ((hfind = FindFirstFile(path, &fd)) != INVALID_HANDLE_VALUE)
+    {
+      do
+      {
+        if ( (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+          && (!(fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+          && (strcmp(fd.cFileName, "."))
+          && (strcmp(fd.cFileName, "..")))
+        {
+          sprintf(path + dirlen, "%s\\", fd.cFileName); // safe
+
+          result = JobQueue_AddDirectory(pqueue, path, strlen(path), pattern, trk, pnumfound);
+        }
+      } while ((!result) && (FindNextFile(hfind, &fd)));
+
+      FindClose(hfind);
+    }
+  }
+
+  free(pfiles);
+  free(path);
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Add jobs for a file name from the command line
+//
+// The name can be a file, a directory or a file name with wildcards (* and
+// ?). For a directory, all .MP1 and .MPP files in it are converted. With
+// wildcards, .TRK files that match are converted too. With the --recursive
+// option, subdirectories are searched as well. If nothing is found, the
+// name itself is added as a job, so that the error is reported.
+ERR                                     // Returns error code
+JobQueue_AddPath(
+  JOBQUEUE *pqueue,                     // Job queue
+  LPCSTR name)                          // Name from the command line
+{
+  ERR result = ERR_OK;
+  LPCSTR basename;
+  DWORD attributes;
+  UINT numfound = 0;
+
+  GetFileExtension(name, &basename);
+
+  if (strpbrk(basename, "*?"))
+  {
+    // Search the directory in front of the pattern
+    result = JobQueue_AddDirectory(pqueue, name, basename - name, basename, TRUE, &numfound);
+  }
+  else if ( ((attributes = GetFileAttributes(name)) != INVALID_FILE_ATTRIBUTES)
+         && (attributes & FILE_ATTRIBUTE_DIRECTORY))
+  {
+    size_t len = strlen(name);
+    LPSTR directory = (LPSTR)malloc(len + 2);
+
+    if (!directory)
+    {
+      result = ERR_MALLOC;
+    }
+    else
+    {
+      strcpy(directory, name); // safe
+
+      if ((len) && (!strchr("\\/:", name[len - 1])))
+      {
+        directory[len++] = '\\';
+        directory[len] = '\0';
+      }
+
+      result = JobQueue_AddDirectory(pqueue, directory, len, "*", FALSE, &numfound);
+
+      free(directory);
+    }
+  }
+
+  if ((!result) && (!numfound))
+  {
+    result = JobQueue_Add(pqueue, name, NULL);
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Wait until all jobs in a job queue are done
+//
+// This must be called after the last job is added. If there's only one
+// job, it gets all the threads (see ProcessMppParts) and runs in the
+// current thread.
+ERR                                     // Returns error code
+JobQueue_Finish(
+  JOBQUEUE *pqueue)                     // Job queue
+{
+  ERR result = ERR_OK;
+  UINT i;
+  double cpu;
+
+  if (pqueue->numjobs == 1)
+  {
+    // A single file can use all the threads by itself
+    pqueue->jobs[0]->numthreads = pqueue->poptions->numthreads;
+  }
+
+  if (pqueue->numthreads)
+  {
+    // Tell every thread that there are no more jobs
+    ReleaseSemaphore(pqueue->hsemaphore, pqueue->numthreads, NULL);
+
+    WaitForMultipleObjects(pqueue->numthreads, pqueue->hthreads, TRUE, INFINITE);
+
+    for (i = 0; i < pqueue->numthreads; i++)
+    {
+      CloseHandle(pqueue->hthreads[i]);
+    }
+
+    pqueue->numthreads = 0;
+  }
+  else
+  {
+    ReleaseSemaphore(pqueue->hsemaphore, 1, NULL);
+
+    JobQueue_Thread(pqueue);
+  }
+
+  // Return the first error in command line order
+  for (i = 0; (i < pqueue->numjobs) && (!result); i++)
+  {
+    result = pqueue->jobs[i]->result;
+  }
+
+  // The cache is saved even if some files failed, so that the files that
+  // were converted are skipped next time
+  if (!result)
+  {
+    result = cache_Save(&pqueue->cache);
+  }
+  else
+  {
+    cache_Save(&pqueue->cache);
+  }
+
+  if (pqueue->poptions->stats)
+  {
+    // The times of the stages are the total of all threads; the elapsed
+    // time is the wall clock time of the entire batch
+    STATS stats;
+    double end;
+
+    memset(&stats, 0, sizeof(stats));
+
+    for (i = 0; i < pqueue->numjobs; i++)
+    {
+      Stats_Add(&stats, &pqueue->jobs[i]->stats);
+    }
+
+    Stats_GetTimes(&end, &cpu);
+    Stats_Print(&stats, "batch", NULL, pqueue->numjobs, result, end - pqueue->start);
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Free the jobs of a job queue
+void
+JobQueue_Destroy(
+  JOBQUEUE *pqueue)                     // Job queue
+{
+  UINT i;
+
+  for (i = 0; i < pqueue->numjobs; i++)
+  {
+    free(pqueue->jobs[i]);
+  }
+
+  free(pqueue->jobs);
+  free(pqueue->waiting);
+
+  CloseHandle(pqueue->hsemaphore);
+  cache_Destroy(&pqueue->cache);
+  nameindex_Destroy(&pqueue->names);
+  DeleteCriticalSection(&pqueue->lock);
+}
+
+
+//---------------------------------------------------------------------------
+// Get a time stamp for benchmarking, in seconds
+double                                  // Returns time in seconds
+Benchmark_GetTime(void)
+{
+  static double frequency;
+  LARGE_INTEGER counter;
+
+  if (!frequency)
+  {
+    LARGE_INTEGER f;
+
+    QueryPerformanceFrequency(&f);
+    frequency = (double)f.QuadPart;
+  }
+
+  QueryPerformanceCounter(&counter);
+
+  return (double)counter.QuadPart / frequency;
+}
+
+
+//---------------------------------------------------------------------------
+// Generate a pseudo random number for benchmarking
+//
+// The benchmark data must be the same every time, so rand() isn't used.
+UINT32                                  // Returns pseudo random number
+Benchmark_Random(
+  UINT32 *pseed)                        // Seed, updated
+{
+  *pseed = *pseed * 1664525 + 1013904223;
+
+  return *pseed >> 8;
+}
+
+
+//---------------------------------------------------------------------------
+// Fill a buffer with random data
+void
+Benchmark_FillRandom(
+  LPBYTE buffer,                        // Buffer to fill
+  UINT size,                            // Number of bytes
+  UINT32 seed)                          // Random seed
+{
+  UINT i;
+
+  for (i = 0; i < size; i++)
+  {
+    buffer[i] = (BYTE)Benchmark_Random(&seed);
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Fill a buffer with 48kHz frames, where every other frame is corrupted
+void
+Benchmark_FillCorrupted(
+  LPBYTE buffer,                        // Buffer to fill
+  UINT size,                            // Number of bytes
+  UINT32 seed)                          // Random seed
+{
+  UINT i;
+
+  Benchmark_FillRandom(buffer, size, seed);
+
+  for (i = 0; i + 384 <= size; i += 2 * 384)
+  {
+    buffer[i + 0] = 0xFF;
+    buffer[i + 1] = 0xFF;
+    buffer[i + 2] = 0xC4;
+    buffer[i + 3] = 0x0C;
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Find the first valid DCC header one byte at a time
+//
+// This is how GetFrameSize used to resynchronize, for comparison.
+UINT                                    // Returns offset of header
+Benchmark_FindHeaderBytewise(
+  LPCBYTE data,                         // Data to search
+  UINT insize)                          // Number of bytes in data
+{
+  UINT i;
+
+  for (i = 0; i + 4 <= insize; i++)
+  {
+    if ((data[i] == 0xFF) && (IS_DCC_HEADER(data + i)))
+    {
+      break;
+    }
+  }
+
+  return (i + 4 <= insize ? i : (insize < 3 ? 0 : insize - 3));
+}
+
+
+//---------------------------------------------------------------------------
+// Run a header scanner over a block of data and report the speed
+void
+Benchmark_Scan(
+  LPCSTR testname,                      // Name of the test data
+  LPCSTR scannername,                   // Name of the scanner
+  UINT (*scanner)(LPCBYTE, UINT),       // Scanner function
+  LPCBYTE data,                         // Data to scan
+  UINT size)                            // Number of bytes
+{
+  UINT numfound = 0;
+  UINT pass;
+  double start;
+  double elapsed;
+
+  start = Benchmark_GetTime();
+
+  for (pass = 0; pass < 4; pass++)
+  {
+    UINT i = 0;
+
+    while (i + 4 <= size)
+    {
+      i += scanner(data + i, size - i);
+
+      if ((i + 4 <= size) && (IS_DCC_HEADER(data + i)))
+      {
+        numfound++;
+      }
+
+      i++;
+    }
+  }
+
+  elapsed = Benchmark_GetTime() - start;
+
+  printf("scan %-10s %-8s %10.1f MB/s %8u headers\n",
+    testname,
+    scannername,
+    (elapsed ? 4.0 * size / elapsed / 1000000.0 : 0.0),
+    numfound / 4);
+}
+
+
+//---------------------------------------------------------------------------
+// Fill a buffer with valid 44.1kHz frames
+//
+// Only the headers are filled in; the rest of the frame is random data.
+// Returns the number of frames
+UINT                                    // Returns number of frames
+Benchmark_FillFrames(
+  LPBYTE buffer,                        // Buffer to fill
+  UINT size,                            // Number of bytes
+  UINT32 seed)                          // Random seed
+{
+  UINT numframes = 0;
+  UINT i = 0;
+
+  Benchmark_FillRandom(buffer, size, seed);
+
+  for (;;)
+  {
+    // 24 out of every 49 frames are padded
+    BOOL padded = ((numframes % 49) * 24 / 49) != (((numframes % 49) + 1) * 24 / 49);
+    UINT framesize = (padded ? 420 : 416);
+
+    if (i + framesize > size)
+    {
+      break;
+    }
+
+    buffer[i + 0] = 0xFF;
+    buffer[i + 1] = 0xFF;
+    buffer[i + 2] = (BYTE)(padded ? 0xC2 : 0xC0);
+    buffer[i + 3] = 0x0C;
+
+    i += framesize;
+    numframes++;
+  }
+
+  return numframes;
+}
+
+
+//---------------------------------------------------------------------------
+// Fill a buffer with 4-byte headers, half of which are invalid
+//
+// The headers are stored back to back. All headers start with a sync byte
+// and the invalid headers have one randomly chosen bad bit field, so that
+// decoding them takes a different path each time.
+void
+Benchmark_FillHeaders(
+  LPBYTE buffer,                        // Buffer to fill
+  UINT size,                            // Number of bytes
+  UINT32 seed)                          // Random seed
+{
+  UINT i;
+
+  for (i = 0; i + 4 <= size; i += 4)
+  {
+    UINT32 r = Benchmark_Random(&seed);
+
+    buffer[i + 0] = 0xFF;
+    buffer[i + 1] = (BYTE)(0xFE | (r & 0x01));
+    buffer[i + 2] = (BYTE)(0xC0 | ((r >> 1) & 0x03) | (((r >> 3) % 3) << 2));
+    buffer[i + 3] = (BYTE)(((r >> 5) % 3) << 6);
+
+    if (r & 0x8000)
+    {
+      switch ((r >> 16) % 5)
+      {
+      case 0: buffer[i + 1] &= 0x7F; break; // Bad sync
+      case 1: buffer[i + 1] &= 0xF7; break; // Not MPEG 1
+      case 2: buffer[i + 2] &= 0x7F; break; // Not 384kbps
+      case 3: buffer[i + 2] |= 0x0C; break; // Bad sample rate
+      default: buffer[i + 3] |= 0xC0; break; // Mono
+      }
+    }
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Measure how fast frame headers are decoded
+//
+// The header table is compared to the branches that are used to generate
+// the table, which is how GetFrameSize used to work.
+//
+// The data should be small enough to fit in the cache, otherwise this
+// measures the speed of the memory instead.
+void
+Benchmark_Headers(
+  LPCSTR testname,                      // Name of the test data
+  LPCBYTE data,                         // Data with headers
+  UINT size,                            // Number of bytes
+  BOOL walk)                            // TRUE=follow frame sizes
+{
+  UINT method;
+
+  for (method = 0; method < 2; method++)
+  {
+    UINT numframes = 0;
+    UINT checksum = 0;
+    UINT pass;
+    double start;
+    double elapsed;
+
+    start = Benchmark_GetTime();
+
+    for (pass = 0; pass < 256; pass++)
+    {
+      UINT i = 0;
+
+      while (i + 4 <= size)
+      {
+        HEADERINFO hi;
+
+        if (method)
+        {
+          DecodeHeader(data + i, &hi);
+        }
+        else
+        {
+          hi = HeaderTable[HEADER_KEY(data + i)];
+        }
+
+        checksum += hi.err + hi.numslots;
+        numframes++;
+
+        if (walk)
+        {
+          if (!hi.numslots)
+          {
+            break;
+          }
+
+          i += hi.numslots * 4;
+        }
+        else
+        {
+          i += 4;
+        }
+      }
+    }
+
+    elapsed = Benchmark_GetTime() - start;
+
+    printf("header %-10s %-8s %12.0f headers/s (checksum %u)\n",
+      testname,
+      (method ? "branches" : "table"),
+      (elapsed ? numframes / elapsed : 0.0),
+      checksum);
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Calculate the CRC of a Layer 1 frame one bit at a time
+//
+// This is the way the CRC is described in the MPEG standard, for
+// comparison with GetFrameCrc. The results must be the same.
+UINT16                                  // Returns CRC
+Benchmark_GetFrameCrcBitwise(
+  LPCBYTE frame)                        // Frame with valid header
+{
+  UINT crc = 0xFFFF;
+  UINT bound = 32;
+  UINT numbits;
+  UINT i;
+
+  if ((frame[3] & 0xC0) == 0x40)
+  {
+    bound = ((frame[3] >> 4) & 0x03) * 4 + 4;
+  }
+
+  // 16 bits of the header, followed by the bit allocations
+  numbits = 16 + (bound * 2 + (32 - bound)) * 4;
+
+  for (i = 0; i < numbits; i++)
+  {
+    UINT pos = (i < 16 ? 16 + i : 32 + i);
+    UINT bit = (frame[pos >> 3] >> (7 - (pos & 7))) & 1;
+
+    crc = ((crc << 1) ^ ((((crc >> 15) & 1) ^ bit) ? 0x8005 : 0)) & 0xFFFF;
+  }
+
+  return (UINT16)crc;
+}
+
+
+//---------------------------------------------------------------------------
+// Measure the speed of the CRC check
+//
+// The CRC is checked for every frame that has one, so it must be fast
+// compared to the rest of the conversion.
+void
+Benchmark_Crc(
+  LPCBYTE data,                         // 48kHz frames
+  UINT numframes)                       // Number of frames
+{
+  UINT method;
+
+  for (method = 0; method < 2; method++)
+  {
+    UINT checksum = 0;
+    UINT pass;
+    double start;
+    double elapsed;
+
+    start = Benchmark_GetTime();
+
+    for (pass = 0; pass < 16; pass++)
+    {
+      UINT i;
+
+      for (i = 0; i < numframes; i++)
+      {
+        checksum += (method ? Benchmark_GetFrameCrcBitwise(data + i * 384) : GetFrameCrc(data + i * 384));
+      }
+    }
+
+    elapsed = Benchmark_GetTime() - start;
+
+    printf("crc %-14s %10.0f frames/s (checksum %u)\n",
+      (method ? "bitwise" : "table"),
+      (elapsed ? numframes * 16.0 / elapsed : 0.0),
+      checksum);
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Fill a buffer with 48kHz frames that can be decoded
+//
+// The lower 24 subbands of both channels get 2 to 5 bits per sample and
+// random scale factors and samples, which is a lot more than most real
+// frames have.
+UINT                                    // Returns number of frames
+Benchmark_FillAudioFrames(
+  LPBYTE buffer,                        // Buffer to fill
+  UINT size,                            // Number of bytes
+  UINT32 seed)                          // Random seed
+{
+  UINT numframes;
+
+  Benchmark_FillRandom(buffer, size, seed);
+
+  for (numframes = 0; (numframes + 1) * 384 <= size; numframes++)
+  {
+    LPBYTE frame = buffer + numframes * 384;
+    UINT sb;
+
+    frame[0] = 0xFF;
+    frame[1] = 0xFF;
+    frame[2] = 0xC4;
+    frame[3] = 0x0C;
+
+    // Bit allocation for both channels; the scale factors and samples
+    // are random
+    for (sb = 0; sb < 32; sb++)
+    {
+      UINT32 r = Benchmark_Random(&seed);
+
+      frame[4 + sb] = (BYTE)((sb < 24) ? (((r & 3) + 1) << 4) | (((r >> 2) & 3) + 1) : 0);
+    }
+  }
+
+  return numframes;
+}
+
+
+//---------------------------------------------------------------------------
+// Measure the speed of a synthesis filter
+void
+Benchmark_Synthesis(
+  LPCSTR filtername,                    // Name of the filter
+  void (*filter)(FLOAT (*)[64], UINT, const FLOAT *, FLOAT *), // Filter
+  LPCBYTE data)                         // 32 bytes of random data
+{
+  const UINT numblocks = 200000;
+  FLOAT v[16][64];
+  FLOAT samples[32];
+  FLOAT output[32];
+  UINT i;
+  double start;
+  double elapsed;
+
+  memset(v, 0, sizeof(v));
+
+  for (i = 0; i < 32; i++)
+  {
+    samples[i] = ((FLOAT)data[i] - 128.0f) / 256.0f;
+  }
+
+  start = Benchmark_GetTime();
+
+  for (i = 0; i < numblocks; i++)
+  {
+    filter(v, i & 15, samples, output);
+  }
+
+  elapsed = Benchmark_GetTime() - start;
+
+  // The filter runs once per channel for each block of 32 samples, so
+  // real time at 48kHz is 2 * 48000 / 32 blocks per second.
+  printf("synthesis %-8s %10.0f blocks/s %8.1fx real time\n",
+    filtername,
+    (elapsed ? numblocks / elapsed : 0.0),
+    (elapsed ? numblocks / elapsed / (2.0 * 48000 / 32) : 0.0));
+}
+
+
+//---------------------------------------------------------------------------
+// Measure the speed of the Layer 1 decoder
+void
+Benchmark_Decode(
+  LPCBYTE data,                         // 48kHz frames to decode
+  UINT numframes)                       // Number of frames
+{
+  HDECODER hd = NULL;
+  SHORT pcm[SAMPLES_PER_FRAME * 2];
+  UINT i;
+  double start;
+  double elapsed;
+
+  if (!decoder_Create(&hd))
+  {
+    start = Benchmark_GetTime();
+
+    for (i = 0; i < numframes; i++)
+    {
+      decoder_DecodeFrame(hd, data + i * 384, 384, pcm);
+    }
+
+    elapsed = Benchmark_GetTime() - start;
+
+    // Each 48kHz frame is 8ms of audio
+    printf("decode             %10.0f frames/s %8.1fx real time\n",
+      (elapsed ? numframes / elapsed : 0.0),
+      (elapsed ? numframes / elapsed / (48000.0 / SAMPLES_PER_FRAME) : 0.0));
+  }
+
+  decoder_Destroy(hd);
+}
+
+
+//---------------------------------------------------------------------------
+// Fill a buffer with a synthetic MP1 stream
+//
+// The frames have valid headers and random data, so they can be converted
+// but they don't sound like anything. Only whole frames are stored, so a
+// long stream can be generated one block at a time. The seed and the
+// frame number carry over from one block to the next.
+//
+// Dirty streams have garbage between some of the frames, and some frames
+// are cut short, so that the converter loses sync and has to search for
+// the next frame. Those frames aren't counted.
+UINT                                    // Returns number of bytes used
+Benchmark_FillStream(
+  LPBYTE buffer,                        // Buffer to fill
+  UINT size,                            // Number of bytes available
+  const BENCHSTREAM *pstream,           // Kind of stream to generate
+  UINT32 *pseed,                        // Random seed, updated
+  UINT *pnumframes)                     // Number of frames, updated
+{
+  UINT used = 0;
+
+  for (;;)
+  {
+    UINT32 r = Benchmark_Random(pseed);
+    BOOL padded = FALSE;
+    BOOL cut = FALSE;
+    UINT garbage = 0;
+    UINT framesize;
+    BYTE ratebits;
+    LPBYTE frame;
+
+    switch (pstream->rateid)
+    {
+    case RATEID_32000:
+      ratebits = 0x08;
+      framesize = 576;
+      break;
+
+    case RATEID_48000:
+      ratebits = 0x04;
+      framesize = 384;
+      break;
+
+    default:
+      // 24 out of every 49 frames are padded
+      ratebits = 0x00;
+      padded = ((*pnumframes % 49) * 24 / 49) != (((*pnumframes % 49) + 1) * 24 / 49);
+      framesize = (padded ? 420 : 416);
+    }
+
+    if (pstream->dirty)
+    {
+      // About one in 32 frames has up to 1KB of garbage in front of it,
+      // and about one in 64 frames is cut in half
+      if (!(r & 0x1F))
+      {
+        garbage = ((r >> 5) & 0x3FF) + 1;
+      }
+
+      cut = !((r >> 15) & 0x3F);
+    }
+
+    if (used + garbage + framesize > size)
+    {
+      break;
+    }
+
+    Benchmark_FillRandom(buffer + used, garbage + framesize, Benchmark_Random(pseed));
+    used += garbage;
+
+    frame = buffer + used;
+    frame[0] = 0xFF;
+    frame[1] = (BYTE)(pstream->crc ? 0xFE : 0xFF);
+    frame[2] = (BYTE)(0xC0 | ratebits | (padded ? 0x02 : 0x00));
+    frame[3] = 0x0C;
+
+    if (pstream->crc)
+    {
+      UINT16 crc = GetFrameCrc(frame);
+
+      frame[4] = (BYTE)(crc >> 8);
+      frame[5] = (BYTE)crc;
+    }
+
+    if (padded)
+    {
+      if (pstream->padding)
+      {
+        // Make sure the padding slot isn't blank
+        frame[416] |= 0x01;
+      }
+      else
+      {
+        memset(frame + 416, 0, 4);
+      }
+    }
+
+    if (cut)
+    {
+      used += framesize / 2;
+    }
+    else
+    {
+      used += framesize;
+      (*pnumframes)++;
+    }
+  }
+
+  return used;
+}
+
+
+//---------------------------------------------------------------------------
+// Report the result of a benchmark of the conversion functions
+//
+// With --json, each result is a JSON object on a line by itself, so that
+// a script can collect the results and compare them between versions.
+void
+Benchmark_Report(
+  const OPTIONS *poptions,              // Command line options
+  LPCSTR benchmark,                     // Name of the benchmark
+  LPCSTR testname,                      // Name of the test data
+  double bytes,                         // Number of bytes processed
+  double frames,                        // Number of frames processed
+  double elapsed)                       // Time in seconds
+{
+  double mbps = (elapsed ? bytes / elapsed / 1000000.0 : 0.0);
+  double fps = (elapsed ? frames / elapsed : 0.0);
+
+  if (poptions->json)
+  {
+    printf("{\"benchmark\":\"%s\",\"test\":\"%s\",\"bytes\":%.0f,\"frames\":%.0f,"
+      "\"seconds\":%.6f,\"mb_per_s\":%.1f,\"frames_per_s\":%.0f}\n",
+      benchmark,
+      testname,
+      bytes,
+      frames,
+      elapsed,
+      mbps,
+      fps);
+  }
+  else
+  {
+    printf("%-16s %-12s %10.1f MB %10.1f MB/s %12.0f frames/s\n",
+      benchmark,
+      testname,
+      bytes / 1000000.0,
+      mbps,
+      fps);
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Generate the name of a temporary file for the benchmarks
+//
+// The files are stored in the temp directory, or in the current directory
+// if there's no temp directory.
+void
+Benchmark_GetTempName(
+  LPSTR filename,                       // Output MAX_PATH bytes
+  LPCSTR extension)                     // Extension without period
+{
+  DWORD len = GetTempPath(MAX_PATH - 16, filename);
+
+  if ((!len) || (len >= MAX_PATH - 16))
+  {
+    filename[0] = '\0';
+  }
+
+  strcat(filename, "DCCUBNCH."); // safe
+  strcat(filename, extension); // safe
+}
+
+
+//---------------------------------------------------------------------------
+// Delete the temporary files of the benchmarks
+void
+Benchmark_DeleteTempFiles(void)
+{
+  static const LPCSTR extensions[] = { "MP1", "MPP", "LVL", "TRK", "IDX" };
+  CHAR filename[MAX_PATH];
+  UINT i;
+
+  for (i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++)
+  {
+    Benchmark_GetTempName(filename, extensions[i]);
+    DeleteFile(filename);
+  }
+}
+
+
+//---------------------------------------------------------------------------
+// Measure how fast GetFrameSize finds the frames in a stream
+//
+// The stream is walked in the same way as inputstream_CopyFrame does it,
+// so garbage is skipped by searching for the next header.
+void
+Benchmark_FrameSize(
+  const OPTIONS *poptions,              // Command line options
+  LPCSTR testname,                      // Name of the test data
+  LPCBYTE data,                         // MP1 stream
+  UINT size)                            // Number of bytes
+{
+  const UINT numpasses = 16;
+  UINT numframes = 0;
+  UINT pass;
+  double start;
+  double elapsed;
+
+  start = Benchmark_GetTime();
+
+  for (pass = 0; pass < numpasses; pass++)
+  {
+    UINT i = 0;
+
+    for (;;)
+    {
+      UINT framesize;
+      UINT skipsize;
+      RATEID rateid;
+      ERR result = GetFrameSize(data + i, size - i, &framesize, &skipsize, &rateid);
+
+      if (!result)
+      {
+        if (size - i < framesize)
+        {
+          break;
+        }
+
+        i += framesize;
+        numframes++;
+      }
+      else if (result == ERR_INSUFFICIENT_DATA)
+      {
+        break;
+      }
+      else
+      {
+        i += (skipsize ? skipsize : 1);
+      }
+    }
+  }
+
+  elapsed = Benchmark_GetTime() - start;
+
+  Benchmark_Report(poptions, "getframesize", testname, (double)numpasses * size, numframes, elapsed);
+}
+
+
+//---------------------------------------------------------------------------
+// Make a list of the frames in a stream
+//
+// The list has the offset, size and rate of each frame, in that order.
+// The stream is walked in the same way as in Benchmark_FrameSize.
+UINT *                                  // Returns list; NULL=out of memory
+Benchmark_ListFrames(
+  LPCBYTE data,                         // MP1 stream
+  UINT size,                            // Number of bytes
+  UINT *pnumframes)                     // Output number of frames
+{
+  UINT *frames = (UINT *)malloc((size / 384 + 1) * 3 * sizeof(UINT));
+  UINT numframes = 0;
+  UINT i = 0;
+
+  while (frames)
+  {
+    UINT framesize;
+    UINT skipsize;
+    RATEID rateid;
+    ERR result = GetFrameSize(data + i, size - i, &framesize, &skipsize, &rateid);
+
+    if (!result)
+    {
+      if (size - i < framesize)
+      {
+        break;
+      }
+
+      frames[numframes * 3] = i;
+      frames[numframes * 3 + 1] = framesize;
+      frames[numframes * 3 + 2] = rateid;
+      numframes++;
+      i += framesize;
+    }
+    else if (result == ERR_INSUFFICIENT_DATA)
+    {
+      break;
+    }
+    else
+    {
+      i += (skipsize ? skipsize : 1);
+    }
+  }
+
+  *pnumframes = numframes;
+
+  return frames;
+}
+
+
+//---------------------------------------------------------------------------
+// Measure how fast frames are written to an output stream
+//
+// The frames are found before the clock starts, so this only measures
+// outputstream_ProcessFrame. The output buffer is big enough for all the
+// output of a pass, and it's emptied after each pass without writing it,
+// so the speed of the disk doesn't matter. The first pass opens the output
+// file(s), so it isn't timed.
+void
+Benchmark_ProcessFrames(
+  const OPTIONS *poptions,              // Command line options
+  LPCSTR testname,                      // Name of the test data
+  LPCBYTE data,                         // MP1 stream
+  UINT size,                            // Number of bytes
+  BOOL output_is_mpp)                   // TRUE=Generate MPP file
+{
+  const UINT numpasses = 16;
+  HOUTPUTSTREAM hso = NULL;
+  UINT *frames = NULL;
+  UINT numframes = 0;
+  UINT numprocessed = 0;
+  UINT i;
+  UINT pass;
+  CHAR filename[MAX_PATH];
+  double elapsed = 0.0;
+
+  frames = Benchmark_ListFrames(data, size, &numframes);
+
+  // The output file name is generated from the input file name
+  Benchmark_GetTempName(filename, (output_is_mpp ? "MP1" : "MPP"));
+  Benchmark_DeleteTempFiles();
+
+  if ( (frames)
+    && (!outputstream_Create(&hso, filename, output_is_mpp, FALSE, size + size / 64 + MIN_OUTPUT_BUFFER_SIZE, NULL, NULL)))
+  {
+    for (pass = 0; pass <= numpasses; pass++)
+    {
+      double start = Benchmark_GetTime();
+
+      for (i = 0; i < numframes; i++)
+      {
+        const UINT *pframe = frames + i * 3;
+
+        if (outputstream_ProcessFrame(hso, data + pframe[0], pframe[1], (RATEID)pframe[2]))
+        {
+          break;
+        }
+      }
+
+      if (pass)
+      {
+        elapsed += Benchmark_GetTime() - start;
+        numprocessed += i;
+      }
+
+      hso->bufferindex = 0;
+    }
+  }
+
+  outputstream_Destroy(hso);
+  free(frames);
+  Benchmark_DeleteTempFiles();
+
+  Benchmark_Report(poptions, (output_is_mpp ? "processframe-mpp" : "processframe-mp1"), testname, (double)numpasses * size, numprocessed, elapsed);
+}
+
+
+//---------------------------------------------------------------------------
+// Make an MPP stream of which the frames still have their CRCs
+//
+// DCC-Studio stores frames with a CRC as they are, but the MP1 to MPP
+// conversion always leaves the CRCs out, so this is needed to test the
+// conversion of such frames to MP1. The MP1 data that the conversion
+// should produce is generated at the same time: each frame without its
+// CRC, followed by 2 zero bytes so that it keeps its size. Both buffers
+// must have room for size + size / 64 + 2 bytes.
+void
+Benchmark_FillCrcMpp(
+  LPCBYTE data,                         // MP1 stream
+  UINT size,                            // Number of bytes
+  LPBYTE mppdata,                       // Output MPP stream
+  UINT *pmppsize,                       // Output size of MPP stream
+  LPBYTE expected,                      // Output expected MP1 stream
+  UINT *pexpectedsize)                  // Output size of MP1 stream
+{
+  UINT numframes = 0;
+  UINT *frames = Benchmark_ListFrames(data, size, &numframes);
+  UINT mppsize = 2;
+  UINT expectedsize = 0;
+  UINT i;
+
+  for (i = 0; (frames) && (i < numframes); i++)
+  {
+    LPCBYTE frame = data + frames[i * 3];
+    UINT framesize = frames[i * 3 + 1];
+    UINT stride = GetMppStride((RATEID)frames[i * 3 + 2]);
+
+    if (!i)
+    {
+      mppdata[0] = (BYTE)frames[2];
+      mppdata[1] = 0;
+    }
+
+    memcpy(mppdata + mppsize, frame, framesize);
+    memset(mppdata + mppsize + framesize, 0, stride - framesize);
+    mppsize += stride;
+
+    if (!(frame[1] & 0x01))
+    {
+      memcpy(expected + expectedsize, frame, 4);
+      expected[expectedsize + 1] |= 0x01;
+      memcpy(expected + expectedsize + 4, frame + 6, framesize - 6);
+      memset(expected + expectedsize + framesize - 2, 0, 2);
+    }
+    else
+    {
+      memcpy(expected + expectedsize, frame, framesize);
+    }
+
+    expectedsize += framesize;
+  }
+
+  free(frames);
+
+  *pmppsize = (numframes ? mppsize : 0);
+  *pexpectedsize = expectedsize;
+}
+
+
+//---------------------------------------------------------------------------
+// Measure how fast frames are copied from an input stream to an output
+// stream
+//
+// The input stream reads the data from memory, as if it's a memory mapped
+// file. See Benchmark_ProcessFrames for the output stream.
+//
+// If an output buffer is given, the output of the last pass is stored
+// there, so MP1 data can be converted to MPP data to test the other
+// direction, or so that the MP1 output can be checked. The output buffer
+// must have room for size + size / 64 + 2 bytes.
+void
+Benchmark_CopyFrames(
+  const OPTIONS *poptions,              // Command line options
+  LPCSTR testname,                      // Name of the test data
+  LPCBYTE data,                         // MP1 or MPP stream
+  UINT size,                            // Number of bytes
+  BOOL input_is_mpp,                    // TRUE=Input is MPP
+  LPBYTE outdata,                       // Output buffer (NULL=none)
+  UINT *poutsize)                       // Output size (NULL=none)
+{
+  const UINT numpasses = 16;
+  HINPUTSTREAM hsi = NULL;
+  HOUTPUTSTREAM hso = NULL;
+  UINT numframes = 0;
+  UINT pass;
+  CHAR filename[MAX_PATH];
+  double elapsed = 0.0;
+
+  Benchmark_GetTempName(filename, (input_is_mpp ? "MPP" : "MP1"));
+  Benchmark_DeleteTempFiles();
+
+  if ( ((hsi = (HINPUTSTREAM)calloc(1, sizeof(INPUTSTREAM))) != NULL)
+    && (!outputstream_Create(&hso, filename, !input_is_mpp, FALSE, size + size / 64 + MIN_OUTPUT_BUFFER_SIZE, NULL, NULL)))
+  {
+    for (pass = 0; pass <= numpasses; pass++)
+    {
+      double start;
+      UINT n = hso->numframes;
+
+      memset(hsi, 0, sizeof(INPUTSTREAM));
+      hsi->data = (LPBYTE)data;
+      hsi->endindex = size;
+      hsi->rateid = RATEID_UNKNOWN;
+      hsi->is_mpp = input_is_mpp;
+
+      hso->bufferindex = 0;
+
+      start = Benchmark_GetTime();
+
+      while (!inputstream_CopyFrames(hsi, hso))
+      {
+      }
+
+      n = hso->numframes - n;
+
+      if (pass)
+      {
+        elapsed += Benchmark_GetTime() - start;
+        numframes += n;
+      }
+    }
+
+    if ((outdata) && (poutsize) && (input_is_mpp))
+    {
+      memcpy(outdata, hso->data, hso->bufferindex);
+      *poutsize = hso->bufferindex;
+    }
+    else if ((outdata) && (poutsize))
+    {
+      // The MPP header was only written in the first pass
+      outdata[0] = (BYTE)hso->rateid;
+      outdata[1] = 0;
+      memcpy(outdata + 2, hso->data, hso->bufferindex);
+      *poutsize = hso->bufferindex + 2;
+    }
+
+    hso->bufferindex = 0;
+  }
+
+  outputstream_Destroy(hso);
+  inputstream_Destroy(hsi);
+  Benchmark_DeleteTempFiles();
+
+  Benchmark_Report(poptions, (input_is_mpp ? "copyframe-mp1" : "copyframe-mpp"), testname, (double)numpasses * size, numframes, elapsed);
+}
+
+
+//---------------------------------------------------------------------------
+// Check a frame index and measure how fast frames are found in it
+//
+// The stream is stored as an MP1 file and converted with --index. Then
+// the index is loaded from the index file, and every frame that
+// GetFrameSize finds in the stream is looked up with frameindex_GetFrame
+// in random order. The offset and size must be the same.
+ERR                                     // Returns error code
+Benchmark_FrameIndex(
+  const OPTIONS *poptions,              // Command line options
+  LPCSTR testname,                      // Name of the test data
+  LPCBYTE data,                         // MP1 stream
+  UINT size)                            // Number of bytes
+{
+  const UINT numpasses = 16;
+  ERR result = ERR_OK;
+  OPTIONS options;
+  HFRAMEINDEX hfi = NULL;
+  UINT *frames = NULL;
+  UINT32 *order = NULL;
+  UINT numframes = 0;
+  UINT numlookups = 0;
+  UINT32 seed = 7;
+  UINT i;
+  UINT pass;
+  CHAR mp1name[MAX_PATH];
+  CHAR indexname[MAX_PATH];
+  double elapsed = 0.0;
+
+  options = *poptions;
+  options.index = TRUE;
+
+  Benchmark_GetTempName(mp1name, "MP1");
+  Benchmark_GetTempName(indexname, "IDX");
+  Benchmark_DeleteTempFiles();
+
+  if (!result)
+  {
+    if ( (!(frames = Benchmark_ListFrames(data, size, &numframes)))
+      || (!(order = (UINT32 *)malloc((numframes + 1) * sizeof(UINT32)))))
+    {
+      result = ERR_MALLOC;
+    }
+  }
+
+  if (!result)
+  {
+    FILE *f = fopen(mp1name, "wb");
+
+    if ((!f) || (!fwrite(data, size, 1, f)))
+    {
+      result = ERR_OUTPUT_FILE_WRITE;
+    }
+
+    if (f)
+    {
+      fclose(f);
+    }
+  }
+
+  if (!result)
+  {
+    result = ProcessFile(mp1name, TRUE, FALSE, options.numthreads, NULL, NULL, NULL, &options);
+  }
+
+  if (!result)
+  {
+    result = frameindex_Create(&hfi);
+  }
+
+  if (!result)
+  {
+    result = frameindex_Load(hfi, indexname, mp1name);
+  }
+
+  if ((!result) && (hfi->numframes != numframes))
+  {
+    result = ERR_INDEX_INVALID;
+  }
+
+  // Shuffle the frame numbers, so that every frame is looked up once
+  // in each pass
+  for (i = 0; (!result) && (i < numframes); i++)
+  {
+    UINT j = Benchmark_Random(&seed) % (i + 1);
+
+    order[i] = order[j];
+    order[j] = i;
+  }
+
+  for (pass = 0; (!result) && (pass < numpasses); pass++)
+  {
+    double start = Benchmark_GetTime();
+
+    for (i = 0; (!result) && (i < numframes); i++)
+    {
+      const UINT *pframe = frames + order[i] * 3;
+      UINT64 offset;
+      UINT framesize;
+
+      if ( (frameindex_GetFrame(hfi, order[i], &offset, &framesize))
+        || (offset != pframe[0])
+        || (framesize != pframe[1]))
+      {
+        result = ERR_INDEX_INVALID;
+      }
+    }
+
+    elapsed += Benchmark_GetTime() - start;
+    numlookups += i;
+  }
+
+  if (result == ERR_INDEX_INVALID)
+  {
+    Console_Printf("The frame index of the %s stream doesn't match the frames\n", testname);
+  }
+
+  frameindex_Destroy(hfi);
+  free(order);
+  free(frames);
+  Benchmark_DeleteTempFiles();
+
+  if (!result)
+  {
+    Benchmark_Report(poptions, "frameindex", testname, (double)numpasses * size, numlookups, elapsed);
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Measure how fast files are converted from start to finish
+//
+// An MP1 file is generated in the temp directory and converted to MPP, and
+// the MPP file is converted back to MP1. With -j, the MPP file is
+// converted in parts. The time includes opening, reading, writing and
+// closing the files, so the results depend on the disk and the file cache.
+ERR                                     // Returns error code
+Benchmark_Files(
+  const OPTIONS *poptions,              // Command line options
+  LPCSTR testname,                      // Name of the test data
+  const BENCHSTREAM *pstream,           // Kind of stream to generate
+  UINT64 size,                          // File size to generate
+  LPBYTE buffer,                        // Buffer to generate the stream
+  UINT buffersize)                      // Size of buffer
+{
+  ERR result = ERR_OK;
+  OPTIONS options;
+  CHAR mp1name[MAX_PATH];
+  CHAR mppname[MAX_PATH];
+  UINT64 mp1size = 0;
+  UINT64 mppsize = 0;
+  UINT64 filetime;
+  UINT numframes = 0;
+  UINT32 seed = 6;
+  double start;
+  double elapsed;
+
+  // Don't leave an index in the temp directory
+  options = *poptions;
+  options.index = FALSE;
+
+  Benchmark_GetTempName(mp1name, "MP1");
+  Benchmark_GetTempName(mppname, "MPP");
+  Benchmark_DeleteTempFiles();
+
+  if (!result)
+  {
+    FILE *f = fopen(mp1name, "wb");
+
+    if (!f)
+    {
+      result = ERR_OUTPUT_FILE_OPEN;
+    }
+
+    while ((!result) && (mp1size < size))
+    {
+      UINT used = Benchmark_FillStream(buffer, (size - mp1size < buffersize ? (UINT)(size - mp1size) : buffersize), pstream, &seed, &numframes);
+
+      if (!used)
+      {
+        break;
+      }
+
+      if (!fwrite(buffer, used, 1, f))
+      {
+        result = ERR_OUTPUT_FILE_WRITE;
+      }
+
+      mp1size += used;
+    }
+
+    if (f)
+    {
+      fclose(f);
+    }
+  }
+
+  if (!result)
+  {
+    start = Benchmark_GetTime();
+    result = ProcessFile(mp1name, TRUE, FALSE, options.numthreads, NULL, NULL, NULL, &options);
+    elapsed = Benchmark_GetTime() - start;
+
+    Benchmark_Report(poptions, "file-mpp", testname, (double)(INT64)mp1size, numframes, elapsed);
+  }
+
+  if (!result)
+  {
+    // Only keep the MPP file
+    Benchmark_GetTempName(mp1name, "LVL");
+    DeleteFile(mp1name);
+    Benchmark_GetTempName(mp1name, "TRK");
+    DeleteFile(mp1name);
+    Benchmark_GetTempName(mp1name, "MP1");
+    DeleteFile(mp1name);
+
+    GetFileInfo(mppname, &mppsize, &filetime);
+
+    start = Benchmark_GetTime();
+    result = ProcessFile(mppname, FALSE, FALSE, options.numthreads, NULL, NULL, NULL, &options);
+    elapsed = Benchmark_GetTime() - start;
+
+    Benchmark_Report(poptions, "file-mp1", testname, (double)(INT64)mppsize, numframes, elapsed);
+  }
+
+  Benchmark_DeleteTempFiles();
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Run the benchmarks of the conversion functions on synthetic streams
+//
+// Every kind of stream is tested in memory first, and then converted as a
+// file in several sizes, up to the size that's given with
+// --benchmark-size.
+ERR                                     // Returns error code
+Benchmark_Conversion(
+  const OPTIONS *poptions)              // Command line options
+{
+  static const BENCHSTREAM streams[] =
+  {
+    { "32k",            RATEID_32000, FALSE, FALSE, FALSE },
+    { "44k",            RATEID_44100, FALSE, FALSE, FALSE },
+    { "48k",            RATEID_48000, FALSE, FALSE, FALSE },
+    { "44k-crc",        RATEID_44100, TRUE,  FALSE, FALSE },
+    { "44k-padding",    RATEID_44100, FALSE, TRUE,  FALSE },
+    { "44k-dirty",      RATEID_44100, TRUE,  TRUE,  TRUE  },
+    { "48k-dirty",      RATEID_48000, FALSE, FALSE, TRUE  },
+  };
+  const UINT size = 4 * 1024 * 1024;
+  const UINT mppsize = size + size / 64 + 2;
+  ERR result = ERR_OK;
+  LPBYTE data = NULL;
+  LPBYTE mppdata = NULL;
+  LPBYTE mp1data = NULL;
+  LPBYTE expected = NULL;
+  UINT i;
+
+  if (!result)
+  {
+    if ( (!(data = (LPBYTE)malloc(size)))
+      || (!(mppdata = (LPBYTE)malloc(mppsize)))
+      || (!(mp1data = (LPBYTE)malloc(mppsize)))
+      || (!(expected = (LPBYTE)malloc(mppsize))))
+    {
+      result = ERR_MALLOC;
+    }
+  }
+
+  for (i = 0; (!result) && (i < sizeof(streams) / sizeof(streams[0])); i++)
+  {
+    UINT32 seed = 5;
+    UINT numframes = 0;
+    UINT used = Benchmark_FillStream(data, size, &streams[i], &seed, &numframes);
+    UINT mppused = 0;
+
+    Benchmark_FrameSize(poptions, streams[i].name, data, used);
+    Benchmark_ProcessFrames(poptions, streams[i].name, data, used, TRUE);
+    Benchmark_ProcessFrames(poptions, streams[i].name, data, used, FALSE);
+    Benchmark_CopyFrames(poptions, streams[i].name, data, used, FALSE, mppdata, &mppused);
+    Benchmark_CopyFrames(poptions, streams[i].name, mppdata, mppused, TRUE, NULL, NULL);
+
+    if (streams[i].crc)
+    {
+      // Convert an MPP stream with CRCs to MP1 and check the result
+      CHAR testname[32];
+      UINT mp1used = 0;
+      UINT expectedused = 0;
+
+      sprintf(testname, "%s-mpp", streams[i].name); // safe
+
+      Benchmark_FillCrcMpp(data, used, mppdata, &mppused, expected, &expectedused);
+      Benchmark_CopyFrames(poptions, testname, mppdata, mppused, TRUE, mp1data, &mp1used);
+
+      if ((mp1used != expectedused) || (memcmp(mp1data, expected, mp1used)))
+      {
+        Console_Printf("The MP1 output of the %s stream doesn't match the frames\n", testname);
+        result = ERR_INTERNAL;
+      }
+    }
+
+    if (!result)
+    {
+      result = Benchmark_FrameIndex(poptions, streams[i].name, data, used);
+    }
+  }
+
+  for (i = 0; (!result) && (i < sizeof(streams) / sizeof(streams[0])); i++)
+  {
+    // From a few frames to the largest size
+    static const UINT64 sizes[] = { 64 * 1024, 4 * 1024 * 1024, 0 };
+    UINT s;
+
+    for (s = 0; (!result) && (s < sizeof(sizes) / sizeof(sizes[0])); s++)
+    {
+      UINT64 filesize = (sizes[s] ? sizes[s] : (UINT64)poptions->benchmarksize * 1024 * 1024);
+
+      result = Benchmark_Files(poptions, streams[i].name, &streams[i], filesize, data, size);
+    }
+  }
+
+  free(expected);
+  free(mp1data);
+  free(mppdata);
+  free(data);
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Run the benchmarks
+//
+// The benchmarks of the building blocks (header scanners, synthesis
+// filters etc.) compare different implementations, so they're only
+// shown as text. The conversion benchmarks can be reported as JSON.
+ERR                                     // Returns error code
+Benchmark(
+  const OPTIONS *poptions)              // Command line options
+{
+  ERR result = ERR_OK;
+  const UINT size = 16 * 1024 * 1024;
+  LPBYTE data = NULL;
+
+  if (!result)
+  {
+    if (!(data = (LPBYTE)malloc(size)))
+    {
+      result = ERR_MALLOC;
+    }
+  }
+
+  if ((!result) && (!poptions->json))
+  {
+    UINT test;
+
+    for (test = 0; test < 2; test++)
+    {
+      LPCSTR testname;
+
+      if (!test)
+      {
+        testname = "random";
+        Benchmark_FillRandom(data, size, 1);
+      }
+      else
+      {
+        testname = "corrupted";
+        Benchmark_FillCorrupted(data, size, 2);
+      }
+
+      Benchmark_Scan(testname, "bytewise", Benchmark_FindHeaderBytewise, data, size);
+      Benchmark_Scan(testname, "scalar", FindHeader_Scalar, data, size);
+#ifdef DCCU_SSE2
+      Benchmark_Scan(testname, "SSE2", FindHeader_SSE2, data, size);
+#endif
+#ifdef DCCU_AVX2
+      Benchmark_Scan(testname, "AVX2", FindHeader_AVX2, data, size);
+#endif
+    }
+  }
+
+  if ((!result) && (!poptions->json))
+  {
+    // Use a small part of the buffer so it fits in the cache
+    Benchmark_FillFrames(data, 256 * 1024, 3);
+    Benchmark_Headers("frames", data, 256 * 1024, TRUE);
+
+    Benchmark_FillHeaders(data, 64 * 1024, 4);
+    Benchmark_Headers("mixed", data, 64 * 1024, FALSE);
+  }
+
+  if ((!result) && (!poptions->json))
+  {
+    UINT numframes = Benchmark_FillAudioFrames(data, 4 * 1024 * 1024, 5);
+
+    Benchmark_Synthesis("scalar", Synthesis_Scalar, data + 4);
+#ifdef DCCU_SSE2
+    Benchmark_Synthesis("SSE2", Synthesis_SSE2, data + 4);
+#endif
+    Benchmark_Decode(data, numframes);
+    Benchmark_Crc(data, numframes);
+  }
+
+  if (!result)
+  {
+    result = Benchmark_Conversion(poptions);
+  }
+
+  free(data);
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Parse a number on the command line
+//
+// Only decimal digits are accepted, so that e.g. a negative number or a
+// number followed by other text is rejected instead of being turned into
+// some other value.
+BOOL                                    // Returns FALSE if invalid
+ParseNumber(
+  LPCSTR s,                             // Text to parse
+  UINT minimum,                         // Lowest valid value
+  UINT maximum,                         // Highest valid value
+  UINT *pvalue)                         // Output value
+{
+  BOOL result = ((*s >= '0') && (*s <= '9'));
+  UINT value = 0;
+
+  for (; (result) && (*s); s++)
+  {
+    UINT digit = (UINT)(*s - '0');
+
+    if ( (*s < '0')
+      || (*s > '9')
+      || (digit > maximum)
+      || (value > (maximum - digit) / 10))
+    {
+      result = FALSE;
+    }
+    else
+    {
+      value = value * 10 + digit;
+    }
+  }
+
+  if ((result) && (value < minimum))
+  {
+    result = FALSE;
+  }
+
+  if (result)
+  {
+    *pvalue = value;
+  }
+
+  return result;
+}
+
+
+//---------------------------------------------------------------------------
+// Main program
+int main(int argc, char *argv[])
+{
+  int result = 0;
+  int firstfile = 1;
+  BOOL benchmark = FALSE;
+  OPTIONS options;
+
+  memset(&options, 0, sizeof(options));
+  options.outbuffersize = OUTPUT_BUFFER_SIZE;
+  options.numthreads = 1;
+  options.benchmarksize = 64;
+
+  HeaderTable_Init();
+  CrcTable_Init();
+  SynthesisTables_Init();
+  InitializeCriticalSection(&ConsoleLock);
+
+  fprintf(stderr, 
+    "DCCU File Conversion Utility for DCC-Studio\n"
+    "Version 3.4\n"
+    "(C) 2020-2022 Jac Goudsmit\n"
+    "Licensed under the MIT license.\n"
+    "\n");
+
+  if (argc < 2)
+  {
+    fprintf(stderr, 
+      "This program converts MPP files (used by DCC-Studio) to MP1 (MPEG 1 Layer 1)\n"
+      "and vice versa.\n"
+      "\n"
+      "Syntax: DCCU [options] inputfile|directory [inputfile|directory...]\n"
+      "        DCCU --benchmark [--json] [--benchmark-size <n>] [-j <n>]\n"
+      "\n"
+      "Options:\n"
+      "-j <n>         Convert up to n files at the same time (default 1)\n"
+      "-r             Search subdirectories of directories and wildcards\n"
+      "--buffer <n>   Size of the output buffer in KB (default %u)\n"
+      "--wav          Decode to .WAV files instead of converting\n"
+      "--index        Save a frame index (.IDX) of each .MP1 input file\n"
+      "--cache <file> Skip files that didn't change since they were converted\n"
+      "--to <type>    Type of output for standard input: mpp, mp1 or wav\n"
+      "--stats        Show statistics of each file and of the batch as JSON\n"
+      "--no-crc-check Don't check the CRCs of frames that have one\n"
+      "--pipeline     Read and write files in separate threads\n"
+      "--overlapped   Same, with several reads and writes at once\n"
+      "--unbuffered   Same, reading without the file cache\n"
+      "--json         Show the conversion benchmark results as JSON\n"
+      "--benchmark-size <n> Size of the largest benchmark file in MB (default 64)\n"
+      "\n"
+      "You can convert multiple files at a time by putting multiple file names on\n"
+      "the command line. The output file name(s) is/are generated from the input\n"
+      "file names by changing the file extension from \".MPP\" to \".MP1\" or\n"
+      "from \".MP1\" to \".MPP\".\n"
+      "\n"
+      "Input file names can contain wildcards (* and ?). A directory name converts\n"
+      "all .MP1 and .MPP files in the directory; with -r, subdirectories too.\n"
+      "\n"
+      "If the input file name is \"-\", the program reads from standard input and\n"
+      "writes to standard output, e.g. DCCU --to mp1 - < IN.MPP > OUT.MP1. The\n"
+      "--to option tells what to convert to; the input must be MP1 data for\n"
+      "--to mpp and MPP data for --to mp1. No .LVL or .TRK file is generated.\n"
+      "\n"
+      "A .TRK file is converted to an .MP1 file with the audio of the track. Only\n"
+      "the parts of the .MPP files that are used by the track are read.\n"
+      "\n"
+      "When converting to .MPP, the program also generates a .LVL and a .TRK file.\n"
+      "Those are necessary to import the audio into the DCC-Studio. The levels in\n"
+      "the .LVL file are estimated from the scale factors in the MP1 frames, so\n"
+      "the DCC Studio wave editor shows an approximation of the audio levels.\n"
+      "\n"
+      "When converting a 44.1 kHz .MP1 file to .MPP, the program checks for padding\n"
+      "slots that aren't blank. Padding slots occur in the audio stream because\n"
+      "384000 / 44100 is not an integer. In a 44.1 kHz PASC/MP1 stream, 24 out of\n"
+      "every 49 frames have an extra slot (105 slots instead of 104 slots per\n"
+      "frame). In MP1, that slot may contain audio data, however in PASC the padding\n"
+      "slot is a dummy slot and must be blank to avoid decoding problems. The program\n"
+      "clears the padding slot and notes in the output that it happened, because\n"
+      "the audio data was changed and a minor amount of audio accuracy may have been\n"
+      "lost at the highest frequencies.\n"
+      "\n"
+      "Frames that have a CRC are checked, and frames with a bad CRC are reported\n"
+      "with their frame number (starting at 0) and file offset. The frames are\n"
+      "converted anyway. The CRC is always removed in the output.\n"
+      "\n",
+      OUTPUT_BUFFER_SIZE / 1024);
+
+    result = ERR_COMMAND;
+  }
+
+  if (!result)
+  {
+    // Process the options. These must precede the input file names.
+    for (firstfile = 1; firstfile < argc; firstfile++)
+    {
+      LPCSTR option = argv[firstfile];
+
+      // A single dash is a file name (standard input)
+      if ((option[0] != '-') || (!option[1]))
+      {
+        break;
+      }
+
+      if (!strcmp(option, "--benchmark"))
+      {
+        benchmark = TRUE;
+      }
+      else if ((!strcmp(option, "-j")) && (firstfile + 1 < argc))
+      {
+        // Number of files to convert at the same time
+        if (!ParseNumber(argv[++firstfile], 1, MAX_THREADS, &options.numthreads))
+        {
+          fprintf(stderr, "Number of threads must be 1 to %u\n", MAX_THREADS);
+          result = ERR_COMMAND;
+          break;
+        }
+      }
+      else if (!strcmp(option, "--wav"))
+      {
+        // Decode MPP or MP1 files to WAV
+        options.wav = TRUE;
+      }
+      else if ((!strcmp(option, "-r")) || (!strcmp(option, "--recursive")))
+      {
+        // Search subdirectories of directories and wildcards
+        options.recursive = TRUE;
+      }
+      else if (!strcmp(option, "--stats"))
+      {
+        // Statistics per file and per batch
+        options.stats = TRUE;
+      }
+      else if (!strcmp(option, "--pipeline"))
+      {
+        // Reader and writer threads for each file
+        options.pipeline = TRUE;
+      }
+      else if (!strcmp(option, "--overlapped"))
+      {
+        // Overlapped I/O in the reader and writer threads
+        options.pipeline = TRUE;
+        options.overlapped = TRUE;
+      }
+      else if (!strcmp(option, "--unbuffered"))
+      {
+        // Overlapped I/O, and read the input without the file cache
+        options.pipeline = TRUE;
+        options.overlapped = TRUE;
+        options.unbuffered = TRUE;
+      }
+      else if (!strcmp(option, "--no-crc-check"))
+      {
+        // Don't report frames with bad CRCs
+        options.nocrccheck = TRUE;
+      }
+      else if (!strcmp(option, "--json"))
+      {
+        // Benchmark results as JSON, one object per line
+        options.json = TRUE;
+      }
+      else if ((!strcmp(option, "--benchmark-size")) && (firstfile + 1 < argc))
+      {
+        // Size of the largest file for the conversion benchmarks in MB
+        if (!ParseNumber(argv[++firstfile], 1, (UINT)-1, &options.benchmarksize))
+        {
+          fprintf(stderr, "Benchmark size must be 1 to %u MB\n", (UINT)-1);
+          result = ERR_COMMAND;
+          break;
+        }
+      }
+      else if (!strcmp(option, "--index"))
+      {
+        // Save an index of MP1 files while reading them
+        options.index = TRUE;
+      }
+      else if ((!strcmp(option, "--cache")) && (firstfile + 1 < argc))
+      {
+        // Remember converted files, and skip them if they didn't change
+        options.cache = argv[++firstfile];
+      }
+      else if ((!strcmp(option, "--to")) && (firstfile + 1 < argc))
+      {
+        // Type of output for standard input
+        options.to = argv[++firstfile];
+
+        if ( (stricmp(options.to, "MPP"))
+          && (stricmp(options.to, "MP1"))
+          && (stricmp(options.to, "WAV")))
+        {
+          fprintf(stderr, "Output type must be mpp, mp1 or wav\n");
+          result = ERR_COMMAND;
+          break;
+        }
+      }
+      else if ((!strcmp(option, "--buffer")) && (firstfile + 1 < argc))
+      {
+        // Output buffer size in KB
+        if (!ParseNumber(argv[++firstfile], MIN_OUTPUT_BUFFER_SIZE / 1024, (UINT)-1 / 1024, &options.outbuffersize))
+        {
+          fprintf(stderr, "Output buffer must be %u to %u KB\n", MIN_OUTPUT_BUFFER_SIZE / 1024, (UINT)-1 / 1024);
+          result = ERR_COMMAND;
+          break;
+        }
+
+        options.outbuffersize *= 1024;
+      }
+      else
+      {
+        fprintf(stderr, "Unknown option %s\n", option);
+        result = ERR_COMMAND;
+        break;
+      }
+    }
+  }
+
+  if ((!result) && (!benchmark))
+  {
+    // Standard input can only be used once, and only with --to
+    int i;
+    UINT numstdio = 0;
+
+    for (i = firstfile; i < argc; i++)
+    {
+      if (!strcmp(argv[i], STDIO_FILENAME))
+      {
+        numstdio++;
+      }
+    }
+
+    if ((numstdio > 1) || ((numstdio) && (!options.to)))
+    {
+      fprintf(stderr, "Standard input (-) can be used once, with the --to option\n");
+      result = ERR_COMMAND;
+    }
+  }
+
+  if ((!result) && (benchmark))
+  {
+    // Measure the speed of the program, instead of converting files
+    result = Benchmark(&options);
+  }
+
+  if ((!result) && (!benchmark) && (firstfile < argc))
+  {
+    JOBQUEUE queue;
+
+    result = JobQueue_Init(&queue, &options);
+
+    if (!result)
+    {
+      ERR finishresult;
+      int i;
+
+      // Files are converted while directories are still being searched
+      for (i = firstfile; (i < argc) && (!result); i++)
+      {
+        result = JobQueue_AddPath(&queue, argv[i]);
+      }
+
+      // Set result to first error that appeared
+      finishresult = JobQueue_Finish(&queue);
+
+      if (!result)
+      {
+        result = finishresult;
+      }
+
+      JobQueue_Destroy(&queue);
+    }
+  }
+
+  DeleteCriticalSection(&ConsoleLock);
+
+  return result;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// END
+/////////////////////////////////////////////////////////////////////////////